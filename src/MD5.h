@@ -1,7 +1,12 @@
 #ifndef MD5_h
 #define MD5_h
 
+#ifdef ARDUINO
 #include "Arduino.h"
+#else
+#include <stdint.h>
+#include <stdlib.h>
+#endif
 
 /*
  * This is an OpenSSL-compatible implementation of the RSA Data Security,
@@ -27,7 +32,7 @@
 
 #include <string.h>
 
-typedef unsigned long MD5_u32plus;
+typedef uint32_t MD5_u32plus;
 
 typedef struct {
     MD5_u32plus lo, hi;
@@ -2,17 +2,22 @@
 
 #include <Arduino.h>
 #include "./MD5.h"
+#include "./nota_protocol.h"
+#include "./nota_receiver.h"
 #include <stdarg.h>
+#include <new>
+#include "./utility/nota_global.h"
 
 #if defined(ESP8266) || defined(ESP32) || defined(ARDUINO_ARCH_ESP8266) || defined(ARDUINO_ARCH_ESP32)
-#ifndef ESP
-#define ESP
-#endif // ESP
+#ifndef NOTA_ESP
+#define NOTA_ESP
+#endif // NOTA_ESP
 #elif defined(STM32) || defined(ARDUINO_ARCH_STM32)
 #ifndef ARDUINO_ARCH_STM32
 #define ARDUINO_ARCH_STM32
 #endif // ARDUINO_ARCH_STM32
 #include "./utility/internal_flash.h"
+#include "./utility/data_partition.h"
 #else // UNKOWN PLATFORM
 #error "Unknown platform"
 #endif
@@ -27,10 +32,14 @@
 #include <WiFi.h>
 #include "Update.h"
 #include <WiFiUdp.h>
+#include "esp_ota_ops.h"
+#include "nvs.h"
 // ARDUINO_ARCH_STM32
 #elif defined(ARDUINO_ARCH_STM32)
 // Use the Ethernet library for STM32 with ArduinoOTA
 #include <Ethernet.h>
+#include <SPI.h>
+#include <utility/w5100.h>
 
 #define UPDATE_ERROR_OK                 (0)
 #define UPDATE_ERROR_WRITE              (1)
@@ -55,14 +64,169 @@
 #define U_TEST    201
 #endif
 
+#ifndef U_TEST
+#define U_TEST    NOTA_CMD_TEST
+#endif
+#define U_QUERY   NOTA_CMD_QUERY
+#define U_BLOCKS  NOTA_CMD_BLOCKS
+#define U_MULTI   NOTA_CMD_MULTI
+#define U_CONFIG  NOTA_CMD_CONFIG
+
 #ifndef ENV
 #define __XENV(x) #x
 #define ENV(x) __XENV(x)
 #endif /* ENV */
 
-#define NOTA_VERSION "0.0.3"
+// Log levels. Define NOTA_LOG_LEVEL before including NOTA.h, messages above it compile to nothing
+#define NOTA_LOG_NONE     0
+#define NOTA_LOG_ERROR    1
+#define NOTA_LOG_WARN     2
+#define NOTA_LOG_INFO     3
+#define NOTA_LOG_DEBUG    4
+#define NOTA_LOG_VERBOSE  5
+#ifndef NOTA_LOG_LEVEL
+#define NOTA_LOG_LEVEL NOTA_LOG_INFO
+#endif
+
+// RAM footprint. NOTA_FOOTPRINT_SMALL trims the default buffer sizes for targets with little RAM (STM32F0/F1, ESP8266),
+// each size can still be set on its own. Define NOTA_RAM_BUDGET (bytes) to fail the build when the OTA object grows past it.
+// tools/nota-footprint.py reports the static RAM and worst-case stack use of a build
+#ifdef NOTA_FOOTPRINT_SMALL
+#ifndef NOTA_LOG_LINE_SIZE
+#define NOTA_LOG_LINE_SIZE 80
+#endif
+#ifndef NOTA_CONFIG_MAX_SIZE
+#define NOTA_CONFIG_MAX_SIZE 1024
+#endif
+#ifndef NOTA_TEMP_SIZE
+#define NOTA_TEMP_SIZE 80
+#endif
+#ifndef NOTA_REPLY_SIZE
+#define NOTA_REPLY_SIZE 192
+#endif
+#ifndef NOTA_PACKET_SIZE
+#define NOTA_PACKET_SIZE 384
+#endif
+#ifndef NOTA_COPY_SIZE
+#define NOTA_COPY_SIZE 256
+#endif
+#endif // NOTA_FOOTPRINT_SMALL
+
+// Scratch arena buffers, see nota_scratch_t: short texts, handshake replies, discovery datagrams and data copies
+#ifndef NOTA_TEMP_SIZE
+#define NOTA_TEMP_SIZE 128
+#endif
+#ifndef NOTA_REPLY_SIZE
+#define NOTA_REPLY_SIZE 256
+#endif
+#ifndef NOTA_PACKET_SIZE
+#define NOTA_PACKET_SIZE 1024
+#endif
+#ifndef NOTA_COPY_SIZE
+#define NOTA_COPY_SIZE 1024
+#endif
+
+// Size of the RAM log ring in bytes. When non-zero, log messages are queued instead of written out
+// and handle() drains the ring outside of the receive loop. Single producer only
+#ifndef NOTA_LOG_RING_SIZE
+#define NOTA_LOG_RING_SIZE 0
+#endif
+#ifndef NOTA_LOG_LINE_SIZE
+#define NOTA_LOG_LINE_SIZE 128
+#endif
+
+// Parts of a multi-part session and the largest config part, which is kept in RAM until the session commits
+#ifndef NOTA_MAX_PARTS
+#define NOTA_MAX_PARTS 4
+#endif
+#ifndef NOTA_CONFIG_MAX_SIZE
+#define NOTA_CONFIG_MAX_SIZE 4096
+#endif
+
+// Multicast transfer (NOTA_MULTICAST): a session is dropped after this long without a packet from the host
+#ifndef NOTA_MC_TIMEOUT
+#define NOTA_MC_TIMEOUT 30000
+#endif
+
+// Relay (NOTA_RELAY): peers collected by one discovery round, largest fan-out a request may ask for,
+// and how long a peer may take to answer a step of the upload
+#ifndef NOTA_RELAY_MAX_PEERS
+#define NOTA_RELAY_MAX_PEERS 16
+#endif
+#ifndef NOTA_RELAY_MAX_FANOUT
+#define NOTA_RELAY_MAX_FANOUT 8
+#endif
+#ifndef NOTA_RELAY_TIMEOUT
+#define NOTA_RELAY_TIMEOUT 10000
+#endif
+
+// Pull mode (NOTA_PULL): bytes asked for per HTTP range request, attempts per range before the update fails,
+// and how long the server may take to answer
+#ifndef NOTA_PULL_RANGE
+#define NOTA_PULL_RANGE 4096
+#endif
+#ifndef NOTA_PULL_RETRIES
+#define NOTA_PULL_RETRIES 5
+#endif
+#ifndef NOTA_PULL_TIMEOUT
+#define NOTA_PULL_TIMEOUT 5000
+#endif
+
+// Single round trip handshake (ts= and mac= in the request): the highest request timestamps remembered against replays
+#ifndef NOTA_AUTH_WINDOW
+#define NOTA_AUTH_WINDOW 8
+#endif
+// STM32: first of the three RTC backup registers that keep the replay floor across resets
+#ifndef NOTA_AUTH_BKP_REGISTER
+#define NOTA_AUTH_BKP_REGISTER 16
+#endif
+#define NOTA_AUTH_BKP_MAGIC 0x4654414EUL // "NATF"
+
+// Rate limit (setMaxRate()): bucket depth in ms of traffic, and the adaptive mode (setRateProbe()): probe interval,
+// lowest rate and additive increase per interval in bytes/s. The rate is halved whenever the probe reports a backlog
+#ifndef NOTA_RATE_BURST_MS
+#define NOTA_RATE_BURST_MS 100
+#endif
+#ifndef NOTA_RATE_INTERVAL
+#define NOTA_RATE_INTERVAL 100
+#endif
+#ifndef NOTA_RATE_MIN
+#define NOTA_RATE_MIN 2048
+#endif
+#ifndef NOTA_RATE_STEP
+#define NOTA_RATE_STEP 4096
+#endif
+
+// Bytes of the running image hashed per idle handle() call. The hash is completed at once when it is needed earlier
+#ifndef NOTA_HASH_SLICE
+#define NOTA_HASH_SLICE 1024
+#endif
 
-static char ota_temp[128];
+#if NOTA_LOG_LEVEL >= NOTA_LOG_ERROR
+#define NOTA_LOGE(...) logf(__VA_ARGS__)
+#else
+#define NOTA_LOGE(...) do {} while (0)
+#endif
+#if NOTA_LOG_LEVEL >= NOTA_LOG_WARN
+#define NOTA_LOGW(...) logf(__VA_ARGS__)
+#else
+#define NOTA_LOGW(...) do {} while (0)
+#endif
+#if NOTA_LOG_LEVEL >= NOTA_LOG_INFO
+#define NOTA_LOGI(...) logf(__VA_ARGS__)
+#else
+#define NOTA_LOGI(...) do {} while (0)
+#endif
+#if NOTA_LOG_LEVEL >= NOTA_LOG_DEBUG
+#define NOTA_LOGD(...) logf(__VA_ARGS__)
+#else
+#define NOTA_LOGD(...) do {} while (0)
+#endif
+#if NOTA_LOG_LEVEL >= NOTA_LOG_VERBOSE
+#define NOTA_LOGV(...) logf(__VA_ARGS__)
+#else
+#define NOTA_LOGV(...) do {} while (0)
+#endif
 
 typedef enum {
     OTA_IDLE,
@@ -78,21 +242,171 @@ typedef enum {
     OTA_END_ERROR
 } ota_error_t;
 
+#define OTA_RESULT_OK 100
+
+typedef enum {
+    OTA_EVENT_REQUEST,
+    OTA_EVENT_START,
+    OTA_EVENT_END,
+    OTA_EVENT_ERROR,
+    OTA_EVENT_PROGRESS,
+    OTA_EVENT_CONFIG
+} ota_event_type_t;
+
+typedef struct {
+    ota_event_type_t type;
+    uint32_t a;
+    uint32_t b;
+} ota_event_t;
+
+typedef struct {
+    int cmd;            // U_FLASH, U_FS or U_CONFIG
+    int size;
+    char hash[33];
+} ota_part_t;
+
+// Data run of a sparse transfer, the bytes between runs are erased (0xFF) and not sent
+typedef struct {
+    uint32_t offset;
+    uint32_t length;
+} ota_extent_t;
+
+// Scratch arena: the larger temporary buffers of the handle() context (or the OTA task) share one block in the OTA object
+// instead of the stack. No two members are in use at the same time, so the arena is only as large as the largest one.
+// Code the application may call directly (getImageHash(), the log) keeps its buffers on the stack
+typedef union {
+    char text[NOTA_TEMP_SIZE];      // parseInt(), host name, storage error text
+    char reply[NOTA_REPLY_SIZE];    // Handshake reply, STAT record, block hashes
+    char packet[NOTA_PACKET_SIZE];  // Discovery request and response
+    uint8_t copy[NOTA_COPY_SIZE];   // ESP receive buffer, relay upload
+    nota_image_header_t header;     // Image header of hdr=1
+#ifdef NOTA_MULTICAST
+    struct {
+        uint8_t packet[NOTA_MC_HEADER_SIZE + NOTA_MC_CHUNK_MAX + 1];
+        char detail[400];
+        char report[512];
+    } mc;
+#endif
+} nota_scratch_t;
+
+inline const char* ota_result_name(int result) {
+    switch (result) {
+        case OTA_AUTH_ERROR: return "AUTH_ERROR";
+        case OTA_BEGIN_ERROR: return "BEGIN_ERROR";
+        case OTA_CONNECT_ERROR: return "CONNECT_ERROR";
+        case OTA_RECEIVE_ERROR: return "RECEIVE_ERROR";
+        case OTA_END_ERROR: return "END_ERROR";
+        case OTA_RESULT_OK: return "OK";
+        default: return "-";
+    }
+}
+
+
+
+#ifdef NOTA_PULL
+#if defined(ARDUINO_ARCH_STM32)
+typedef EthernetClient nota_pull_client_t;
+#else
+typedef WiFiClient nota_pull_client_t;
+#endif
+#endif // NOTA_PULL
+
+// Policies of NOTABasic<Transport, Storage, Hash, Callbacks>, NOTAClass uses the defaults of the platform.
+//   Transport  server_t and client_t, static begin(server_t&, uint16_t port), static prepare(client_t&) for a new session
+//   Storage    bool write(const uint8_t* data, uint32_t size): the receive loop writes plain image parts through it,
+//              opening and committing the update stays with the platform (InternalStorage, Update)
+//   Hash       the hash of the receive loop, see nota_receiver.h. nota_no_hash: the platform verifies the image afterwards
+//   Callbacks  request(), start(), end(), error(ota_error_t), progress(uint32_t, uint32_t), config(const uint8_t*, size_t)
+//              and yield(). The on...() setters need the on_... members of nota_function_callbacks or nota_pointer_callbacks,
+//              any other functor is set up through callbacks()
+#if defined(ARDUINO_ARCH_STM32)
+struct nota_ethernet_transport {
+    typedef EthernetServer server_t;
+    typedef EthernetClient client_t;
+    static void begin(server_t& server, uint16_t) { server.begin(); }
+    static void prepare(client_t&) {}
+};
+
+struct nota_internal_storage {
+    bool write(const uint8_t* data, uint32_t size) { return InternalStorage.write(data, size); }
+};
+
+typedef nota_ethernet_transport nota_default_transport;
+typedef nota_internal_storage nota_default_storage;
+#else
+struct nota_wifi_transport {
+    typedef WiFiServer server_t;
+    typedef WiFiClient client_t;
+    static void begin(server_t& server, uint16_t port) { server.begin(port); }
+    static void prepare(client_t& client) { client.setNoDelay(true); }
+};
+
+// Update takes any length and reports a short write on error
+struct nota_update_storage {
+    bool write(const uint8_t* data, uint32_t size) { return Update.write((uint8_t*) data, size) == size; }
+};
+
+typedef nota_wifi_transport nota_default_transport;
+typedef nota_update_storage nota_default_storage;
+#endif
+
+// Callbacks in std::function, set with onStart() and the other setters
+struct nota_function_callbacks {
+    std::function<void(void)> on_request, on_start, on_end, on_yield;
+    std::function<void(ota_error_t)> on_error;
+    std::function<void(unsigned int, unsigned int)> on_progress;
+    std::function<void(const uint8_t*, size_t)> on_config;
+    void request() { if (on_request) on_request(); }
+    void start() { if (on_start) on_start(); }
+    void end() { if (on_end) on_end(); }
+    void error(ota_error_t error) { if (on_error) on_error(error); }
+    void progress(uint32_t done, uint32_t size) { if (on_progress) on_progress(done, size); }
+    void config(const uint8_t* data, size_t size) { if (on_config) on_config(data, size); }
+    void yield() { if (on_yield) on_yield(); }
+};
 
+// The same as plain function pointers, lambdas without captures convert to them
+struct nota_pointer_callbacks {
+    void (*on_request)() = nullptr;
+    void (*on_start)() = nullptr;
+    void (*on_end)() = nullptr;
+    void (*on_yield)() = nullptr;
+    void (*on_error)(ota_error_t) = nullptr;
+    void (*on_progress)(unsigned int, unsigned int) = nullptr;
+    void (*on_config)(const uint8_t*, size_t) = nullptr;
+    void request() { if (on_request) on_request(); }
+    void start() { if (on_start) on_start(); }
+    void end() { if (on_end) on_end(); }
+    void error(ota_error_t error) { if (on_error) on_error(error); }
+    void progress(uint32_t done, uint32_t size) { if (on_progress) on_progress(done, size); }
+    void config(const uint8_t* data, size_t size) { if (on_config) on_config(data, size); }
+    void yield() { if (on_yield) on_yield(); }
+};
 
-class NOTAClass {
+template <typename Transport = nota_default_transport, typename Storage = nota_default_storage,
+    typename Hash = nota_no_hash, typename Callbacks = nota_function_callbacks>
+class NOTABasic {
 public:
     typedef std::function<void(void)> THandlerFunction;
     typedef std::function<void(ota_error_t)> THandlerFunction_Error;
     typedef std::function<void(unsigned int, unsigned int)> THandlerFunction_Progress;
     typedef std::function<void(const char*)> TLogFunction_Out;
+    typedef std::function<void(const uint8_t*, size_t)> THandlerFunction_Config;
+    typedef std::function<uint32_t(void)> THandlerFunction_Backlog;
+
+    //Sets the log output. Default OTA_DEBUG (Serial)
+    void setLogger(TLogFunction_Out fn);
+
+    //Writes a formatted log message, or queues it when NOTA_LOG_RING_SIZE is set
+    void logf(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+    //Writes out the queued log messages. Called from handle()
+    void flushLog();
 
-    // void setLogger(TLogFunction_Out fn);
-    // void logf(const char* fmt, ...);
     // MyFileStorageClass *storage = nullptr;
 
-    NOTAClass();
-    ~NOTAClass();
+    NOTABasic();
+    ~NOTABasic();
 
     //Sets the service port. Default 8266
     void setPort(uint16_t port);
@@ -125,20 +439,69 @@ public:
     //Sets if the device should be rebooted after successful update. Default true
     void setRebootOnSuccess(bool reboot);
 
+    //Keeps a verified image in the update slot instead of installing it, until applyStaged() is called. Default false.
+    //The staged image survives resets and is dropped by the next update. Not supported on ESP8266
+    void setStageOnly(bool stage);
+
+    //Returns true while a verified image waits for applyStaged()
+    bool isStaged();
+
+    //Gets the MD5 hash of the staged image, empty when there is none
+    String getStagedHash();
+
+    //Verifies the staged image again, installs it and reboots. Returns false when there is none or it is damaged
+    bool applyStaged();
+
     //This callback will be called when OTA connection has begun
-    void onRequest(THandlerFunction fn);
+    template <typename F> void onRequest(F fn);
 
     //This callback will be called when OTA update has started
-    void onStart(THandlerFunction fn);
+    template <typename F> void onStart(F fn);
 
     //This callback will be called when OTA has finished
-    void onEnd(THandlerFunction fn);
+    template <typename F> void onEnd(F fn);
 
     //This callback will be called when OTA encountered Error
-    void onError(THandlerFunction_Error fn);
+    template <typename F> void onError(F fn);
 
     //This callback will be called when OTA is receiving data
-    void onProgress(THandlerFunction_Progress fn);
+    template <typename F> void onProgress(F fn);
+
+    //This callback receives the config part of a multi-part session after all parts were verified, before the reboot
+    template <typename F> void onConfig(F fn);
+
+    //This callback is called while the receive loop waits for data or for the rate limit, so the application can
+    //serve its own sockets during an update. Not called with beginTask(), the application loop keeps running there
+    template <typename F> void onYield(F fn);
+
+    //Gets the callbacks policy, for a functor that is not set up through the on...() setters
+    Callbacks& callbacks() { return _callbacks; }
+
+    //Limits the update data the device takes to bytes per second, 0 for no limit. Default 0.
+    //The TCP window closes while the limit holds data back, which slows the sender down
+    void setMaxRate(uint32_t bytes_per_second);
+
+    //Adapts the rate to the application: the probe returns the application's backlog (queued bytes or requests, 0 when idle).
+    //The rate is halved while there is a backlog and grows step by step up to setMaxRate() otherwise
+    void setRateProbe(THandlerFunction_Backlog fn);
+
+    //Checks the OTA sockets only every ms milliseconds while idle, handle() returns right away in between. Default 0 (every call).
+    //A client connecting in between waits for the next check, a multicast transfer is checked on every call
+    void setPollInterval(uint16_t ms);
+
+#ifdef ARDUINO_ARCH_STM32
+    //Uses the INT pin of the W5100 / W5500: the OTA sockets are checked as soon as the chip reports an event on one of them.
+    //setPollInterval() is then the fallback for events that were missed, e.g. 1000. -1 turns it off. Default -1
+    void setInterruptPin(int pin);
+
+    //Sets the data partition that receives filesystem images (-s of nota.js) in internal flash, at a sector boundary.
+    //The image is written in place while the application runs and there is no restart after it: unmount the filesystem in
+    //onStart() when getCommand() is U_FS and mount it again in onEnd(). After onError() it holds a partial image
+    void setDataPartition(uint32_t address, uint32_t size);
+
+    //The same on an external flash chip, address is relative to the chip and aligned to driver->block_size
+    void setDataPartition(uint32_t address, uint32_t size, const nota_flash_driver_t* driver);
+#endif
 
     //Starts the ArduinoOTA service
     void begin();
@@ -146,25 +509,138 @@ public:
     //Run this when network is reset and the listeners need to be reconnected
     void reconnect();
 
+#ifdef ESP32
+    //Starts the OTA service in its own FreeRTOS task pinned to the given core.
+    //Callbacks are queued (up to queue_length events) and delivered from handle() in the caller's context
+    void beginTask(BaseType_t core = 0, UBaseType_t priority = 1, UBaseType_t queue_length = 16, uint32_t stack_size = 8192);
+#endif
+
     //Call this in loop() regularly
     void handle();
 
     //Gets update command type after OTA has started. Either U_FLASH or U_FS
     int getCommand();
 
+    //Gets the MD5 hash of the running application image. Computed once, in slices from handle() while idle
+    String getImageHash();
+
+    //Confirms that the running image started correctly and cancels its rollback.
+    //Needed with NOTA_AB_SLOTS on STM32 and with app rollback enabled in the ESP32 bootloader
+    bool confirmBoot();
+
+    //Returns true while the running image waits for confirmBoot()
+    bool isBootPending();
+
+    //Gets the running application slot (0 = A, 1 = B) or -1 when there are no slots
+    int getBootSlot();
+
 private:
     void listener();
+    bool poll_due();
+#ifdef ARDUINO_ARCH_STM32
+    void irq_arm();
+    void irq_disarm();
+#endif
     void ota_handle_idle();
+    void ota_handle_query();
+    void ota_handle_blocks();
     void ota_handle_auth();
     void ota_handle_update();
+    bool ota_check_header();
+    bool ota_begin_part();
+    bool ota_receive_part();
+#ifdef NOTA_PULL
+    bool ota_pull_part();
+    int32_t pull_range(nota_pull_client_t& http, uint32_t length);
+#endif
+    void rate_begin();
+    uint32_t rate_allowance();
+    void rate_consume(uint32_t bytes);
+    void receive_wait();
+#ifdef NOTA_LWIP_RAW
+    uint32_t ota_receive_raw(uint32_t limit);
+#endif
+    void ota_finish(bool ok);
+    void reboot_after_update(bool force = false);
+    bool stage_image(uint32_t size, const char* hash);
+    bool staged_image(uint32_t* size, char* hash);
+    void drop_staged();
+    void ota_error(ota_error_t error);
+    void ota_reply(const char* prefix);
+    String option(const char* key);
+    bool hash_step(uint32_t budget);
+    bool hash_slice(uint32_t budget);
+    bool parse_blocks();
+    bool parse_extents();
+    uint32_t extent_left();
+    bool parse_pull();
+    bool auth_mac_valid();
+    bool auth_window_accept(unsigned long long ts);
+    void auth_floor_load();
+    bool auth_floor_store(unsigned long long ts);
+    bool parse_parts();
+    void image_read(uint32_t offset, uint32_t* buf, uint32_t size);
+    bool block_unchanged(uint32_t block);
+    bool ota_write(const uint8_t* data, uint32_t size);
+    bool ota_fill();
+#ifdef ARDUINO_ARCH_STM32
+    bool ota_verify();
+#endif
+    void notify(ota_event_type_t type, uint32_t a = 0, uint32_t b = 0);
+    void dispatch(const ota_event_t& event);
+#ifdef ESP32
+    static void task_main(void* arg);
+    void wait_events_delivered(uint32_t timeout);
+    TaskHandle_t _task = nullptr;
+    QueueHandle_t _events = nullptr;
+    SemaphoreHandle_t _hash_lock = nullptr; // The image hash, advanced by the task and by getImageHash() of the application
+    volatile bool _reconnect_request = false;
+#endif
 #ifdef NOTA_BROADCAST
     uint32_t last_broadcast = 0;
     void handle_broadcast();
+#endif
+#ifdef NOTA_RELAY
+    void relay_image();
+    uint8_t relay_discover(IPAddress* ips, uint16_t* ports, uint8_t max);
+    bool relay_push(IPAddress ip, uint16_t port, uint8_t fanout, uint32_t size, const char* hash);
+    bool relay_read(uint8_t* buffer, uint32_t offset, uint32_t size);
+#ifdef ESP32
+    const esp_partition_t* _relay_partition = nullptr;
+#endif
+#endif
+#ifdef NOTA_MULTICAST
+    void handle_multicast();
+    void mc_announce(const char* args, IPAddress host);
+    void mc_data(const uint8_t* packet, int length);
+    void mc_poll();
+    void mc_report(const char* kind, uint32_t session, const char* detail);
+    void mc_close(bool commit);
+    uint32_t _mc_session = 0;       // Multicast transfer in progress, 0 = none
+    uint32_t _mc_size = 0;
+    uint32_t _mc_chunk = 0;
+    uint32_t _mc_chunks = 0;
+    uint32_t _mc_received = 0;
+    uint32_t _mc_last_packet = 0;
+    uint8_t* _mc_bitmap = nullptr;  // Received chunks
+    char _mc_hash[33];
+    IPAddress _mc_host;
+#ifdef ESP32
+    const esp_partition_t* _mc_partition = nullptr;
+    esp_ota_handle_t _mc_handle = 0;
+#endif
 #endif
     int parseInt();
     String readStringUntil(char end);
 
+    void log_write(const char* text);
     TLogFunction_Out _logger = nullptr;
+#if NOTA_LOG_RING_SIZE > 0
+    char _log_ring[NOTA_LOG_RING_SIZE];
+    volatile uint32_t _log_head = 0; // Advanced by the producer (logf)
+    volatile uint32_t _log_tail = 0; // Advanced by the consumer (flushLog)
+    volatile uint32_t _log_dropped = 0;
+#endif
     long _last_auth_time;
     long _last_update_time;
     int _port = 0;
@@ -174,15 +650,36 @@ private:
     String _version = "";
     String _board = "";
     String _nonce;
+    unsigned long long _auth_window[NOTA_AUTH_WINDOW];
+    uint8_t _auth_window_count = 0;
+    unsigned long long _auth_floor = 0; // Timestamps at or below it are refused
+    unsigned long long _auth_stored = 0; // Floor after a restart
+    bool _auth_floor_known = false; // false: signed requests get the AUTH challenge
+    nota_scratch_t _scratch;
+    typedef typename Transport::server_t nota_server_t;
+    typename Transport::client_t* ota_client = nullptr;
+    nota_server_t* _tcp_ota = nullptr; // Constructed in _tcp_ota_storage, not on the heap
+    alignas(nota_server_t) uint8_t _tcp_ota_storage[sizeof(nota_server_t)];
+    bool _initialized = false;
+    Storage _storage;
+    NOTAReceiver<Storage, Hash> _receiver { _storage }; // Plain image parts, see nota_receiver.h
 #ifdef ARDUINO_ARCH_STM32
-    EthernetServer* _tcp_ota = nullptr;
-    EthernetClient* ota_client = nullptr;
-#else
-    WiFiServer* _tcp_ota = nullptr;
-    WiFiClient* ota_client = nullptr;
+    NOTAReceiver<OTADataStorage, Hash> _data_receiver { DataStorage }; // Filesystem images
 #endif
-    bool _initialized = false;
     bool _rebootOnSuccess = true;
+    uint32_t _max_rate = 0;         // bytes/s, 0 = unlimited
+    uint32_t _rate = 0;             // Current rate, below _max_rate while the probe reports a backlog
+    uint64_t _rate_credit = 0;      // Token bucket in 1/1000 bytes, 64 bit as the depth exceeds 32 bit above 42 MB/s
+    uint32_t _rate_time = 0;
+    uint32_t _rate_probe_time = 0;
+    uint16_t _poll_interval = 0;    // ms between idle socket checks, 0 = every handle() call
+    uint32_t _last_poll = 0;
+    bool _poll_now = true;          // Check on the next call: after begin() or a setting change
+#ifdef ARDUINO_ARCH_STM32
+    int _irq_pin = -1;              // W5x00 INT pin, -1 = none
+    uint8_t _irq_mask = 0;          // Socket interrupts NOTA enabled in SIMR / IMR
+#endif
+    bool _stageOnly = false;
     ota_state_t _state = OTA_IDLE;
     int _size = 0;
     int _cmd = 0;
@@ -190,16 +687,51 @@ private:
     uint16_t _ota_tcp_port = 0;
     IPAddress _ota_ip;
     String _program_hash_;
-
-    THandlerFunction _request_callback = nullptr;
-    THandlerFunction _start_callback = nullptr;
-    THandlerFunction _end_callback = nullptr;
-    THandlerFunction_Error _error_callback = nullptr;
-    THandlerFunction_Progress _progress_callback = nullptr;
+    String _options;
+    String _image_hash;
+    MD5_CTX _hash_ctx;
+    bool _hash_running = false;
+    uint32_t _hash_offset = 0;
+    uint32_t _hash_length = 0;
+    uint32_t _block_size = 0;       // Delta transfer block size, 0 for a full image
+    String _block_map;              // Hex bitmap of the blocks copied from the running image
+    ota_extent_t _extents[NOTA_EXTENTS_MAX]; // Sparse transfer, see parse_extents()
+    uint8_t _extent_count = 0;
+    uint32_t _image_offset = 0;     // Bytes of the new image stored so far
+    uint32_t _transfer_size = 0;    // Bytes the client sends
+#ifdef NOTA_PULL
+    String _pull_host;              // Pull mode: the image is fetched from http://<host>:<port><path>, empty = push
+    String _pull_path;
+    uint16_t _pull_port = 0;
+#endif
+    bool _header = false;           // hdr=1: the vector table of the header is compared with the received one
+    uint32_t _header_vector[2];
+    ota_part_t _parts[NOTA_MAX_PARTS];
+    uint8_t _part_count = 0;
+    uint8_t* _config = nullptr;     // Config part, delivered when the session commits
+    uint32_t _config_size = 0;
+    bool _flash_received = false;
+    int _last_result = -1; // -1 = none since boot, OTA_RESULT_OK or ota_error_t
+    uint32_t _last_duration = 0;
+    uint32_t _session_start = 0;
+
+    Callbacks _callbacks;
+    THandlerFunction_Backlog _rate_probe = nullptr;
 };
 
+// Out of class definitions of the NOTABasic members
+#define NOTA_TEMPLATE template <typename Transport, typename Storage, typename Hash, typename Callbacks>
+#define NOTA_BASIC NOTABasic<Transport, Storage, Hash, Callbacks>
+
+// Today's defaults of the platform
+typedef NOTABasic<> NOTAClass;
+
 #if !defined(NO_GLOBAL_INSTANCES) && !defined(NO_GLOBAL_ARDUINOOTA)
-extern NOTAClass OTA;
+NOTA_GLOBAL(NOTAClass, OTA, {});
+
+#ifdef NOTA_RAM_BUDGET
+static_assert(sizeof(NOTAClass) <= NOTA_RAM_BUDGET, "The OTA object is larger than NOTA_RAM_BUDGET, see NOTA_FOOTPRINT_SMALL");
+#endif
 #endif
 
 
@@ -231,6 +763,8 @@ extern "C" {
 #include <WiFiUdp.h>
 #include "MD5Builder.h"
 #include "Update.h"
+#include "esp_ota_ops.h"
+#include "esp_image_format.h"
 
 #elif defined(ARDUINO_ARCH_STM32)
 #include <functional>
@@ -240,149 +774,282 @@ extern "C" {
 #endif
 
 #ifdef NOTA_BROADCAST
-#define NOTA_BC_MAGIC           "NOTA_DISCOVERY"
 #define NOTA_BC_DISCOVERY_GROUP IPAddress(239, 255, 0, 1)
-#define NOTA_BC_DISCOVERY_PORT  41234
-#define NOTA_BC_RESPONSE_PORT   41235
 
 #if defined(ARDUINO_ARCH_STM32)
 #include <EthernetUdp.h>
-static EthernetUDP udp_mc; // Multicast UDP
-static EthernetUDP udp_b;  // Broadcast UDP
+NOTA_GLOBAL(EthernetUDP, udp_mc, {}); // Multicast UDP
+NOTA_GLOBAL(EthernetUDP, udp_b, {});  // Broadcast UDP
 #else
 #include <WiFiUdp.h>
-static WiFiUDP udp_mc; // Multicast UDP
-static WiFiUDP udp_b;  // Broadcast UDP
+NOTA_GLOBAL(WiFiUDP, udp_mc, {}); // Multicast UDP
+NOTA_GLOBAL(WiFiUDP, udp_b, {});  // Broadcast UDP
 #endif
 
-static void macToString(const uint8_t mac[6], char* out) {
+inline void macToString(const uint8_t mac[6], char* out) {
     sprintf(out, "%02X:%02X:%02X:%02X:%02X:%02X",
         mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 }
-static void ipToString(IPAddress ip, char* out) {
+inline void ipToString(IPAddress ip, char* out) {
     sprintf(out, "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
 }
-static void buildDeviceId(const uint8_t mac[6], char* out, const char* prefix) {
+inline void buildDeviceId(const uint8_t mac[6], char* out, const char* prefix) {
     sprintf(out, "%s-%02x%02x%02x", prefix, mac[3], mac[4], mac[5]);
 }
 #endif // NOTA_BROADCAST
 
-#define OTA_DEBUG Serial
+#ifdef NOTA_MULTICAST
+#if defined(ESP8266)
+#error "NOTA_MULTICAST writes the update out of order, which the ESP8266 Updater does not support"
+#endif
+#define NOTA_MC_GROUP_IP IPAddress(239, 255, 0, 1)
+#if defined(ARDUINO_ARCH_STM32)
+#include <EthernetUdp.h>
+NOTA_GLOBAL(EthernetUDP, udp_data, {}); // Multicast transfer
+#else
+#include <WiFiUdp.h>
+NOTA_GLOBAL(WiFiUDP, udp_data, {});     // Multicast transfer
+#endif
+#endif // NOTA_MULTICAST
+
+#ifdef NOTA_RELAY
+#ifndef NOTA_BROADCAST
+#error "NOTA_RELAY finds its peers with the discovery of NOTA_BROADCAST"
+#endif
+#if defined(ESP8266)
+#error "NOTA_RELAY reads the staged image back from flash, which the ESP8266 Updater does not expose"
+#endif
+#if defined(ARDUINO_ARCH_STM32)
+typedef EthernetClient nota_relay_client_t;
+typedef EthernetUDP nota_relay_udp_t;
+#else
+typedef WiFiClient nota_relay_client_t;
+typedef WiFiUDP nota_relay_udp_t;
+#endif
+#endif // NOTA_RELAY
+
+// Image data straight from the lwIP receive buffers (NOTA_LWIP_RAW). The TCP window only opens again once the
+// update writer has taken the bytes, so the sender is paced by the flash instead of by an intermediate copy
+#ifdef NOTA_LWIP_RAW
+#if defined(ARDUINO_ARCH_STM32)
+#error "NOTA_LWIP_RAW needs the lwIP stack of ESP8266 or ESP32"
+#endif
+#if defined(ESP32)
+#include "lwip/sockets.h"
+#endif
+#endif // NOTA_LWIP_RAW
 
-char reusable_hash[128];
+#ifndef OTA_DEBUG
+#define OTA_DEBUG Serial
+#endif
 
-String MD5(const char* text) {
+inline String MD5(const char* text) {
     uint8_t* hash = MD5::make_hash((char*) text);
     //generate the digest (hex encoding) of our hash
     char* md5str = MD5::make_digest(hash, 16);
-    strcpy(reusable_hash, md5str);
+    String result = md5str;
     free(hash);
     free(md5str);
-    return String(reusable_hash);
+    return result;
+}
+inline String MD5(const String& text) { return MD5(text.c_str()); }
+inline String MD5(long ms) { return MD5(String(ms)); }
+
+// HMAC-MD5 (RFC 2104) as hex. The key is the password hash, 32 characters and so shorter than the block
+inline String HMAC_MD5(const String& key, const String& message) {
+    uint8_t pad[64];
+    uint8_t digest[16];
+    MD5_CTX ctx;
+    memset(pad, 0x36, sizeof(pad));
+    for (size_t i = 0; i < key.length() && i < sizeof(pad); i++) pad[i] ^= (uint8_t) key[i];
+    MD5::MD5Init(&ctx);
+    MD5::MD5Update(&ctx, pad, sizeof(pad));
+    MD5::MD5Update(&ctx, message.c_str(), message.length());
+    MD5::MD5Final(digest, &ctx);
+    for (size_t i = 0; i < sizeof(pad); i++) pad[i] ^= 0x36 ^ 0x5C;
+    MD5::MD5Init(&ctx);
+    MD5::MD5Update(&ctx, pad, sizeof(pad));
+    MD5::MD5Update(&ctx, digest, sizeof(digest));
+    MD5::MD5Final(digest, &ctx);
+    char* md5str = MD5::make_digest(digest, 16);
+    String result = md5str;
+    free(md5str);
+    return result;
 }
-String MD5(const String& text) { return MD5(text.c_str()); }
-String MD5(long ms) { return MD5(String(ms)); }
 
-NOTAClass::NOTAClass() {}
+NOTA_TEMPLATE NOTA_BASIC::NOTABasic() {}
 
-NOTAClass::~NOTAClass() {
+NOTA_TEMPLATE NOTA_BASIC::~NOTABasic() {
     if (_tcp_ota) {
-        delete _tcp_ota;
+        _tcp_ota->~nota_server_t();
         _tcp_ota = 0;
     }
 }
 
-// void NOTAClass::setLogger(TLogFunction_Out fn) { _logger = fn; }
-
-// void NOTAClass::logf(const char* fmt, ...) {
-//     if (!_logger) return;
-//     char buf[256];
-//     va_list ap; va_start(ap, fmt);
-//     vsnprintf(buf, sizeof(buf), fmt, ap);
-//     va_end(ap);
-//     _logger(buf);
-// }
-
-void NOTAClass::onRequest(THandlerFunction fn) { _request_callback = fn; }
-void NOTAClass::onStart(THandlerFunction fn) { _start_callback = fn; }
-void NOTAClass::onEnd(THandlerFunction fn) { _end_callback = fn; }
-void NOTAClass::onProgress(THandlerFunction_Progress fn) { _progress_callback = fn; }
-void NOTAClass::onError(THandlerFunction_Error fn) { _error_callback = fn; }
-void NOTAClass::setPort(uint16_t port) { if (!_initialized && !_port && port) _port = port; }
-// void NOTAClass::setStorage(MyFileStorageClass& storage) { if (!_initialized) this->storage = &storage; }
-void NOTAClass::setHostname(const char* hostname) { if (hostname && _hostname.length() == 0) _hostname = hostname; }
-String NOTAClass::getHostname() { return _hostname; }
-void NOTAClass::setPlatform(const char* platform) { if (platform && _platform.length() == 0) _platform = platform; }
-String NOTAClass::getPlatform() { return _platform; }
-void NOTAClass::setBoard(const char* board) { if (board && _board.length() == 0) _board = board; }
-String NOTAClass::getBoard() { return _board; }
-void NOTAClass::setVersion(const char* version) { if (version && _version.length() == 0) _version = version; }
-String NOTAClass::getVersion() { return _version; }
-void NOTAClass::setPassword(const char* password) {
+NOTA_TEMPLATE void NOTA_BASIC::setLogger(TLogFunction_Out fn) { _logger = fn; }
+
+NOTA_TEMPLATE void NOTA_BASIC::log_write(const char* text) {
+    if (_logger) _logger(text);
+    else OTA_DEBUG.print(text);
+}
+
+NOTA_TEMPLATE void NOTA_BASIC::logf(const char* fmt, ...) {
+    char buf[NOTA_LOG_LINE_SIZE];
+    va_list ap; va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n <= 0) return;
+    if (n >= (int) sizeof(buf)) n = sizeof(buf) - 1;
+#if NOTA_LOG_RING_SIZE > 0
+    uint32_t head = _log_head;
+    if ((uint32_t) n > NOTA_LOG_RING_SIZE - (head - _log_tail)) {
+        _log_dropped = _log_dropped + 1;
+        return;
+    }
+    for (int i = 0; i < n; i++) _log_ring[(head + i) % NOTA_LOG_RING_SIZE] = buf[i];
+    __sync_synchronize(); // Publish the bytes before the new head
+    _log_head = head + n;
+#else
+    log_write(buf);
+#endif
+}
+
+NOTA_TEMPLATE void NOTA_BASIC::flushLog() {
+#if NOTA_LOG_RING_SIZE > 0
+    char buf[65];
+    uint32_t head = _log_head;
+    __sync_synchronize(); // Read the bytes only after the head that published them
+    uint32_t tail = _log_tail;
+    while (tail != head) {
+        size_t n = 0;
+        while (tail != head && n < sizeof(buf) - 1) buf[n++] = _log_ring[tail++ % NOTA_LOG_RING_SIZE];
+        buf[n] = 0;
+        _log_tail = tail;
+        log_write(buf);
+    }
+    if (_log_dropped) {
+        snprintf(buf, sizeof(buf), "[NOTA] %u log messages dropped\n", (unsigned) _log_dropped);
+        _log_dropped = 0;
+        log_write(buf);
+    }
+#endif
+}
+
+NOTA_TEMPLATE template <typename F> void NOTA_BASIC::onRequest(F fn) { _callbacks.on_request = fn; }
+NOTA_TEMPLATE template <typename F> void NOTA_BASIC::onStart(F fn) { _callbacks.on_start = fn; }
+NOTA_TEMPLATE template <typename F> void NOTA_BASIC::onEnd(F fn) { _callbacks.on_end = fn; }
+NOTA_TEMPLATE template <typename F> void NOTA_BASIC::onProgress(F fn) { _callbacks.on_progress = fn; }
+NOTA_TEMPLATE template <typename F> void NOTA_BASIC::onError(F fn) { _callbacks.on_error = fn; }
+NOTA_TEMPLATE template <typename F> void NOTA_BASIC::onConfig(F fn) { _callbacks.on_config = fn; }
+NOTA_TEMPLATE template <typename F> void NOTA_BASIC::onYield(F fn) { _callbacks.on_yield = fn; }
+NOTA_TEMPLATE void NOTA_BASIC::setMaxRate(uint32_t bytes_per_second) { _max_rate = bytes_per_second; }
+NOTA_TEMPLATE void NOTA_BASIC::setRateProbe(THandlerFunction_Backlog fn) { _rate_probe = fn; }
+NOTA_TEMPLATE void NOTA_BASIC::setPollInterval(uint16_t ms) {
+    _poll_interval = ms;
+    _poll_now = true;
+}
+#ifdef ARDUINO_ARCH_STM32
+NOTA_TEMPLATE void NOTA_BASIC::setInterruptPin(int pin) {
+    if (pin < 0) irq_disarm();
+    _irq_pin = pin;
+    if (pin >= 0) pinMode(pin, INPUT_PULLUP);
+    _poll_now = true;
+}
+NOTA_TEMPLATE void NOTA_BASIC::setDataPartition(uint32_t address, uint32_t size) { setDataPartition(address, size, nullptr); }
+NOTA_TEMPLATE void NOTA_BASIC::setDataPartition(uint32_t address, uint32_t size, const nota_flash_driver_t* driver) {
+    DataStorage.address = address;
+    DataStorage.size = size;
+    DataStorage.driver = driver;
+    if (!DataStorage.valid()) NOTA_LOGW("OTA data partition at 0x%08lX is not usable\n", (unsigned long) address);
+}
+#endif
+NOTA_TEMPLATE void NOTA_BASIC::setPort(uint16_t port) { if (!_initialized && !_port && port) _port = port; }
+// NOTA_TEMPLATE void NOTA_BASIC::setStorage(MyFileStorageClass& storage) { if (!_initialized) this->storage = &storage; }
+NOTA_TEMPLATE void NOTA_BASIC::setHostname(const char* hostname) { if (hostname && _hostname.length() == 0) _hostname = hostname; }
+NOTA_TEMPLATE String NOTA_BASIC::getHostname() { return _hostname; }
+NOTA_TEMPLATE void NOTA_BASIC::setPlatform(const char* platform) { if (platform && _platform.length() == 0) _platform = platform; }
+NOTA_TEMPLATE String NOTA_BASIC::getPlatform() { return _platform; }
+NOTA_TEMPLATE void NOTA_BASIC::setBoard(const char* board) { if (board && _board.length() == 0) _board = board; }
+NOTA_TEMPLATE String NOTA_BASIC::getBoard() { return _board; }
+NOTA_TEMPLATE void NOTA_BASIC::setVersion(const char* version) { if (version && _version.length() == 0) _version = version; }
+NOTA_TEMPLATE String NOTA_BASIC::getVersion() { return _version; }
+NOTA_TEMPLATE void NOTA_BASIC::setPassword(const char* password) {
     if (!_initialized && !_password.length() && password) {
         _password = MD5(password);
     }
 }
 
-void NOTAClass::reconnect() {
+NOTA_TEMPLATE void NOTA_BASIC::reconnect() {
+#ifdef ESP32
+    if (_task) { // The OTA task owns the sockets
+        _reconnect_request = true;
+        return;
+    }
+#endif
     this->_initialized = false; // Reset initialization state
     this->begin();
 }
 
-void NOTAClass::setPasswordHash(const char* password) { if (!_initialized && !_password.length() && password) _password = password; }
-void NOTAClass::setRebootOnSuccess(bool reboot) { _rebootOnSuccess = reboot; }
+NOTA_TEMPLATE void NOTA_BASIC::setPasswordHash(const char* password) { if (!_initialized && !_password.length() && password) _password = password; }
+NOTA_TEMPLATE void NOTA_BASIC::setRebootOnSuccess(bool reboot) { _rebootOnSuccess = reboot; }
+NOTA_TEMPLATE void NOTA_BASIC::setStageOnly(bool stage) {
+#if defined(ESP8266)
+    // The ESP8266 boot loader installs the update on the next reset, there is nothing to hold it back
+    if (stage) NOTA_LOGW("OTA stage only mode is not supported on ESP8266\n");
+#else
+    _stageOnly = stage;
+#endif
+}
 
-void NOTAClass::begin() {
+NOTA_TEMPLATE void NOTA_BASIC::begin() {
     if (_initialized) return;
     if (!_hostname.length()) {
 #if defined(ESP8266)
-        sprintf(ota_temp, "esp8266-%06x", ESP.getChipId());
+        sprintf(_scratch.text, "esp8266-%06x", ESP.getChipId());
 #elif defined(ESP32) 
         uint8_t mac[6];
         WiFi.macAddress(mac);
-        sprintf(ota_temp, "esp32-%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+        sprintf(_scratch.text, "esp32-%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 #endif // ESP32
-        _hostname = ota_temp;
+        _hostname = _scratch.text;
     }
     if (!_port) _port = 3232;
     if (_tcp_ota) {
-        delete _tcp_ota;
+        _tcp_ota->~nota_server_t();
         _tcp_ota = 0;
     }
-#ifdef ARDUINO_ARCH_STM32
-    _tcp_ota = new EthernetServer(_port);
-    _tcp_ota->begin();
-#else // ESP8266/ESP32
-    _tcp_ota = new WiFiServer(_port);
-    _tcp_ota->begin(_port);
-#endif // ARDUINO_ARCH_STM32
+    _tcp_ota = new (_tcp_ota_storage) nota_server_t(_port);
+    Transport::begin(*_tcp_ota, _port);
     _initialized = true;
     _state = OTA_IDLE;
+    _poll_now = true;
+    auth_floor_load();
 #ifdef ARDUINO_ARCH_STM32
-    Serial.printf("OTA server at port %u\n", _port);
+    InternalStorage.layout();
+    NOTA_LOGI("OTA server at port %u\n", _port);
 #else // ESP8266/ESP32
-    Serial.printf("OTA server at: %s.local:%u\n", _hostname.c_str(), _port);
+    NOTA_LOGI("OTA server at: %s.local:%u\n", _hostname.c_str(), _port);
 #endif // ARDUINO_ARCH_STM32
 #ifdef NOTA_BROADCAST
 #if defined(ARDUINO_ARCH_STM32)
     bool mc_ok = udp_mc.beginMulticast(NOTA_BC_DISCOVERY_GROUP, NOTA_BC_DISCOVERY_PORT) == 1;
     bool b_ok = udp_b.begin(NOTA_BC_DISCOVERY_PORT) == 1;
-    Serial.printf("OTA multicast discovery %s on %u\n", mc_ok ? "started" : "failed", NOTA_BC_DISCOVERY_PORT);
-    // logf("OTA multicast discovery %s on %u\n", mc_ok ? "started" : "failed", NOTA_BC_DISCOVERY_PORT);
-    Serial.printf("OTA broadcast discovery %s on %u\n", b_ok ? "started" : "failed", NOTA_BC_DISCOVERY_PORT);
-    // logf("OTA broadcast discovery %s on %u\n", b_ok ? "started" : "failed", NOTA_BC_DISCOVERY_PORT);
+    NOTA_LOGI("OTA multicast discovery %s on %u\n", mc_ok ? "started" : "failed", NOTA_BC_DISCOVERY_PORT);
+    NOTA_LOGI("OTA broadcast discovery %s on %u\n", b_ok ? "started" : "failed", NOTA_BC_DISCOVERY_PORT);
 #else
     bool mc_ok = udp_mc.beginMulticast(WiFi.localIP(), NOTA_BC_DISCOVERY_GROUP, NOTA_BC_DISCOVERY_PORT);
     bool b_ok = udp_b.begin(NOTA_BC_DISCOVERY_PORT);
-    Serial.printf("OTA multicast discovery %s on %u\n", mc_ok ? "started" : "failed", NOTA_BC_DISCOVERY_PORT);
-    // logf("OTA multicast discovery %s on %u\n", mc_ok ? "started" : "failed", NOTA_BC_DISCOVERY_PORT);
-    Serial.printf("OTA broadcast discovery %s on %u\n", b_ok ? "started" : "failed", NOTA_BC_DISCOVERY_PORT);
-    // logf("OTA broadcast discovery %s on %u\n", b_ok ? "started" : "failed", NOTA_BC_DISCOVERY_PORT);
+    NOTA_LOGI("OTA multicast discovery %s on %u\n", mc_ok ? "started" : "failed", NOTA_BC_DISCOVERY_PORT);
+    NOTA_LOGI("OTA broadcast discovery %s on %u\n", b_ok ? "started" : "failed", NOTA_BC_DISCOVERY_PORT);
 #endif
 #endif // NOTA_BROADCAST
+#ifdef NOTA_MULTICAST
+    bool data_ok = udp_data.beginMulticast(NOTA_MC_GROUP_IP, NOTA_MC_DATA_PORT) == 1;
+    NOTA_LOGI("OTA multicast transfer %s on %u\n", data_ok ? "started" : "failed", NOTA_MC_DATA_PORT);
+#endif // NOTA_MULTICAST
 }
 
-int NOTAClass::parseInt() {
+NOTA_TEMPLATE int NOTA_BASIC::parseInt() {
     if (!ota_client) return 0;
     int i = 0;
     uint8_t index = 0;
@@ -393,15 +1060,15 @@ int NOTAClass::parseInt() {
         i++;
         value = ota_client->read();
         if (value == '\n' || value == '\r') {
-            ota_temp[index] = 0;
+            _scratch.text[index] = 0;
             done = true;
-        } else ota_temp[index++] = value;
+        } else _scratch.text[index++] = value;
     }
-    ota_temp[index] = 0;
-    return atoi(ota_temp);
+    _scratch.text[index] = 0;
+    return atoi(_scratch.text);
 }
 
-String NOTAClass::readStringUntil(char end) {
+NOTA_TEMPLATE String NOTA_BASIC::readStringUntil(char end) {
     if (!ota_client) return "";
     String res;
     int value;
@@ -414,91 +1081,280 @@ String NOTAClass::readStringUntil(char end) {
 }
 
 
-void NOTAClass::ota_handle_idle() {
+NOTA_TEMPLATE void NOTA_BASIC::ota_handle_idle() {
     delay(10);
-    Serial.println("Incoming OTA update request ...");
     int cmd = this->parseInt();
-    if (cmd != U_FLASH && cmd != U_SPIFFS) {
-        Serial.printf("Unknown command: \"%d\"\n", cmd);
+    if (cmd == U_QUERY) {
+        while (ota_client->available()) ota_client->read();
+        ota_handle_query();
+        return;
+    }
+    if (cmd == U_BLOCKS) {
+        ota_handle_blocks();
+        return;
+    }
+    NOTA_LOGI("Incoming OTA update request ...\n");
+    if (cmd != U_FLASH && cmd != U_SPIFFS && cmd != U_MULTI) {
+        NOTA_LOGW("Unknown command: \"%d\"\n", cmd);
         while (ota_client->available()) ota_client->read();
         return;
     }
     _cmd = cmd;
+    _last_result = -1;
+    _session_start = millis();
     ota_client->read(); // skip ' '
 
-    Serial.printf("OTA Update type: %s\n", cmd == U_FLASH ? "U_FLASH" : "U_FS");
-#ifdef ESP
-    ota_client->setNoDelay(true);
-#endif
-    Serial.printf("OTA program size: ");
+    NOTA_LOGI("OTA Update type: %s\n", cmd == U_FLASH ? "U_FLASH" : cmd == U_MULTI ? "U_MULTI" : "U_FS");
+    Transport::prepare(*ota_client);
+    NOTA_LOGI("OTA program size: ");
     _size = this->parseInt();
-    Serial.printf("%d\n", _size);
+    NOTA_LOGI("%d\n", _size);
     ota_client->read(); // skip ' '
-    Serial.printf("OTA program MD5 hash: ");
-    _program_hash_ = readStringUntil('\n');
-    _program_hash_.trim();
+    NOTA_LOGI("OTA program MD5 hash: ");
+    // The hash may be followed by space separated key=value options
+    String request = readStringUntil('\n');
+    request.trim();
+    int options_start = request.indexOf(' ');
+    _program_hash_ = options_start < 0 ? request : request.substring(0, options_start);
+    _options = options_start < 0 ? "" : request.substring(options_start + 1);
     while (ota_client->available()) ota_client->read();
-    Serial.printf("%s\n", _program_hash_.c_str());
+    NOTA_LOGI("%s\n", _program_hash_.c_str());
+    if (_options.length()) NOTA_LOGD("OTA options: %s\n", _options.c_str());
     bool error = false;
     if (_program_hash_.length() != 32) {
-        Serial.println("Invalid MD5 hash length");
+        NOTA_LOGW("Invalid MD5 hash length\n");
+        _state = OTA_IDLE;
+        ota_reply("ERR:HASH");
+        error = true;
+#ifdef NOTA_MULTICAST
+    } else if (_mc_session) {
+        NOTA_LOGW("OTA multicast transfer in progress\n");
+        _state = OTA_IDLE;
+        ota_reply("ERR:BUSY");
+        error = true;
+#endif
+    } else if (cmd == U_FLASH && _program_hash_.equalsIgnoreCase(getImageHash()) && option("reflash") != "1") {
+        // Nothing to do, the client ends the session on its own
+        NOTA_LOGI("OTA image is already running, skipping update\n");
+        _state = OTA_IDLE;
+        ota_reply("SAME");
+    } else if (!parse_blocks()) {
+        NOTA_LOGW("Invalid delta block map\n");
+        _state = OTA_IDLE;
+        ota_reply("ERR:BLOCKS");
+        error = true;
+    } else if (!parse_extents()) {
+        NOTA_LOGW("Invalid extent list\n");
+        _state = OTA_IDLE;
+        ota_reply("ERR:EXTENTS");
+        error = true;
+    } else if (!parse_pull()) {
+        NOTA_LOGW("Invalid or unsupported pull URL\n");
+        _state = OTA_IDLE;
+        ota_reply("ERR:PULL");
+        error = true;
+    } else if (!parse_parts()) {
+        NOTA_LOGW("Invalid part manifest\n");
+        _state = OTA_IDLE;
+        ota_reply("ERR:PARTS");
+        error = true;
+    } else if (_password.length() && option("mac").length() && !auth_mac_valid()) {
+        NOTA_LOGW("Authentication failed: wrong request MAC\n");
+        _state = OTA_IDLE;
+        ota_reply("ERR:AUTH");
+        ota_error(OTA_AUTH_ERROR);
+        error = true;
+    } else if (_password.length() && option("mac").length() && _auth_floor_known && !auth_window_accept(strtoull(option("ts").c_str(), nullptr, 10))) {
+        NOTA_LOGW("Authentication failed: replayed request\n");
         _state = OTA_IDLE;
-        sprintf(ota_temp, "ERR:HASH %s|/%s|/%s|/%s|/%s", NOTA_VERSION, _hostname.c_str(), _platform.c_str(), _board.c_str(), _version.c_str());
-        ota_client->write((const char*) ota_temp, strlen(ota_temp));
+        ota_reply("ERR:REPLAY");
+        ota_error(OTA_AUTH_ERROR);
         error = true;
-    } else if (_password.length()) {
+    } else if (_password.length() && (!option("mac").length() || !_auth_floor_known)) {
         _nonce = MD5(micros());
-        sprintf(ota_temp, "AUTH %s %s|/%s|/%s|/%s|/%s", _nonce.c_str(), NOTA_VERSION, _hostname.c_str(), _platform.c_str(), _board.c_str(), _version.c_str());
-        // Serial.printf("Requesting OTA authentication: %s\n", auth_req);
-        ota_client->write((const char*) ota_temp, strlen(ota_temp));
+        char prefix[40];
+        snprintf(prefix, sizeof(prefix), "AUTH %s", _nonce.c_str());
+        ota_reply(prefix);
         delay(100);
         _state = OTA_WAITAUTH;
         _last_auth_time = millis();
     } else {
-        Serial.println("Authentication OK");
-        sprintf(ota_temp, "OK %s|/%s|/%s|/%s|/%s", NOTA_VERSION, _hostname.c_str(), _platform.c_str(), _board.c_str(), _version.c_str());
-        ota_client->write((const char*) ota_temp, strlen(ota_temp));
+        NOTA_LOGI("Authentication OK\n");
+        ota_reply("OK");
         delay(100);
         _state = OTA_RUNUPDATE;
         _last_update_time = millis();
     }
 }
 
-void NOTAClass::ota_handle_auth() {
+// Handshake reply: <prefix> followed by the device meta fields, the last one is the running image hash
+NOTA_TEMPLATE void NOTA_BASIC::ota_reply(const char* prefix) {
+    String hash = getImageHash();
+    char* out = _scratch.reply;
+    int n = snprintf(out, sizeof(_scratch.reply), "%s %s|/%s|/%s|/%s|/%s|/%s", prefix,
+        NOTA_VERSION, _hostname.c_str(), _platform.c_str(), _board.c_str(), _version.c_str(), hash.c_str());
+    if (n >= (int) sizeof(_scratch.reply)) n = sizeof(_scratch.reply) - 1;
+    if (n > 0) ota_client->write((const char*) out, (size_t) n);
+}
+
+// Single round trip handshake: the request carries ts=<n> and, as its last option, mac=<hex>, the HMAC-MD5 of the
+// request line before " mac=" keyed with the password hash. Signs the command, size, hash and every other option
+NOTA_TEMPLATE bool NOTA_BASIC::auth_mac_valid() {
+    String options = " " + _options;
+    int mac_start = options.indexOf(" mac=");
+    if (mac_start < 0 || options.indexOf(' ', mac_start + 1) >= 0 || !option("ts").length()) return false;
+    String request = String(_cmd) + ' ' + String(_size) + ' ' + _program_hash_ + options.substring(0, mac_start);
+    return HMAC_MD5(_password, request).equalsIgnoreCase(option("mac"));
+}
+
+// Replay window of the single round trip handshake: the NOTA_AUTH_WINDOW highest timestamps accepted so far, so
+// uploaders on several hosts may arrive a little out of order. Whatever drops out of the window raises the floor.
+// The window does not survive a restart, the highest timestamp does: it is stored before a request is accepted
+NOTA_TEMPLATE bool NOTA_BASIC::auth_window_accept(unsigned long long ts) {
+    if (!ts || ts <= _auth_floor) return false;
+    uint8_t lowest = 0;
+    for (uint8_t i = 0; i < _auth_window_count; i++) {
+        if (_auth_window[i] == ts) return false;
+        if (_auth_window[i] < _auth_window[lowest]) lowest = i;
+    }
+    if (!auth_floor_store(ts)) return false;
+    if (_auth_window_count < NOTA_AUTH_WINDOW) {
+        _auth_window[_auth_window_count++] = ts;
+    } else if (ts < _auth_window[lowest]) {
+        _auth_floor = ts;
+    } else {
+        _auth_floor = _auth_window[lowest];
+        _auth_window[lowest] = ts;
+    }
+    return true;
+}
+
+// Replay floor after a restart: the highest timestamp accepted so far, in NVS on ESP32 and in RTC backup registers on
+// STM32. Without one (new device, erased NVS, backup domain without power, ESP8266 after every restart) a signed
+// request gets the AUTH challenge, and the first one that passes it sets the floor to its timestamp
+NOTA_TEMPLATE void NOTA_BASIC::auth_floor_load() {
+    unsigned long long floor = 0;
+    _auth_floor_known = false;
+#if defined(ESP32)
+    nvs_handle_t nvs;
+    if (nvs_open("nota", NVS_READONLY, &nvs) == ESP_OK) {
+        uint64_t value = 0;
+        _auth_floor_known = nvs_get_u64(nvs, "auth_floor", &value) == ESP_OK;
+        floor = value;
+        nvs_close(nvs);
+    }
+#elif defined(ARDUINO_ARCH_STM32)
+    const volatile uint32_t* bkp = &RTC->BKP0R + NOTA_AUTH_BKP_REGISTER;
+    _auth_floor_known = (bkp[0] ^ bkp[1] ^ NOTA_AUTH_BKP_MAGIC) == bkp[2];
+    if (_auth_floor_known) floor = ((unsigned long long) bkp[1] << 32) | bkp[0];
+#endif
+    _auth_floor = floor;
+    _auth_stored = floor;
+    _auth_window_count = 0;
+}
+
+// Keeps ts as the floor after a restart, false when it could not be stored
+NOTA_TEMPLATE bool NOTA_BASIC::auth_floor_store(unsigned long long ts) {
+    if (ts <= _auth_stored) return true;
+#if defined(ESP32)
+    nvs_handle_t nvs;
+    if (nvs_open("nota", NVS_READWRITE, &nvs) != ESP_OK) return false;
+    bool ok = nvs_set_u64(nvs, "auth_floor", ts) == ESP_OK && nvs_commit(nvs) == ESP_OK;
+    nvs_close(nvs);
+    if (!ok) return false;
+#elif defined(ARDUINO_ARCH_STM32)
+    __HAL_RCC_PWR_CLK_ENABLE();
+    HAL_PWR_EnableBkUpAccess();
+    volatile uint32_t* bkp = &RTC->BKP0R + NOTA_AUTH_BKP_REGISTER;
+    // The check word goes first and last, a reset in between leaves no floor rather than a torn one
+    bkp[2] = 0;
+    bkp[0] = (uint32_t) ts;
+    bkp[1] = (uint32_t) (ts >> 32);
+    bkp[2] = bkp[0] ^ bkp[1] ^ NOTA_AUTH_BKP_MAGIC;
+#endif
+    _auth_stored = ts;
+    return true;
+}
+
+// Value of a key=value option from the request line, empty when not given
+NOTA_TEMPLATE String NOTA_BASIC::option(const char* key) {
+    const char* options = _options.c_str();
+    size_t key_length = strlen(key);
+    while (*options) {
+        const char* end = strchr(options, ' ');
+        if (!end) end = options + strlen(options);
+        if (end - options > (int) key_length && options[key_length] == '=' && !strncmp(options, key, key_length)) {
+            String value;
+            for (const char* c = options + key_length + 1; c < end; c++) value += *c;
+            return value;
+        }
+        options = *end ? end + 1 : end;
+    }
+    return "";
+}
+
+// Answers a status query in a single reply without touching the flash or the update state
+NOTA_TEMPLATE void NOTA_BASIC::ota_handle_query() {
+#ifdef NOTA_ESP
+    uint32_t free_space = ESP.getFreeSketchSpace();
+#else
+    uint32_t free_space = InternalStorage.maxSize();
+#endif
+    String hash = getImageHash();
+    // Slot that receives the next update, images for A/B slots are linked for a specific slot
+#ifdef NOTA_AB_SLOTS
+    const char* slot = getBootSlot() == 0 ? "B" : "A";
+#else
+    const char* slot = "-";
+#endif
+    char* out = _scratch.reply;
+    String staged = getStagedHash();
+    int n = snprintf(out, sizeof(_scratch.reply), "STAT %s|/%s|/%s|/%s|/%s|/%s|/%lu|/%lu|/%s|/%lu|/%s|/%s\n",
+        NOTA_VERSION, _hostname.c_str(), _platform.c_str(), _board.c_str(), _version.c_str(),
+        hash.c_str(), (unsigned long) free_space, (unsigned long) millis(),
+        ota_result_name(_last_result), (unsigned long) _last_duration, slot, staged.length() ? staged.c_str() : "-");
+    if (n <= 0 || n >= (int) sizeof(_scratch.reply)) {
+        ota_client->write("ERR:QUERY", 9);
+        return;
+    }
+    ota_client->write((const char*) out, (size_t) n);
+}
+
+NOTA_TEMPLATE void NOTA_BASIC::ota_handle_auth() {
     int cmd = this->parseInt();
     if (cmd != U_AUTH && cmd != U_TEST) {
-        Serial.printf("Authentication failed: Wrong command \"%d\"\n", cmd);
+        NOTA_LOGW("Authentication failed: Wrong command \"%d\"\n", cmd);
         ota_client->write("ERR:CMD", 7);
         _state = OTA_IDLE;
         return;
     }
     if (cmd == U_AUTH && _size <= 0) {
-        Serial.printf("Authentication failed: Invalid size %d\n", _size);
+        NOTA_LOGW("Authentication failed: Invalid size %d\n", _size);
         ota_client->write("ERR:SIZE", 8);
         _state = OTA_IDLE;
         return;
     }
-    Serial.printf("Authenticating ");
+    NOTA_LOGI("Authenticating ");
     ota_client->read();
-    Serial.printf(".");
+    NOTA_LOGD(".");
     String cnonce = readStringUntil(' ');
-    Serial.printf(".");
+    NOTA_LOGD(".");
     String response = readStringUntil('\n');
     while (ota_client->available()) ota_client->read();
-    Serial.printf(".");
+    NOTA_LOGD(".");
     if (cnonce.length() != 32 || response.length() != 32) {
-        Serial.printf(" failed: Invalid key length\n");
+        NOTA_LOGW(" failed: Invalid key length\n");
         ota_client->write("ERR:KEY", 7);
         _state = OTA_IDLE;
         return;
     }
-    Serial.printf(".");
+    NOTA_LOGD(".");
     String challenge = _password + ':' + _nonce + ':' + cnonce;
-    Serial.printf(".");
+    NOTA_LOGD(".");
     String result = MD5(challenge);
-    Serial.printf(".");
+    NOTA_LOGD(".");
     if (result.equals(response)) {
-        Serial.println(" OK");
+        NOTA_LOGI(" OK\n");
         if (cmd == U_TEST) {
             _state = OTA_IDLE;
             delay(100);
@@ -506,15 +1362,21 @@ void NOTAClass::ota_handle_auth() {
             delay(100);
             while (ota_client->available()) ota_client->read();
         } else { // Run update
+            // A signed request that got the challenge because the device had no floor sets it
+            unsigned long long ts = strtoull(option("ts").c_str(), nullptr, 10);
+            if (!_auth_floor_known && option("mac").length() && ts && auth_floor_store(ts)) {
+                _auth_floor = ts;
+                _auth_floor_known = true;
+            }
             _state = OTA_RUNUPDATE;
             _last_update_time = millis();
         }
         return;
     } else {
-        Serial.printf(" failed - wrong nonce - expected \"%s\" but got \"%s\"\n", result.c_str(), response.c_str());
+        NOTA_LOGW(" failed - wrong nonce - expected \"%s\" but got \"%s\"\n", result.c_str(), response.c_str());
         ota_client->write("ERR:AUTH", 9);
         delay(100);
-        if (_error_callback) _error_callback(OTA_AUTH_ERROR);
+        ota_error(OTA_AUTH_ERROR);
         _state = OTA_IDLE;
     }
 }
@@ -522,18 +1384,89 @@ void NOTAClass::ota_handle_auth() {
 
 
 
-void NOTAClass::ota_handle_update() {
-#ifdef ESP
-    if (!Update.begin(_size, _cmd)) {
-#elif defined(ARDUINO_ARCH_STM32) // Using ArduinoOTA with NO_OTA_NETWORK -> InternalStorage
+NOTA_TEMPLATE void NOTA_BASIC::ota_handle_update() {
     // Fire callbacks BEFORE flash operations - on STM32F4 single-bank flash,
     // any ISR executing from flash during erase/write will hard-fault.
-    if (_request_callback) _request_callback();
-    if (_start_callback) _start_callback();
+    notify(OTA_EVENT_REQUEST);
+    notify(OTA_EVENT_START);
+    free(_config);
+    _config = nullptr;
+    _config_size = 0;
+    _flash_received = false;
+    // A single image is a session of one part. Every part starts with "OK" once its storage is ready
+    // and nothing is committed before the last one is verified: a config blob waits in RAM for the firmware
+    bool multi = _cmd == U_MULTI;
+    bool ok = true;
+    for (uint8_t i = 0; i < _part_count && ok; i++) {
+        _cmd = _parts[i].cmd;
+        _size = _parts[i].size;
+        _program_hash_ = _parts[i].hash;
+        if (multi) {
+            _transfer_size = _size;
+            _block_size = 0;
+            _extent_count = 0;
+            NOTA_LOGI("OTA part %u of %u: command %d, %d bytes\n", i + 1, _part_count, _cmd, _size);
+        }
+        _header = _cmd == U_FLASH && option("hdr") == "1";
+        if ((_header && !ota_check_header()) || !ota_begin_part()) {
+            delay(50);
+            while (ota_client->available()) ota_client->read();
+            _state = OTA_IDLE;
+            return;
+        }
+        while (ota_client->available()) ota_client->read();
+        NOTA_LOGI("OTA Update started\n");
+        ota_client->write("OK", 2);
+        delayMicroseconds(10);
+        notify(OTA_EVENT_PROGRESS, 0, _size);
+        if (i == 0) delay(500);
+#ifdef NOTA_PULL
+        if (_pull_host.length()) ok = ota_pull_part();
+        else
+#endif
+        ok = ota_receive_part();
+        if (ok && _cmd == U_FLASH) _flash_received = true;
+    }
+    ota_finish(ok);
+    if (multi) _cmd = U_MULTI;
+}
+
+// Opens the storage for the current part (_cmd, _size) and reports a failure to the client
+NOTA_TEMPLATE bool NOTA_BASIC::ota_begin_part() {
+    _image_offset = 0;
+    if (_cmd == U_CONFIG) {
+        _config = (uint8_t*) malloc(_size);
+        if (_config) return true;
+        NOTA_LOGE("Update Begin Error: no memory for %d bytes of config\n", _size);
+        ota_client->printf("ERR: No memory for %d bytes of config", _size);
+        ota_error(OTA_BEGIN_ERROR);
+        return false;
+    }
+#ifdef ESP32
+    // The update partition is about to be overwritten (STM32 erases the record with the slot)
+    if (_cmd == U_FLASH) drop_staged();
+#endif
+#ifdef ARDUINO_ARCH_STM32
+    if (_cmd == U_FS) {
+        int data_error = DataStorage.open(_size);
+        if (!data_error) return true;
+        const char* reason = data_error == 5 ? "No data partition for a filesystem image"
+            : data_error == 6 ? "The data partition is not usable"
+            : data_error == 1 ? "Filesystem image larger than the data partition"
+            : "Unable to open the data partition";
+        NOTA_LOGE("Update Begin Error: %s\n", reason);
+        ota_client->printf("ERR: %s", reason);
+        ota_error(OTA_BEGIN_ERROR);
+        return false;
+    }
+#endif
+#ifdef NOTA_ESP
+    if (!Update.begin(_size, _cmd)) {
+#elif defined(ARDUINO_ARCH_STM32) // Using ArduinoOTA with NO_OTA_NETWORK -> InternalStorage
     int ota_open_error = InternalStorage.open(_size);
     if (ota_open_error > 0) {
 #endif
-        Serial.println("Update Begin Error");
+        NOTA_LOGE("Update Begin Error\n");
 #if defined(ESP8266)
         StreamString ___e;
         Update.printError(___e);
@@ -543,15 +1476,15 @@ void NOTAClass::ota_handle_update() {
 #else
         int32_t max_size = InternalStorage.maxSize();
 
-        sprintf(ota_temp, "Unable to open InternalStorage with size %d, max size is %d", _size, max_size);
+        snprintf(_scratch.text, sizeof(_scratch.text), "Unable to open InternalStorage with size %d, max size is %d", _size, max_size);
         switch (ota_open_error) {
-            case 1: Serial.println("(1) Size overflow"); break;
-            case 2: Serial.println("(2) HAL_FLASH_Unlock problem"); break;
-            case 3: Serial.println("(3) HAL_FLASHEx_Erase problem"); break;
-            case 4: Serial.println("(4) SectorError problem"); break;
-            default: Serial.printf("(%d) Unknown error code\n", ota_open_error); break;
+            case 1: NOTA_LOGE("(1) Size overflow\n"); break;
+            case 2: NOTA_LOGE("(2) HAL_FLASH_Unlock problem\n"); break;
+            case 3: NOTA_LOGE("(3) HAL_FLASHEx_Erase problem\n"); break;
+            case 4: NOTA_LOGE("(4) SectorError problem\n"); break;
+            default: NOTA_LOGE("(%d) Unknown error code\n", ota_open_error); break;
         }
-        String ss = ota_temp;
+        String ss = _scratch.text;
 #endif
         // Remove the trailing newline character from the error string
         bool done = false;
@@ -559,118 +1492,455 @@ void NOTAClass::ota_handle_update() {
             if (ss[i] == '\n' || ss[i] == '\r') ss.remove(i);
             else done = true;
         }
-        Serial.printf("Error: %s\n", ss.c_str());
+        NOTA_LOGE("Error: %s\n", ss.c_str());
         ota_client->printf("ERR: %s", ss.c_str());
-        if (_error_callback) _error_callback(OTA_BEGIN_ERROR);
-        delay(50);
-        while (ota_client->available()) ota_client->read();
-        _state = OTA_IDLE;
-        return;
+        ota_error(OTA_BEGIN_ERROR);
+        return false;
     }
-    while (ota_client->available()) ota_client->read();
-    Serial.println("OTA Update started");
-
-    // Note: _request_callback and _start_callback already called before InternalStorage.open()
-    // Serial.printf("Sketch start address: 0x%08X\n", FLASH_BASE + InternalStorage.SKETCH_START_ADDRESS);
-    // Serial.printf("Page size: %d\n", InternalStorage.PAGE_SIZE);
-    // Serial.printf("Max flash: %d \n", InternalStorage.MAX_FLASH);
-    // Serial.printf("OTA sector: %d \n", InternalStorage.sector);
-    // Serial.printf("OTA sector size: %d \n", InternalStorage.sector_size);
-    // Serial.printf("OTA start address: 0x%08X \n", InternalStorage.storageStartAddress);
-    // Serial.printf("OTA max sketch size: %d \n", InternalStorage.maxSketchSize);
-    // Serial.printf("OTA page aligned length: %d \n", InternalStorage.pageAlignedLength);
-    // Serial.printf("OTA EraseInitStruct.TypeErase: %d \n", InternalStorage.EraseInitStruct.TypeErase);
-    // Serial.printf("OTA EraseInitStruct.NbSectors: %d \n", InternalStorage.EraseInitStruct.NbSectors);
-    // Serial.printf("OTA EraseInitStruct.Banks: %d \n", InternalStorage.EraseInitStruct.Banks);
-    // Serial.printf("OTA EraseInitStruct.Sector: %d \n", InternalStorage.EraseInitStruct.Sector);
-    // Serial.printf("OTA EraseInitStruct.VoltageRange: %d \n", InternalStorage.EraseInitStruct.VoltageRange);
-
-
-    ota_client->write("OK", 2);
-#ifdef ESP
+#ifdef NOTA_ESP
     Update.setMD5(_program_hash_.c_str());
 #endif
-    delayMicroseconds(10);
-    if (_progress_callback) _progress_callback(0, _size);
-    delay(500);
-    // WiFiUDP::stopAll();
-    // WiFiClient::stopAll();
-#ifdef ESP
-    ota_client->setNoDelay(true);
-#endif
-    uint32_t written = 0;
+    return true;
+}
+
+// Image header (hdr=1): asks for it with "OK" and checks it before the update slot is erased, so a wrong image
+// is refused after one round trip instead of after the erase and the whole transfer
+NOTA_TEMPLATE bool NOTA_BASIC::ota_check_header() {
+    while (ota_client->available()) ota_client->read();
+    ota_client->write("OK", 2);
+    nota_image_header_t& header = _scratch.header;
+    uint8_t* out = (uint8_t*) &header;
+    uint32_t got = 0;
+    uint32_t start = millis();
+    while (got < sizeof(header) && millis() - start < 5000UL && (ota_client->connected() || ota_client->available())) {
+        if (!ota_client->available()) {
+            receive_wait();
+            continue;
+        }
+        int n = ota_client->read(out + got, sizeof(header) - got);
+        if (n > 0) got += n;
+    }
+    const char* error = nullptr;
+    char md5[33];
+    for (int i = 0; i < 16; i++) snprintf(md5 + 2 * i, 3, "%02x", got == sizeof(header) ? header.md5[i] : 0);
+    if (got != sizeof(header) || header.magic != NOTA_HEADER_MAGIC || header.image_size != (uint32_t) _size || !_program_hash_.equalsIgnoreCase(md5)) {
+        error = "ERR:HEADER";
+    } else if (header.board[0] && strncmp(header.board, _board.c_str(), sizeof(header.board))) {
+        error = "ERR:BOARD";
+    } else {
+#ifdef ARDUINO_ARCH_STM32
+        if (header.link_address && header.link_address != InternalStorage.runAddress()) error = "ERR:ADDRESS";
+        else if (!InternalStorage.vectorsValid(header.vector[0], header.vector[1])) error = "ERR:VECTOR";
+#else
+        bool image = (header.vector[0] & 0xFF) == 0xE9; // ESP image magic byte
+#if defined(ESP8266)
+        image = image || (header.vector[0] & 0xFFFF) == 0x8B1F; // gzip compressed image
+#endif
+        if (!image) error = "ERR:VECTOR";
+#endif
+    }
+    if (error) {
+        NOTA_LOGE("Image header rejected: %s\n", error);
+        ota_client->write(error, strlen(error));
+        ota_error(OTA_BEGIN_ERROR);
+        return false;
+    }
+    NOTA_LOGI("Image header: board \"%.16s\", version \"%.12s\", linked at 0x%08lX\n", header.board, header.version, (unsigned long) header.link_address);
+    _header_vector[0] = header.vector[0];
+    _header_vector[1] = header.vector[1];
+    return true;
+}
+
+// Receives the current part and verifies it, returns false on any error
+NOTA_TEMPLATE bool NOTA_BASIC::ota_receive_part() {
+    Transport::prepare(*ota_client);
+    uint32_t written = 0;
     uint32_t total = 0;
     int waited = 1000;
-#ifdef ESP
-    while (_state == OTA_RUNUPDATE && !Update.isFinished() && (ota_client->connected() || ota_client->available())) {
-#else
     bool valid = true;
-    while (valid && _state == OTA_RUNUPDATE && (ota_client->connected() || ota_client->available())) {
-        // while (_state == OTA_RUNUPDATE && total < _size && valid && ota_client->connected() && ota_client->available()) {
+    _receiver.begin(_transfer_size);
+#ifdef ARDUINO_ARCH_STM32
+    _data_receiver.begin(_transfer_size);
+#endif
+    rate_begin();
+#ifdef NOTA_ESP
+    while (valid && _state == OTA_RUNUPDATE && total < _transfer_size && (_cmd == U_CONFIG || !Update.isFinished()) && (ota_client->connected() || ota_client->available())) {
+#else
+    while (valid && _state == OTA_RUNUPDATE && total < _transfer_size && (ota_client->connected() || ota_client->available())) {
 #endif
+        uint32_t allowed = rate_allowance();
+        if (!allowed) {
+            receive_wait(); // Held back by the rate limit, not a receive timeout
+            continue;
+        }
         bool available = ota_client->available();
         if (!available && waited--) {
-            delay(1);
+            receive_wait();
             continue;
         }
         if (!available) {
-            Serial.printf("\nReceive Failed: TIMEOUT\n");
-            if (_error_callback) _error_callback(OTA_RECEIVE_ERROR);
+            NOTA_LOGE("\nReceive Failed: TIMEOUT\n");
+            ota_error(OTA_RECEIVE_ERROR);
             valid = false;
             break;
         }
         waited = 1000;
-#ifdef ESP
-        written = Update.write(*ota_client);
-#else
         written = 0;
-        while (valid && (ota_client->available())) {
-            uint8_t b = ota_client->read();
-            if (!InternalStorage.write(b)) {
-                Serial.printf("\nReceive Failed: InternalStorage.write\n");
-                if (_error_callback) _error_callback(OTA_RECEIVE_ERROR);
+        if (!_block_size && _cmd != U_CONFIG) {
+            // Plain image: whole reads into the scratch buffer, written through the storage policy. A sparse one
+            // fills the gap before the next extent and reads up to its end
+            int32_t received;
+            if (!ota_fill()) received = -1;
+#ifdef ARDUINO_ARCH_STM32
+            else if (_cmd == U_FS) received = _data_receiver.receive(*ota_client, _scratch.copy, sizeof(_scratch.copy), allowed);
+#endif
+#ifdef NOTA_LWIP_RAW
+            else if (!_extent_count && !_rate) received = ota_receive_raw(_transfer_size - total);
+#endif
+            else received = _receiver.receive(*ota_client, _scratch.copy, sizeof(_scratch.copy), allowed < extent_left() ? allowed : extent_left());
+#ifdef NOTA_ESP
+            if (Update.hasError()) received = -1;
+#endif
+            if (received < 0) {
+                NOTA_LOGE("\nReceive Failed: storage write\n");
+                ota_error(OTA_RECEIVE_ERROR);
                 valid = false;
                 break;
-            } else {
-                if ((total + written) < 0xFF) {
-                    Serial.printf("%02X ", b);
-                }
             }
-            written++;
-#endif
-            if (written >= InternalStorage.maxSize()) {
-                Serial.printf("\nReceive Failed: SIZE OVERFLOW\n");
-                if (_error_callback) _error_callback(OTA_RECEIVE_ERROR);
+            written = received;
+            _image_offset += received;
+        }
+        // Delta transfer: received bytes never cross a block boundary, unchanged blocks are copied in between.
+        // Config parts are collected in RAM
+        while (valid && (_block_size || _cmd == U_CONFIG) && ota_client->available() && total + written < _transfer_size && written < allowed) {
+            if (!ota_fill()) {
+                NOTA_LOGE("\nReceive Failed: block copy\n");
+                ota_error(OTA_RECEIVE_ERROR);
+                valid = false;
+                break;
+            }
+            uint8_t* buf = _scratch.copy;
+            uint32_t n = sizeof(_scratch.copy);
+            if (_block_size && _block_size - _image_offset % _block_size < n) n = _block_size - _image_offset % _block_size;
+            if (allowed - written < n) n = allowed - written;
+            if (_transfer_size - total - written < n) n = _transfer_size - total - written;
+            int received = ota_client->read(buf, n);
+            if (received <= 0) break;
+            if (!ota_write(buf, received)) {
+                NOTA_LOGE("\nReceive Failed: storage write\n");
+                ota_error(OTA_RECEIVE_ERROR);
                 valid = false;
                 break;
             }
-            if (written > _size) {
-                Serial.printf("\nReceive Failed: SIZE MISMATCH\n");
-                if (_error_callback) _error_callback(OTA_RECEIVE_ERROR);
+            written += received;
+            _image_offset += received;
+        }
+        if (!valid) break;
+        if (_image_offset > (uint32_t) _size) {
+            NOTA_LOGE("\nReceive Failed: SIZE MISMATCH\n");
+            ota_error(OTA_RECEIVE_ERROR);
+            valid = false;
+            break;
+        }
+#ifdef ARDUINO_ARCH_STM32
+        // The vector table checked with the header must be the one that was written
+        if (_header && _image_offset >= 8) {
+            _header = false;
+            const volatile uint32_t* vectors = (const volatile uint32_t*) program_ota_address;
+            if (vectors[0] != _header_vector[0] || vectors[1] != _header_vector[1]) {
+                NOTA_LOGE("\nReceive Failed: vector table differs from the header\n");
+                ota_error(OTA_RECEIVE_ERROR);
                 valid = false;
                 break;
             }
         }
+#endif
         if (written > 0) {
+            rate_consume(written);
             ota_client->print(written, DEC);
             total += written;
-            if (_progress_callback) _progress_callback(total, _size);
-            if (total >= _size) break;
+            notify(OTA_EVENT_PROGRESS, _image_offset, _size);
+        }
+    }
+    // A delta transfer ends with the unchanged blocks after the last changed one, a sparse one with the last gap
+    if (valid && !ota_fill()) {
+        NOTA_LOGE("\nReceive Failed: block copy\n");
+        ota_error(OTA_RECEIVE_ERROR);
+        valid = false;
+    }
+    if (!valid || total != _transfer_size) return false;
+    if (_cmd == U_CONFIG) {
+        MD5_CTX ctx;
+        uint8_t digest[16];
+        MD5::MD5Init(&ctx);
+        MD5::MD5Update(&ctx, _config, _size);
+        MD5::MD5Final(digest, &ctx);
+        char* md5str = MD5::make_digest(digest, 16);
+        bool match = _program_hash_.equalsIgnoreCase(md5str);
+        free(md5str);
+        if (!match) NOTA_LOGE("Config Failed: MD5 mismatch\n");
+        return match;
+    }
+    // The hash policy saw the image when the receiver took all of it
+    if (_receiver.received() == (uint32_t) _size && !_receiver.finish(_program_hash_.c_str())) {
+        NOTA_LOGE("Update Failed: MD5 mismatch while receiving\n");
+        return false;
+    }
+#ifdef NOTA_ESP
+    return Update.end();
+#else
+    return _image_offset == (uint32_t) _size && ota_verify();
+#endif
+}
+
+#ifdef NOTA_PULL
+// Header line of an HTTP response without the line end, false when none arrived in time
+inline bool pull_read_line(nota_pull_client_t& http, char* line, size_t size) {
+    size_t n = 0;
+    uint32_t start = millis();
+    while (millis() - start < NOTA_PULL_TIMEOUT) {
+        if (!http.available()) {
+            if (!http.connected()) return false;
+            delay(1);
+            continue;
+        }
+        int c = http.read();
+        if (c == '\n') {
+            if (n && line[n - 1] == '\r') n--;
+            line[n] = '\0';
+            return true;
+        }
+        if (n < size - 1) line[n++] = (char) c;
+    }
+    return false;
+}
+
+// Pull mode: fetches the image with HTTP range requests of NOTA_PULL_RANGE bytes, the next one only after the previous
+// one is written, so the server sends exactly as fast as the flash takes it. A failed request is repeated on a new
+// connection from the last written byte. The uploader gets "<bytes written>\n" after every range on the session connection
+NOTA_TEMPLATE bool NOTA_BASIC::ota_pull_part() {
+    nota_pull_client_t http;
+    uint8_t failures = 0;
+    rate_begin();
+    NOTA_LOGI("OTA pull from %s:%u%s\n", _pull_host.c_str(), _pull_port, _pull_path.c_str());
+    while (_image_offset < (uint32_t) _size) {
+        uint32_t allowed = rate_allowance();
+        if (!allowed) {
+            receive_wait();
+            continue;
+        }
+        uint32_t length = (uint32_t) _size - _image_offset;
+        if (length > NOTA_PULL_RANGE) length = NOTA_PULL_RANGE;
+        if (length > allowed) length = allowed;
+        int32_t written = pull_range(http, length);
+        if (written < 0) break; // Storage error, repeating does not help
+        if (written > 0) {
+            rate_consume(written);
+            ota_client->print(_image_offset, DEC);
+            ota_client->print('\n');
+            notify(OTA_EVENT_PROGRESS, _image_offset, _size);
+        }
+        if ((uint32_t) written == length) {
+            failures = 0;
+            continue;
         }
+        http.stop();
+        if (++failures > NOTA_PULL_RETRIES) break;
+        NOTA_LOGW("OTA pull: retry %u at %lu\n", failures, (unsigned long) _image_offset);
+        for (uint32_t start = millis(); millis() - start < (100UL << failures);) receive_wait();
     }
-#ifdef ESP
-    if (Update.end()) {
+    http.stop();
+    if (_image_offset != (uint32_t) _size) {
+        NOTA_LOGE("\nReceive Failed: pull\n");
+        ota_client->write("ERR:PULL", 8);
+        ota_error(OTA_RECEIVE_ERROR);
+        return false;
+    }
+#ifdef NOTA_ESP
+    return Update.end();
 #else
-    // TODO: verify MD5 hash
-    if (valid && _state == OTA_RUNUPDATE && total == _size) {
+    return ota_verify();
 #endif
-        Serial.printf("Update Success: %u\n", total);
+}
 
-        if (_end_callback) _end_callback();
+// One range request from the current image offset, returns the bytes written (fewer than length when the request
+// failed) or -1 when the storage refused them
+NOTA_TEMPLATE int32_t NOTA_BASIC::pull_range(nota_pull_client_t& http, uint32_t length) {
+    if (!http.connected()) {
+        http.stop();
+        if (!http.connect(_pull_host.c_str(), _pull_port)) return 0;
+#ifdef NOTA_ESP
+        http.setNoDelay(true);
+#endif
+    }
+    String request = "GET " + _pull_path + " HTTP/1.1\r\nHost: " + _pull_host + "\r\nRange: bytes=" + String(_image_offset) + '-' + String(_image_offset + length - 1) + "\r\n\r\n";
+    http.print(request);
+
+    // Status line, then the headers up to the empty line. The body goes through the same scratch buffer afterwards
+    char* line = _scratch.text;
+    if (!pull_read_line(http, line, sizeof(_scratch.text)) || strncmp(line, "HTTP/1.", 7) || atoi(line + 9) != 206) {
+        NOTA_LOGW("OTA pull: expected 206 Partial Content\n");
+        return 0;
+    }
+    uint32_t content_length = 0;
+    bool range_ok = false;
+    bool complete = false;
+    while (pull_read_line(http, line, sizeof(_scratch.text))) {
+        if (!line[0]) {
+            complete = true;
+            break;
+        }
+        if (!strncasecmp(line, "Content-Length:", 15)) {
+            content_length = strtoul(line + 15, nullptr, 10);
+        } else if (!strncasecmp(line, "Content-Range:", 14)) {
+            const char* range = strstr(line, "bytes ");
+            range_ok = range && strtoul(range + 6, nullptr, 10) == _image_offset;
+        }
+    }
+    if (!complete || !range_ok || !content_length || content_length > length) return 0;
 
-        delay(10);
+    uint32_t written = 0;
+    uint32_t last_data = millis();
+    while (written < content_length && millis() - last_data < NOTA_PULL_TIMEOUT) {
+        if (http.available() <= 0) {
+            if (!http.connected()) break;
+            receive_wait();
+            continue;
+        }
+        uint32_t n = content_length - written < sizeof(_scratch.copy) ? content_length - written : sizeof(_scratch.copy);
+        int received = http.read(_scratch.copy, n);
+        if (received <= 0) continue;
+        if (!ota_write(_scratch.copy, received)) return -1;
+        written += received;
+        _image_offset += received;
+        last_data = millis();
+    }
+    return written;
+}
+#endif // NOTA_PULL
+
+#ifdef NOTA_LWIP_RAW
+// Hands the received image data to Update without the Stream copy, at most limit bytes, returns the bytes written.
+// ESP8266: the payload of the pbuf at the head of the receive queue, peekConsume() acks it with tcp_recved().
+// ESP32: WiFiClient sits on the socket API, the data is taken from the socket directly instead of through the
+// WiFiClient receive buffer. lwip_recv() acks what it returns, so both advance the window only after Update.write()
+NOTA_TEMPLATE uint32_t NOTA_BASIC::ota_receive_raw(uint32_t limit) {
+    uint32_t written = 0;
+#if defined(ESP8266)
+    if (!ota_client->hasPeekBufferAPI()) return Update.write(*ota_client);
+    while (written < limit && !Update.hasError()) {
+        size_t n = ota_client->peekAvailable();
+        if (!n) break;
+        if (n > limit - written) n = limit - written;
+        size_t taken = Update.write((uint8_t*) ota_client->peekBuffer(), n);
+        ota_client->peekConsume(taken);
+        written += taken;
+        if (taken < n) break;
+    }
+#else
+    while (written < limit && !Update.hasError()) {
+        uint32_t n = limit - written < sizeof(_scratch.copy) ? limit - written : sizeof(_scratch.copy);
+        int received = lwip_recv(ota_client->fd(), _scratch.copy, n, MSG_DONTWAIT);
+        if (received <= 0) break;
+        size_t taken = Update.write(_scratch.copy, received);
+        written += taken;
+        if (taken < (size_t) received) break;
+    }
+#endif
+    return written;
+}
+#endif // NOTA_LWIP_RAW
+
+// Each part starts with a full bucket, the adaptive rate starts at the limit (or a step above the floor without one)
+NOTA_TEMPLATE void NOTA_BASIC::rate_begin() {
+    _rate = _max_rate ? _max_rate : _rate_probe ? NOTA_RATE_MIN + NOTA_RATE_STEP : 0;
+    _rate_time = _rate_probe_time = millis();
+    _rate_credit = 0;
+    if (_rate) _rate_credit = (uint64_t) _rate * NOTA_RATE_BURST_MS;
+}
+
+// Bytes the rate limit lets through now, refills the token bucket and runs the adaptive probe
+NOTA_TEMPLATE uint32_t NOTA_BASIC::rate_allowance() {
+    if (!_rate) return UINT32_MAX;
+    uint32_t now = millis();
+    if (_rate_probe && now - _rate_probe_time >= NOTA_RATE_INTERVAL) {
+        _rate_probe_time = now;
+        uint32_t ceiling = _max_rate ? _max_rate : UINT32_MAX - NOTA_RATE_STEP;
+        if (_rate_probe()) _rate = _rate / 2 > NOTA_RATE_MIN ? _rate / 2 : NOTA_RATE_MIN;
+        else _rate = _rate + NOTA_RATE_STEP < ceiling ? _rate + NOTA_RATE_STEP : ceiling;
+    }
+    uint32_t elapsed = now - _rate_time;
+    if (elapsed > NOTA_RATE_BURST_MS) elapsed = NOTA_RATE_BURST_MS;
+    uint64_t credit = _rate_credit + (uint64_t) _rate * elapsed;
+    uint64_t depth = (uint64_t) _rate * NOTA_RATE_BURST_MS;
+    _rate_credit = credit < depth ? credit : depth;
+    _rate_time = now;
+    return (uint32_t) (_rate_credit / 1000); // At most a tenth of the rate
+}
+
+NOTA_TEMPLATE void NOTA_BASIC::rate_consume(uint32_t bytes) {
+    if (!_rate) return;
+    uint64_t used = (uint64_t) bytes * 1000;
+    _rate_credit = used < _rate_credit ? _rate_credit - used : 0;
+}
+
+// One ms of waiting in the receive loop, handed to the application when it asked for it
+NOTA_TEMPLATE void NOTA_BASIC::receive_wait() {
+#ifdef ESP32
+    if (!_task) _callbacks.yield();
+#else
+    _callbacks.yield();
+#endif
+    delay(1);
+}
+
+NOTA_TEMPLATE void NOTA_BASIC::reboot_after_update(bool force) {
+    if (_rebootOnSuccess || force) {
+        NOTA_LOGI("Rebooting after successful update\n");
+#ifdef ESP32
+        if (!_task) flushLog();
+#else
+        flushLog();
+#endif
+        //let serial/network finish tasks that might be given in _end_callback
+#ifdef ESP32
+        wait_events_delivered(2000);
+#endif
+        delay(1000);
+#ifdef NOTA_ESP
+        ESP.restart();
+#else
+        NVIC_SystemReset();
+#endif
+    } else {
+        NOTA_LOGI("Skipping reboot after successful update\n");
+    }
+}
+
+// Commits the session: config callback, final "OK", STM32 image apply and reboot
+NOTA_TEMPLATE void NOTA_BASIC::ota_finish(bool ok) {
+    bool staged = true;
+    if (ok) {
+#ifdef ARDUINO_ARCH_STM32
         InternalStorage.close();
+#endif
+        // The stage record is written before the host hears "OK" and before any relay. On ESP32 it also points the
+        // boot partition back at the running image, Update.end() had already selected the new one
+        if (_stageOnly && _flash_received) {
+            for (uint8_t i = 0; i < _part_count; i++) {
+                if (_parts[i].cmd == U_FLASH && !stage_image(_parts[i].size, _parts[i].hash)) staged = false;
+            }
+        }
+    }
+    if (ok && staged) {
+        NOTA_LOGI("Update Success: %u part(s)\n", _part_count);
+        _last_result = OTA_RESULT_OK;
+        _last_duration = millis() - _session_start;
 
+        if (_config_size) notify(OTA_EVENT_CONFIG, (uint32_t) (uintptr_t) _config, _config_size);
+        notify(OTA_EVENT_END);
+
+        delay(10);
 
         // Ensure last count packet has been sent out and not combined with the final OK
         ota_client->flush();
@@ -680,27 +1950,35 @@ void NOTAClass::ota_handle_update() {
         delay(1000);
         ota_client->stop();
         delay(100);
-        Serial.printf("Update Success\n");
-#ifdef ARDUINO_ARCH_STM32
-        InternalStorage.apply();
+        NOTA_LOGI("Update Success\n");
+#ifdef NOTA_RELAY
+        relay_image();
 #endif
-        if (_rebootOnSuccess) {
-            Serial.printf("Rebooting after successful update\n");
-            //let serial/network finish tasks that might be given in _end_callback
-            delay(1000);
-#ifdef ESP
-            ESP.restart();
+        if (!_stageOnly || !_flash_received) {
+#ifdef ARDUINO_ARCH_STM32
+            // A filesystem image is in use once written, only new firmware needs the restart
+            if (_flash_received) {
+                InternalStorage.apply();
+                reboot_after_update();
+            }
 #else
-            NVIC_SystemReset();
+            reboot_after_update();
 #endif
-        } else {
-            Serial.printf("Skipping reboot after successful update\n");
         }
+    } else if (!staged) {
+        ota_error(OTA_END_ERROR);
+        ota_client->flush();
+        delay(100);
+        ota_client->print("ERR:STAGE");
+        ota_client->flush();
+        delay(100);
     } else {
-        if (_error_callback) _error_callback(OTA_END_ERROR);
-#ifdef ESP
-        Update.printError(*ota_client);
-        Update.printError(Serial);
+        ota_error(OTA_END_ERROR);
+#ifdef NOTA_ESP
+        if (_cmd != U_CONFIG) Update.printError(*ota_client);
+#if NOTA_LOG_LEVEL >= NOTA_LOG_ERROR
+        Update.printError(OTA_DEBUG);
+#endif
 #endif
         delay(100);
     }
@@ -709,7 +1987,7 @@ void NOTAClass::ota_handle_update() {
 }
 
 #ifdef NOTA_BROADCAST
-void NOTAClass::handle_broadcast() {
+NOTA_TEMPLATE void NOTA_BASIC::handle_broadcast() {
     if (!this->_initialized) return;
     uint32_t now = millis();
     int32_t elapsed = (int32_t) (now - last_broadcast);
@@ -724,12 +2002,12 @@ void NOTAClass::handle_broadcast() {
         int packetSize = udp.parsePacket();
         if (packetSize <= 0) continue;
 
-        // logf("Broadcast packet received, size: %d\n", packetSize);
+        NOTA_LOGD("Broadcast packet received, size: %d\n", packetSize);
 
-        char inBuf[512];
-        int len = udp.read((uint8_t*) inBuf, sizeof(inBuf) - 1);
+        char* inBuf = _scratch.packet;
+        int len = udp.read((uint8_t*) inBuf, sizeof(_scratch.packet) - 1);
         if (len <= 0) {
-            // logf("Broadcast read error: %d\n", len); 
+            NOTA_LOGD("Broadcast read error: %d\n", len);
             continue;
         }
         inBuf[len] = '\0';
@@ -737,7 +2015,7 @@ void NOTAClass::handle_broadcast() {
         // Minimal check for discovery request
         if (!strstr(inBuf, "\"m\"") || !strstr(inBuf, NOTA_BC_MAGIC) ||
             !strstr(inBuf, "\"t\"") || !strstr(inBuf, "disc_req")) {
-            // logf("Ignoring non DISC_REQ broadcast");
+            NOTA_LOGD("Ignoring non DISC_REQ broadcast\n");
             continue;
         }
 
@@ -775,8 +2053,9 @@ void NOTAClass::handle_broadcast() {
         }
 
         // Compose JSON response (includes platform, hostname, port, NOTA version)
-        char out[1024];
-        int n = snprintf(out, sizeof(out),
+        // The request is parsed, its buffer takes the response
+        char* out = _scratch.packet;
+        int n = snprintf(out, sizeof(_scratch.packet),
             "{\"m\":\"%s\",\"t\":\"disc_res\",\"nonce\":\"%s\","\
             "\"n\":\"%s\",\"p\":\"%s\","\
             "\"mac\":\"%s\",\"ip\":\"%s\",\"port\":%u,\"nota\":\"%s\",\"v\":\"%s\",\"b\":\"%s\"}\n",
@@ -785,11 +2064,11 @@ void NOTAClass::handle_broadcast() {
             macStr, ipStr, (unsigned) _port, NOTA_VERSION, _version.c_str(), _board.c_str()
         );
         if (n <= 0) {
-            // logf("Broadcast response encoding error: %d\n", n); 
+            NOTA_LOGW("Broadcast response encoding error: %d\n", n);
             continue;
         }
-        if (n >= (int) sizeof(out)) {
-            // logf("Broadcast response truncated: %d\n", n); 
+        if (n >= (int) sizeof(_scratch.packet)) {
+            NOTA_LOGW("Broadcast response truncated: %d\n", n);
             continue;
         }
 
@@ -799,8 +2078,8 @@ void NOTAClass::handle_broadcast() {
         udp.endPacket();
         last_broadcast = millis();
         responded = true;
+        NOTA_LOGD("Broadcast DISC_REQ from %u.%u.%u.%u responded\n", serverIP[0], serverIP[1], serverIP[2], serverIP[3]);
         break; // Process only one packet per call to avoid flooding
-        // logf("Broadcast DISC_REQ from %u.%u.%u.%u responded\n", serverIP[0], serverIP[1], serverIP[2], serverIP[3]);
     }
 
     // Drop all packets if we are flooded
@@ -821,32 +2100,472 @@ void NOTAClass::handle_broadcast() {
 }
 #endif // NOTA_BROADCAST
 
+#ifdef NOTA_MULTICAST
+inline uint32_t mc_le32(const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24); }
+
+NOTA_TEMPLATE void NOTA_BASIC::handle_multicast() {
+    if (!this->_initialized) return;
+    // Bounded per call, the host paces the data to what the devices can take
+    for (int i = 0; i < 16; i++) {
+        int packetSize = udp_data.parsePacket();
+        if (packetSize <= 0) break;
+        uint8_t* packet = _scratch.mc.packet;
+        int len = udp_data.read(packet, sizeof(_scratch.mc.packet) - 1);
+        if (len <= 0) continue;
+        if (len >= NOTA_MC_HEADER_SIZE && !memcmp(packet, NOTA_MC_DATA_MAGIC, 4)) {
+            mc_data(packet, len);
+            continue;
+        }
+        packet[len] = '\0';
+        const char* text = (const char*) packet;
+        if (strncmp(text, NOTA_MC_MAGIC " ", sizeof(NOTA_MC_MAGIC))) continue;
+        text += sizeof(NOTA_MC_MAGIC);
+        if (!strncmp(text, "ANN ", 4)) {
+            mc_announce(text + 4, udp_data.remoteIP());
+        } else if (_mc_session && !strncmp(text, "POLL ", 5) && strtoul(text + 5, nullptr, 10) == _mc_session) {
+            _mc_last_packet = millis();
+            mc_poll();
+        } else if (_mc_session && !strncmp(text, "ABORT ", 6) && strtoul(text + 6, nullptr, 10) == _mc_session) {
+            NOTA_LOGW("OTA multicast transfer aborted by the host\n");
+            ota_error(OTA_RECEIVE_ERROR);
+            mc_close(false);
+        }
+    }
+    if (_mc_session && millis() - _mc_last_packet > NOTA_MC_TIMEOUT) {
+        NOTA_LOGE("OTA multicast transfer timeout, %lu of %lu chunks received\n", (unsigned long) _mc_received, (unsigned long) _mc_chunks);
+        ota_error(OTA_RECEIVE_ERROR);
+        mc_close(false);
+    }
+}
+
+NOTA_TEMPLATE void NOTA_BASIC::mc_report(const char* kind, uint32_t session, const char* detail) {
+    char* out = _scratch.mc.report;
+    int n = snprintf(out, sizeof(_scratch.mc.report), NOTA_MC_MAGIC " %s %lu %s %s", kind, (unsigned long) session, _hostname.c_str(), detail);
+    if (n <= 0) return;
+    if (n >= (int) sizeof(_scratch.mc.report)) n = sizeof(_scratch.mc.report) - 1;
+    udp_data.beginPacket(_mc_host, NOTA_MC_REPORT_PORT);
+    udp_data.write((const uint8_t*) out, (size_t) n);
+    udp_data.endPacket();
+}
+
+// "<session> <size> <md5> <chunk> <board|-> <token|->": join the transfer when the image is for this board and new to it
+NOTA_TEMPLATE void NOTA_BASIC::mc_announce(const char* args, IPAddress host) {
+    unsigned long session = 0, size = 0, chunk = 0;
+    char hash[33], board[65], token[33];
+    if (sscanf(args, "%lu %lu %32s %lu %64s %32s", &session, &size, hash, &chunk, board, token) != 6 || !session) return;
+    if (session == _mc_session) { // Repeated announce, the READY may have been lost
+        mc_report("READY", session, "");
+        return;
+    }
+    if (_mc_session || _state != OTA_IDLE) return;
+    if (strcmp(board, "-") && !_board.equals(board)) return;
+    _mc_host = host;
+    if (_password.length() && !MD5(_password + ':' + String(session) + ':' + hash).equals(token)) {
+        NOTA_LOGW("OTA multicast transfer: authentication failed\n");
+        mc_report("DONE", session, "ERR:AUTH");
+        return;
+    }
+    if (getImageHash().equalsIgnoreCase(hash)) {
+        mc_report("DONE", session, "SAME");
+        return;
+    }
+    if (!size || !chunk || chunk > NOTA_MC_CHUNK_MAX || chunk % 4) {
+        mc_report("DONE", session, "ERR:CHUNK");
+        return;
+    }
+    NOTA_LOGI("OTA multicast transfer %lu: %lu bytes in chunks of %lu\n", session, size, chunk);
+    _mc_chunks = (size + chunk - 1) / chunk;
+    _mc_bitmap = (uint8_t*) calloc((_mc_chunks + 7) / 8, 1);
+    if (!_mc_bitmap) {
+        mc_report("DONE", session, "ERR:MEMORY");
+        return;
+    }
+    _last_result = -1;
+    _session_start = millis();
+    notify(OTA_EVENT_REQUEST);
+    notify(OTA_EVENT_START);
+#ifdef ESP32
+    drop_staged();
+    _mc_partition = esp_ota_get_next_update_partition(nullptr);
+    bool opened = _mc_partition && size <= _mc_partition->size && esp_ota_begin(_mc_partition, size, &_mc_handle) == ESP_OK;
+#else
+    bool opened = InternalStorage.open(size) == 0;
+#endif
+    if (!opened) {
+        NOTA_LOGE("OTA multicast transfer: unable to open the update storage for %lu bytes\n", size);
+        free(_mc_bitmap);
+        _mc_bitmap = nullptr;
+#ifdef ESP32
+        _mc_handle = 0;
+#endif
+        mc_report("DONE", session, "ERR:BEGIN");
+        ota_error(OTA_BEGIN_ERROR);
+        return;
+    }
+    _mc_session = session;
+    _mc_size = size;
+    _mc_chunk = chunk;
+    _mc_received = 0;
+    _mc_last_packet = millis();
+    strcpy(_mc_hash, hash);
+    mc_report("READY", session, "");
+}
+
+NOTA_TEMPLATE void NOTA_BASIC::mc_data(const uint8_t* packet, int length) {
+    uint32_t session = mc_le32(packet + 4);
+    uint32_t index = mc_le32(packet + 8);
+    uint32_t size = packet[12] | (packet[13] << 8);
+    if (!_mc_session || session != _mc_session || index >= _mc_chunks) return;
+    uint32_t offset = index * _mc_chunk;
+    uint32_t expected = _mc_size - offset < _mc_chunk ? _mc_size - offset : _mc_chunk;
+    if (size != expected || NOTA_MC_HEADER_SIZE + size > (uint32_t) length) return;
+    _mc_last_packet = millis();
+    if (_mc_bitmap[index / 8] & (1 << (index % 8))) return; // Repair of a chunk this device already has
+#ifdef ESP32
+    bool written = esp_ota_write_with_offset(_mc_handle, packet + NOTA_MC_HEADER_SIZE, size, offset) == ESP_OK;
+#else
+    bool written = InternalStorage.writeAt(offset, packet + NOTA_MC_HEADER_SIZE, size);
+#endif
+    if (!written) {
+        NOTA_LOGE("OTA multicast transfer: write failed at %lu\n", (unsigned long) offset);
+        mc_report("DONE", _mc_session, "ERR:WRITE");
+        ota_error(OTA_RECEIVE_ERROR);
+        mc_close(false);
+        return;
+    }
+    _mc_bitmap[index / 8] |= 1 << (index % 8);
+    _mc_received++;
+    notify(OTA_EVENT_PROGRESS, _mc_received == _mc_chunks ? _mc_size : _mc_received * _mc_chunk, _mc_size);
+}
 
-void NOTAClass::listener() {
+// Answers a poll with the missing chunk ranges, or verifies and installs the complete image
+NOTA_TEMPLATE void NOTA_BASIC::mc_poll() {
+    if (_mc_received < _mc_chunks) {
+        char* detail = _scratch.mc.detail;
+        int n = snprintf(detail, sizeof(_scratch.mc.detail), "%lu ", (unsigned long) (_mc_chunks - _mc_received));
+        for (uint32_t i = 0; i < _mc_chunks && n < (int) sizeof(_scratch.mc.detail) - 24;) {
+            if (_mc_bitmap[i / 8] & (1 << (i % 8))) {
+                i++;
+                continue;
+            }
+            uint32_t first = i;
+            while (i < _mc_chunks && !(_mc_bitmap[i / 8] & (1 << (i % 8)))) i++;
+            n += snprintf(detail + n, sizeof(_scratch.mc.detail) - n, "%s%lu-%lu", detail[n - 1] == ' ' ? "" : ",", (unsigned long) first, (unsigned long) (i - 1));
+        }
+        mc_report("NACK", _mc_session, detail);
+        return;
+    }
+    MD5_CTX ctx;
+    uint8_t digest[16];
+    MD5::MD5Init(&ctx);
+#ifdef ESP32
+    for (uint32_t offset = 0; offset < _mc_size;) {
+        uint32_t buf[64];
+        uint32_t n = _mc_size - offset < sizeof(buf) ? _mc_size - offset : sizeof(buf);
+        esp_partition_read(_mc_partition, offset, buf, n);
+        MD5::MD5Update(&ctx, buf, n);
+        offset += n;
+    }
+#else
+    InternalStorage.close();
+    MD5::MD5Update(&ctx, (const uint8_t*) program_ota_address, _mc_size);
+#endif
+    MD5::MD5Final(digest, &ctx);
+    char* md5str = MD5::make_digest(digest, 16);
+    bool match = !strcmp(md5str, _mc_hash);
+    free(md5str);
+#ifdef ESP32
+    // esp_ota_end() also validates the image structure
+    if (match && esp_ota_end(_mc_handle) != ESP_OK) {
+        _mc_handle = 0;
+        mc_report("DONE", _mc_session, "ERR:IMAGE");
+        ota_error(OTA_END_ERROR);
+        mc_close(false);
+        return;
+    }
+    if (match) _mc_handle = 0;
+#endif
+    if (!match) {
+        NOTA_LOGE("OTA multicast transfer: MD5 mismatch\n");
+        mc_report("DONE", _mc_session, "ERR:MD5");
+        ota_error(OTA_END_ERROR);
+        mc_close(false);
+        return;
+    }
+    // The host may miss a single datagram, the device is gone once it reboots
+    for (int i = 0; i < 3; i++) {
+        mc_report("DONE", _mc_session, "OK");
+        delay(20);
+    }
+    mc_close(true);
+}
+
+NOTA_TEMPLATE void NOTA_BASIC::mc_close(bool commit) {
+    free(_mc_bitmap);
+    _mc_bitmap = nullptr;
+    _mc_session = 0;
+#ifdef ESP32
+    if (_mc_handle) esp_ota_abort(_mc_handle);
+    _mc_handle = 0;
+    if (commit && esp_ota_set_boot_partition(_mc_partition) != ESP_OK) {
+        NOTA_LOGE("OTA multicast transfer: unable to set the boot partition\n");
+        ota_error(OTA_END_ERROR);
+        return;
+    }
+#else
+    InternalStorage.close();
+#endif
+    if (!commit) return;
+    NOTA_LOGI("OTA multicast transfer complete\n");
+    _last_result = OTA_RESULT_OK;
+    _last_duration = millis() - _session_start;
+    notify(OTA_EVENT_END);
+    if (_stageOnly) {
+        stage_image(_mc_size, _mc_hash);
+        return;
+    }
+#ifdef ARDUINO_ARCH_STM32
+    InternalStorage.apply();
+#endif
+    reboot_after_update();
+}
+#endif // NOTA_MULTICAST
+
+#ifdef NOTA_RELAY
+// Copies a string field of a discovery response ("key":"value" or "key":number)
+inline bool relay_field(const char* json, const char* key, char* out, size_t size) {
+    char pattern[16];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char* p = strstr(json, pattern);
+    if (!p) return false;
+    p += strlen(pattern);
+    bool quoted = *p == '"';
+    if (quoted) p++;
+    size_t i = 0;
+    while (*p && i < size - 1 && (quoted ? *p != '"' : *p != ',' && *p != '}')) out[i++] = *p++;
+    out[i] = '\0';
+    return true;
+}
+
+// Waits for "OK" from the peer, skipping the byte count acks. False on "ERR", disconnect or timeout
+inline bool relay_expect_ok(nota_relay_client_t& peer, uint32_t timeout) {
+    uint32_t start = millis();
+    char last = 0;
+    while (millis() - start < timeout) {
+        if (!peer.available()) {
+            if (!peer.connected()) return false;
+            delay(1);
+            continue;
+        }
+        char c = peer.read();
+        if (last == 'O' && c == 'K') return true;
+        if (last == 'E' && c == 'R') return false;
+        last = c;
+    }
+    return false;
+}
+
+// Reads the staged image, which stays in the update slot until the reboot
+NOTA_TEMPLATE bool NOTA_BASIC::relay_read(uint8_t* buffer, uint32_t offset, uint32_t size) {
+#ifdef ESP32
+    return esp_partition_read(_relay_partition, offset, buffer, size) == ESP_OK;
+#else
+    memcpy(buffer, (const uint8_t*) (program_ota_address + offset), size);
+    return true;
+#endif
+}
+
+// Asks the discovery responders for the devices of the same board, this device excluded
+NOTA_TEMPLATE uint8_t NOTA_BASIC::relay_discover(IPAddress* ips, uint16_t* ports, uint8_t max) {
+    nota_relay_udp_t udp;
+    if (udp.begin(NOTA_BC_RESPONSE_PORT) != 1) return 0;
+#if defined(ARDUINO_ARCH_STM32)
+    IPAddress self = Ethernet.localIP();
+#else
+    IPAddress self = WiFi.localIP();
+#endif
+    char nonce[9];
+    snprintf(nonce, sizeof(nonce), "%08lx", (unsigned long) random(0x7FFFFFFF));
+    char* out = _scratch.packet;
+    int n = snprintf(out, sizeof(_scratch.packet), "{\"m\":\"%s\",\"t\":\"disc_req\",\"nonce\":\"%s\"}\n", NOTA_BC_MAGIC, nonce);
+    IPAddress targets[2] = { NOTA_BC_DISCOVERY_GROUP, IPAddress(255, 255, 255, 255) };
+    for (IPAddress& target : targets) {
+        udp.beginPacket(target, NOTA_BC_DISCOVERY_PORT);
+        udp.write((const uint8_t*) out, (size_t) n);
+        udp.endPacket();
+    }
+    uint8_t count = 0;
+    uint32_t start = millis();
+    // Responders answer at most once per second
+    while (millis() - start < 2000 && count < max) {
+        if (udp.parsePacket() <= 0) {
+            delay(5);
+            continue;
+        }
+        char* in = _scratch.packet;
+        int len = udp.read((uint8_t*) in, sizeof(_scratch.packet) - 1);
+        if (len <= 0) continue;
+        in[len] = '\0';
+        char field[64];
+        if (!relay_field(in, "nonce", field, sizeof(field)) || strcmp(field, nonce)) continue;
+        if (!relay_field(in, "b", field, sizeof(field)) || !_board.equals(field)) continue;
+        IPAddress ip;
+        if (!relay_field(in, "ip", field, sizeof(field)) || !ip.fromString(field) || ip == self) continue;
+        bool known = false;
+        for (uint8_t i = 0; i < count && !known; i++) known = ips[i] == ip;
+        if (known || !relay_field(in, "port", field, sizeof(field))) continue;
+        ips[count] = ip;
+        ports[count] = (uint16_t) atoi(field);
+        count++;
+    }
+    udp.stop();
+    return count;
+}
+
+// Uploads the staged image to one peer like the host tool does. False when the peer did not take it
+NOTA_TEMPLATE bool NOTA_BASIC::relay_push(IPAddress ip, uint16_t port, uint8_t fanout, uint32_t size, const char* hash) {
+    nota_relay_client_t peer;
+    if (!peer.connect(ip, port)) return false;
+#ifdef NOTA_ESP
+    peer.setNoDelay(true);
+#endif
+    char line[64];
+    snprintf(line, sizeof(line), "%d %lu %s relay=%u\n", U_FLASH, (unsigned long) size, hash, fanout);
+    peer.print(line);
+
+    // "OK <meta>", "AUTH <nonce> <meta>", "SAME <meta>" or "ERR..."
+    char* reply = (char*) _scratch.copy;
+    int n = 0;
+    uint32_t start = millis();
+    while (millis() - start < NOTA_RELAY_TIMEOUT && n < (int) sizeof(_scratch.copy) - 1 && peer.connected()) {
+        delay(50);
+        if (!peer.available() && n) break; // The reply is complete once the peer pauses
+        while (peer.available() && n < (int) sizeof(_scratch.copy) - 1) reply[n++] = peer.read();
+    }
+    reply[n] = '\0';
+    bool started = false;
+    if (!strncmp(reply, "AUTH ", 5) && n >= 37) {
+        String nonce = String(reply + 5).substring(0, 32);
+        String cnonce = MD5(String(millis()) + hash + nonce);
+        String response = MD5(_password + ':' + nonce + ':' + cnonce);
+        peer.print(String(U_AUTH) + ' ' + cnonce + ' ' + response + '\n');
+    } else if (!strncmp(reply, "OK", 2)) {
+        // The "OK" that opens the part may already follow the metadata
+        started = n > 4 && !strcmp(reply + n - 2, "OK");
+    } else {
+        NOTA_LOGI("Relay: %u.%u.%u.%u answered %.16s\n", ip[0], ip[1], ip[2], ip[3], n ? reply : "nothing");
+        peer.stop();
+        return false;
+    }
+    if (!started && !relay_expect_ok(peer, NOTA_RELAY_TIMEOUT)) {
+        NOTA_LOGW("Relay: %u.%u.%u.%u did not start the update\n", ip[0], ip[1], ip[2], ip[3]);
+        peer.stop();
+        return false;
+    }
+    NOTA_LOGI("Relay: sending %lu bytes to %u.%u.%u.%u\n", (unsigned long) size, ip[0], ip[1], ip[2], ip[3]);
+    // The reply is no longer needed, its buffer carries the image
+    uint8_t* buffer = _scratch.copy;
+    uint32_t offset = 0;
+    uint32_t last_progress = millis();
+    while (offset < size && peer.connected() && millis() - last_progress < NOTA_RELAY_TIMEOUT) {
+        uint32_t chunk = size - offset < sizeof(_scratch.copy) ? size - offset : sizeof(_scratch.copy);
+        if (!relay_read(buffer, offset, chunk)) break;
+        size_t written = peer.write(buffer, chunk);
+        if (written) last_progress = millis();
+        offset += written;
+        // Byte count acks, an error ends the transfer
+        while (peer.available()) {
+            if (peer.read() == 'E') offset = size + 1;
+        }
+    }
+    // The peer verifies the image before its final "OK"
+    bool ok = offset == size && relay_expect_ok(peer, NOTA_RELAY_TIMEOUT * 3);
+    peer.stop();
+    NOTA_LOGI("Relay: %u.%u.%u.%u %s\n", ip[0], ip[1], ip[2], ip[3], ok ? "updated" : "failed");
+    return ok;
+}
+
+// Pushes the staged image to up to relay=<fanout> peers of the same board before this device reboots into it.
+// Every peer relays with the same fan-out, so a rollout reaches the fleet in a logarithmic number of rounds
+// and the uplink to the host carries the image only once
+NOTA_TEMPLATE void NOTA_BASIC::relay_image() {
+    int fanout = option("relay").toInt();
+    if (!_flash_received || fanout <= 0) return;
+    if (fanout > NOTA_RELAY_MAX_FANOUT) fanout = NOTA_RELAY_MAX_FANOUT;
+    const ota_part_t* image = nullptr;
+    for (uint8_t i = 0; i < _part_count; i++) if (_parts[i].cmd == U_FLASH) image = &_parts[i];
+    if (!image) return;
+#ifdef ESP32
+    // The partition Update wrote to: in stage only mode the boot partition is the running image again
+    _relay_partition = esp_ota_get_next_update_partition(nullptr);
+    if (!_relay_partition) return;
+#endif
+    // Peers would reject anything else with ERR:MD5 only after the whole transfer
+    MD5_CTX ctx;
+    uint8_t digest[16];
+    MD5::MD5Init(&ctx);
+    for (uint32_t offset = 0; offset < image->size;) {
+        uint32_t n = image->size - offset < sizeof(_scratch.copy) ? image->size - offset : sizeof(_scratch.copy);
+        if (!relay_read(_scratch.copy, offset, n)) return;
+        MD5::MD5Update(&ctx, _scratch.copy, n);
+        offset += n;
+    }
+    MD5::MD5Final(digest, &ctx);
+    char* md5str = MD5::make_digest(digest, 16);
+    bool match = !strcasecmp(md5str, image->hash);
+    free(md5str);
+    if (!match) {
+        NOTA_LOGE("Relay: the image read back does not match %s, not relayed\n", image->hash);
+        return;
+    }
+    IPAddress ips[NOTA_RELAY_MAX_PEERS];
+    uint16_t ports[NOTA_RELAY_MAX_PEERS];
+    uint8_t count = relay_discover(ips, ports, NOTA_RELAY_MAX_PEERS);
+    NOTA_LOGI("Relay: %u peer(s) found, fan-out %d\n", count, fanout);
+    // Relays of the same round see the same peers, a random order keeps them from all picking the first ones
+    for (uint8_t i = count; i > 1; i--) {
+        uint8_t j = random(i);
+        IPAddress ip = ips[i - 1];
+        ips[i - 1] = ips[j];
+        ips[j] = ip;
+        uint16_t port = ports[i - 1];
+        ports[i - 1] = ports[j];
+        ports[j] = port;
+    }
+    int pushed = 0;
+    for (uint8_t i = 0; i < count && pushed < fanout; i++) {
+        if (relay_push(ips[i], ports[i], fanout, image->size, image->hash)) pushed++;
+    }
+    NOTA_LOGI("Relay: image passed on to %d peer(s)\n", pushed);
+}
+#endif // NOTA_RELAY
+
+
+NOTA_TEMPLATE void NOTA_BASIC::listener() {
     // Check if server is started
     if (!_tcp_ota) {
-        Serial.println("OTA Server not running ...");
+        NOTA_LOGW("OTA Server not running ...\n");
         this->begin();
         return;
     }
     if (_state == OTA_WAITAUTH && (_last_auth_time + 5000UL) < millis()) {
         _state = OTA_IDLE;
-        Serial.println("OTA Authentication timeout");
+        NOTA_LOGW("OTA Authentication timeout\n");
     }
     if (_state == OTA_RUNUPDATE && (_last_update_time + 5000UL) < millis()) {
         _state = OTA_IDLE;
-        Serial.println("OTA Update timeout");
+        NOTA_LOGW("OTA Update timeout\n");
     }
     auto client = _tcp_ota->available();
     if (!client.available()) return;
     delay(10);
     // Check if data is available
     ota_client = &client;
-#ifdef ESP
-    Serial.printf("Client with IP %s connected\n", client.remoteIP().toString().c_str());
-#else 
+#ifdef NOTA_ESP
+    NOTA_LOGI("Client with IP %s connected\n", client.remoteIP().toString().c_str());
+#elif NOTA_LOG_LEVEL >= NOTA_LOG_INFO
     IPAddress ip = client.remoteIP();
-    Serial.printf("Client with IP %d.%d.%d.%d connected\n", ip[0], ip[1], ip[2], ip[3]);
+    NOTA_LOGI("Client with IP %d.%d.%d.%d connected\n", ip[0], ip[1], ip[2], ip[3]);
 #endif
     if (_state == OTA_IDLE) ota_handle_idle();
     if (_state == OTA_WAITAUTH) ota_handle_auth();
@@ -855,17 +2574,637 @@ void NOTAClass::listener() {
 }
 
 //this needs to be called in the loop()
-void NOTAClass::handle() {
+NOTA_TEMPLATE void NOTA_BASIC::handle() {
+    flushLog();
+#ifdef ESP32
+    if (_task) {
+        ota_event_t event;
+        while (xQueueReceive(_events, &event, 0) == pdTRUE) dispatch(event);
+        return;
+    }
+#endif
     if (!_initialized) return;
+    if (_state == OTA_IDLE) hash_step(NOTA_HASH_SLICE);
+    if (!poll_due()) return;
+#ifdef ARDUINO_ARCH_STM32
+    if (_irq_pin >= 0) irq_arm();
+#endif
+    _poll_now = false;
+    _last_poll = millis();
     this->listener();
+    flushLog();
 
 #ifdef NOTA_BROADCAST
     handle_broadcast();
 #endif
+#ifdef NOTA_MULTICAST
+    handle_multicast();
+#endif
+}
+
+// True when handle() should check the sockets now. Reading the INT pin is a GPIO read, the socket checks
+// are several SPI transactions each on the W5x00
+NOTA_TEMPLATE bool NOTA_BASIC::poll_due() {
+    if (_poll_now || !_poll_interval || _state != OTA_IDLE) return true;
+#ifdef NOTA_MULTICAST
+    if (_mc_session) return true; // The host streams the image to the group
+#endif
+#ifdef ARDUINO_ARCH_STM32
+    if (_irq_pin >= 0 && digitalRead(_irq_pin) == LOW) return true;
+#endif
+    return millis() - _last_poll >= _poll_interval;
 }
 
-int NOTAClass::getCommand() { return _cmd; }
+#ifdef ARDUINO_ARCH_STM32
+// Routes the interrupts of the OTA sockets (update server, discovery, multicast data) to the INT pin and clears their
+// flags, so INT goes low again with the next event. Runs before the sockets are read: an event that arrives while they
+// are read is not lost. The interrupts the application enabled are kept. Other chips keep polling at the interval.
+// The registers are read when INT is low and while the OTA sockets may move without an event: on the first check,
+// after a setting change and during a session, when the server listens on a new socket for the next client
+NOTA_TEMPLATE void NOTA_BASIC::irq_arm() {
+    if (!_poll_now && _state == OTA_IDLE && digitalRead(_irq_pin) == HIGH) return;
+    uint8_t chip = W5100.getChip();
+    if (chip != 51 && chip != 55) return;
+    uint8_t mask = 0;
+    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    for (uint8_t s = 0; s < MAX_SOCK_NUM && s < 8; s++) {
+        if (W5100.readSnSR(s) == SnSR::CLOSED) continue;
+        uint16_t port = W5100.readSnPORT(s);
+        if (port != _port && port != NOTA_BC_DISCOVERY_PORT && port != NOTA_MC_DATA_PORT) continue;
+        // SEND_OK is left to the Ethernet library, it waits for it in socketSend()
+        W5100.writeSnIR(s, SnIR::CON | SnIR::DISCON | SnIR::RECV | SnIR::TIMEOUT);
+        mask |= 1 << s;
+    }
+    uint16_t reg = chip == 55 ? 0x0018 : 0x0016; // W5500 SIMR, W5100 IMR (bits 0-3 are the sockets)
+    uint8_t enabled = W5100.read(reg);
+    uint8_t next = (enabled & ~_irq_mask) | mask;
+    if (next != enabled) W5100.write(reg, next);
+    _irq_mask = mask;
+    SPI.endTransaction();
+}
 
-#if !defined(NO_GLOBAL_INSTANCES) && !defined(NO_GLOBAL_ARDUINOOTA)
-NOTAClass OTA;
+// Masks the socket interrupts irq_arm() enabled again, those of the application stay as they are
+NOTA_TEMPLATE void NOTA_BASIC::irq_disarm() {
+    if (!_irq_mask) return;
+    uint8_t chip = W5100.getChip();
+    uint16_t reg = chip == 55 ? 0x0018 : 0x0016;
+    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    W5100.write(reg, W5100.read(reg) & ~_irq_mask);
+    SPI.endTransaction();
+    _irq_mask = 0;
+}
+#endif
+
+NOTA_TEMPLATE int NOTA_BASIC::getCommand() { return _cmd; }
+
+NOTA_TEMPLATE String NOTA_BASIC::getImageHash() {
+    while (!hash_step(NOTA_HASH_SLICE));
+    return _image_hash;
+}
+
+#ifdef ESP32
+// Length of the app image in the partition: header, segments, checksum padded to 16 bytes and the optional SHA-256
+inline uint32_t esp32_image_length(const esp_partition_t* partition) {
+    esp_image_header_t header;
+    if (!partition || esp_partition_read(partition, 0, &header, sizeof(header)) != ESP_OK || header.magic != ESP_IMAGE_HEADER_MAGIC) return 0;
+    uint32_t offset = sizeof(header);
+    for (uint8_t i = 0; i < header.segment_count; i++) {
+        esp_image_segment_header_t segment;
+        if (esp_partition_read(partition, offset, &segment, sizeof(segment)) != ESP_OK) return 0;
+        offset += sizeof(segment) + segment.data_len;
+        if (offset > partition->size) return 0;
+    }
+    offset = (offset + 16) & ~15UL;
+    if (header.hash_appended) offset += 32;
+    return offset;
+}
+#endif
+
+// Hashes up to budget bytes of the running image, returns true once the hash is complete.
+// The hash is written once and never changes after that, so a caller that saw true reads it without the lock
+NOTA_TEMPLATE bool NOTA_BASIC::hash_step(uint32_t budget) {
+#ifdef ESP32
+    if (_hash_lock) xSemaphoreTake(_hash_lock, portMAX_DELAY);
+    bool done = hash_slice(budget);
+    if (_hash_lock) xSemaphoreGive(_hash_lock);
+    return done;
+#else
+    return hash_slice(budget);
+#endif
+}
+
+NOTA_TEMPLATE bool NOTA_BASIC::hash_slice(uint32_t budget) {
+    if (_image_hash.length()) return true;
+    if (!_hash_running) {
+#if defined(ESP8266)
+        _hash_length = ESP.getSketchSize();
+#elif defined(ESP32)
+        _hash_length = esp32_image_length(esp_ota_get_running_partition());
+#else
+        // The image ends at its last programmed byte, erased flash tail and the stage record area are not part of it
+        InternalStorage.layout();
+        const uint8_t* image = (const uint8_t*) program_memory_address;
+        _hash_length = InternalStorage.maxSize();
+        while (_hash_length && image[_hash_length - 1] == 0xFF) _hash_length--;
+#endif
+        _hash_offset = 0;
+        MD5::MD5Init(&_hash_ctx);
+        _hash_running = true;
+    }
+    if (!budget) budget = _hash_length;
+    while (budget && _hash_offset < _hash_length) {
+        uint32_t n = _hash_length - _hash_offset;
+#ifdef NOTA_ESP
+        uint32_t buf[64];
+        if (n > sizeof(buf)) n = sizeof(buf);
+        if (n > budget) n = budget;
+        image_read(_hash_offset, buf, n);
+        MD5::MD5Update(&_hash_ctx, buf, n);
+#else
+        if (n > budget) n = budget;
+        MD5::MD5Update(&_hash_ctx, (const uint8_t*) program_memory_address + _hash_offset, n);
 #endif
+        _hash_offset += n;
+        budget -= n;
+    }
+    if (_hash_offset < _hash_length) return false;
+    uint8_t digest[16];
+    MD5::MD5Final(digest, &_hash_ctx);
+    char* md5str = MD5::make_digest(digest, 16);
+    _image_hash = md5str;
+    free(md5str);
+    _hash_running = false;
+    return true;
+}
+
+// Reads up to 256 bytes of the running image
+NOTA_TEMPLATE void NOTA_BASIC::image_read(uint32_t offset, uint32_t* buf, uint32_t size) {
+#if defined(ESP8266)
+    ESP.flashRead(offset, buf, (size + 3) & ~3UL);
+#elif defined(ESP32)
+    esp_partition_read(esp_ota_get_running_partition(), offset, buf, size);
+#else
+    memcpy(buf, (const uint8_t*) program_memory_address + offset, size);
+#endif
+}
+
+// Answers with the hashes of the running image in blocks of the requested size, so the client can send only changed blocks
+NOTA_TEMPLATE void NOTA_BASIC::ota_handle_blocks() {
+    uint32_t block_size = this->parseInt();
+    while (ota_client->available()) ota_client->read();
+    if (block_size < 256 || block_size > 65536 || block_size % 256) {
+        ota_client->write("ERR:BLOCKS", 10);
+        return;
+    }
+    getImageHash(); // Completes the running image length
+    NOTA_LOGI("Sending block hashes of %lu bytes in blocks of %lu\n", (unsigned long) _hash_length, (unsigned long) block_size);
+    char* out = _scratch.reply;
+    int used = snprintf(out, sizeof(_scratch.reply), "BLOCKS %lu %lu ", (unsigned long) block_size, (unsigned long) _hash_length);
+    for (uint32_t offset = 0; offset < _hash_length; offset += block_size) {
+        uint32_t end = offset + block_size < _hash_length ? offset + block_size : _hash_length;
+        MD5_CTX ctx;
+        uint8_t digest[16];
+        MD5::MD5Init(&ctx);
+        for (uint32_t position = offset; position < end;) {
+            uint32_t buf[64];
+            uint32_t n = end - position < sizeof(buf) ? end - position : sizeof(buf);
+            image_read(position, buf, n);
+            MD5::MD5Update(&ctx, buf, n);
+            position += n;
+        }
+        MD5::MD5Final(digest, &ctx);
+        if (used + 2 * NOTA_BLOCK_HASH_SIZE >= (int) sizeof(_scratch.reply)) {
+            ota_client->write((const char*) out, used);
+            used = 0;
+        }
+        for (int i = 0; i < NOTA_BLOCK_HASH_SIZE; i++) used += sprintf(out + used, "%02x", digest[i]);
+    }
+    ota_client->write((const char*) out, used);
+    ota_client->write("\n", 1);
+}
+
+// Reads the blocks=<size>:<bitmap> option of a delta transfer and counts the bytes the client will send
+NOTA_TEMPLATE bool NOTA_BASIC::parse_blocks() {
+    _block_size = 0;
+    _block_map = "";
+    _transfer_size = _size;
+    String blocks = option("blocks");
+    if (!blocks.length()) return true;
+    int colon = blocks.indexOf(':');
+    if (_cmd != U_FLASH || colon < 0) return false;
+    uint32_t block_size = blocks.substring(0, colon).toInt();
+    if (block_size < 256 || block_size > 65536 || block_size % 256) return false;
+    _block_size = block_size;
+    _block_map = blocks.substring(colon + 1);
+    getImageHash(); // Completes the running image length
+    for (uint32_t offset = 0; offset < (uint32_t) _size; offset += _block_size) {
+        if (!block_unchanged(offset / _block_size)) continue;
+        uint32_t length = _size - offset < _block_size ? _size - offset : _block_size;
+        if (offset + length > _hash_length) { // Nothing to copy beyond the running image
+            _block_size = 0;
+            return false;
+        }
+        _transfer_size -= length;
+    }
+    NOTA_LOGI("Delta transfer: %lu of %d bytes\n", (unsigned long) _transfer_size, _size);
+    return true;
+}
+
+// Sparse transfer: extents=<offset>:<length>,... in hex, ascending and word aligned. Only the extents are sent
+NOTA_TEMPLATE bool NOTA_BASIC::parse_extents() {
+    _extent_count = 0;
+    String extents = option("extents");
+    if (!extents.length()) return true;
+    if (_cmd != U_FLASH || _block_size) return false;
+    const char* p = extents.c_str();
+    uint32_t end = 0;
+    uint32_t sent = 0;
+    while (*p) {
+        char* next;
+        uint32_t offset = strtoul(p, &next, 16);
+        if (*next != ':' || _extent_count >= NOTA_EXTENTS_MAX) return false;
+        uint32_t length = strtoul(next + 1, &next, 16);
+        // A length off the word boundary only for the extent that ends the image
+        if (offset < end || offset % 4 || !length || length > (uint32_t) _size - offset || (length % 4 && offset + length != (uint32_t) _size)) {
+            _extent_count = 0;
+            return false;
+        }
+        _extents[_extent_count++] = { offset, length };
+        end = offset + length;
+        sent += length;
+        p = *next == ',' ? next + 1 : next;
+        if (*next && *next != ',') {
+            _extent_count = 0;
+            return false;
+        }
+    }
+    _transfer_size = sent;
+    NOTA_LOGI("Sparse transfer: %lu of %d bytes in %u extents\n", (unsigned long) _transfer_size, _size, _extent_count);
+    return true;
+}
+
+// Bytes from the image offset to the end of its extent, 0 in a gap. No limit without extents
+NOTA_TEMPLATE uint32_t NOTA_BASIC::extent_left() {
+    if (!_extent_count) return UINT32_MAX;
+    for (uint8_t i = 0; i < _extent_count; i++) {
+        if (_image_offset >= _extents[i].offset && _image_offset < _extents[i].offset + _extents[i].length) {
+            return _extents[i].offset + _extents[i].length - _image_offset;
+        }
+    }
+    return 0;
+}
+
+// Pull mode: url=http://<host>[:<port>]/<path>. Single flash images sent in full only
+NOTA_TEMPLATE bool NOTA_BASIC::parse_pull() {
+    String url = option("url");
+#ifdef NOTA_PULL
+    _pull_host = "";
+    if (!url.length()) return true;
+    if (_cmd != U_FLASH || _block_size || _extent_count || !url.startsWith("http://")) return false;
+    int path = url.indexOf('/', 7);
+    String host = path < 0 ? url.substring(7) : url.substring(7, path);
+    int colon = host.indexOf(':');
+    long port = colon < 0 ? 80 : host.substring(colon + 1).toInt();
+    if (port <= 0 || port > 65535) return false;
+    _pull_port = port;
+    _pull_host = colon < 0 ? host : host.substring(0, colon);
+    _pull_path = path < 0 ? "/" : url.substring(path);
+    return _pull_host.length() > 0;
+#else
+    return !url.length();
+#endif
+}
+
+// Reads the parts=<cmd>:<size>:<md5>,... manifest of a multi-part session, a single image is a session of one part.
+// The request hash of a multi-part session is the MD5 of the manifest
+NOTA_TEMPLATE bool NOTA_BASIC::parse_parts() {
+    _part_count = 0;
+    if (_cmd != U_MULTI) {
+        _parts[0].cmd = _cmd;
+        _parts[0].size = _size;
+        strcpy(_parts[0].hash, _program_hash_.c_str());
+        _part_count = 1;
+        return true;
+    }
+    String parts = option("parts");
+    if (!parts.length() || !_program_hash_.equalsIgnoreCase(MD5(parts))) return false;
+    uint32_t total = 0;
+    int start = 0;
+    while (start < (int) parts.length()) {
+        int end = parts.indexOf(',', start);
+        if (end < 0) end = parts.length();
+        int size_start = parts.indexOf(':', start) + 1;
+        int hash_start = parts.indexOf(':', size_start) + 1;
+        // The firmware part is committed by the end of its transfer on ESP, so it has to come last
+        if (_part_count == NOTA_MAX_PARTS || size_start <= 0 || hash_start <= 0 || end - hash_start != 32) return false;
+        if (_part_count && _parts[_part_count - 1].cmd == U_FLASH) return false;
+        ota_part_t& part = _parts[_part_count++];
+        part.cmd = parts.substring(start, size_start - 1).toInt();
+        part.size = parts.substring(size_start, hash_start - 1).toInt();
+        strcpy(part.hash, parts.substring(hash_start, end).c_str());
+        if (part.size <= 0) return false;
+        // A filesystem image is written in place and could not be rolled back, it needs a session of its own
+        if (part.cmd != U_FLASH && part.cmd != U_CONFIG) return false;
+        if (part.cmd == U_CONFIG && part.size > NOTA_CONFIG_MAX_SIZE) return false;
+        total += part.size;
+        start = end + 1;
+    }
+    return total == (uint32_t) _size;
+}
+
+NOTA_TEMPLATE bool NOTA_BASIC::block_unchanged(uint32_t block) {
+    if (!_block_size || 2 * (block / 8) + 1 >= _block_map.length()) return false;
+    char hex[3] = { _block_map[2 * (block / 8)], _block_map[2 * (block / 8) + 1], 0 };
+    return (strtoul(hex, nullptr, 16) >> (block % 8)) & 1;
+}
+
+NOTA_TEMPLATE bool NOTA_BASIC::ota_write(const uint8_t* data, uint32_t size) {
+    if (_cmd == U_CONFIG) {
+        if (_image_offset + size > (uint32_t) _size) return false;
+        memcpy(_config + _image_offset, data, size);
+        _config_size = _image_offset + size;
+        return true;
+    }
+#ifdef ARDUINO_ARCH_STM32
+    if (_cmd == U_FS) return DataStorage.write(data, size);
+#endif
+    return _storage.write(data, size);
+}
+
+// Writes what the client does not send at the current image offset: the gap before the next extent of a sparse
+// transfer, or the unchanged blocks of a delta transfer, copied from the running image
+NOTA_TEMPLATE bool NOTA_BASIC::ota_fill() {
+    if (_extent_count && !extent_left()) {
+        uint32_t next = _size;
+        for (uint8_t i = 0; i < _extent_count; i++) {
+            if (_extents[i].offset > _image_offset) {
+                next = _extents[i].offset;
+                break;
+            }
+        }
+#ifdef NOTA_ESP
+        // Update writes sector by sector, the erased bytes are written like received ones
+        memset(_scratch.copy, 0xFF, sizeof(_scratch.copy));
+        while (_image_offset < next) {
+            uint32_t n = next - _image_offset < sizeof(_scratch.copy) ? next - _image_offset : sizeof(_scratch.copy);
+            if (!ota_write(_scratch.copy, n)) return false;
+            _image_offset += n;
+        }
+#else
+        // The slot was erased by open(), the gap is left as it is
+        if (!InternalStorage.skip(next - _image_offset)) return false;
+        _image_offset = next;
+#endif
+        return true;
+    }
+    if (!_block_size || _image_offset % _block_size) return true;
+    while (_image_offset < (uint32_t) _size && block_unchanged(_image_offset / _block_size)) {
+        uint32_t end = _image_offset + _block_size < (uint32_t) _size ? _image_offset + _block_size : _size;
+        while (_image_offset < end) {
+            uint32_t buf[64];
+            uint32_t n = end - _image_offset < sizeof(buf) ? end - _image_offset : sizeof(buf);
+            image_read(_image_offset, buf, n);
+            if (!ota_write((const uint8_t*) buf, n)) return false;
+            _image_offset += n;
+        }
+    }
+    return true;
+}
+
+#ifdef ARDUINO_ARCH_STM32
+// Checks the received image in the OTA region, or a filesystem image in the data partition, against the MD5 hash
+// from the request
+NOTA_TEMPLATE bool NOTA_BASIC::ota_verify() {
+    uint8_t digest[16];
+    if (_cmd == U_FS) {
+        // Every write was read back already, this covers the image as a whole
+        if (!DataStorage.close() || !DataStorage.digest(_size, digest)) return false;
+    } else {
+        InternalStorage.close(); // Programs the last partial word
+        MD5_CTX ctx;
+        MD5::MD5Init(&ctx);
+        MD5::MD5Update(&ctx, (const uint8_t*) program_ota_address, _size);
+        MD5::MD5Final(digest, &ctx);
+    }
+    char* md5str = MD5::make_digest(digest, 16);
+    bool ok = _program_hash_.equalsIgnoreCase(md5str);
+    if (!ok) NOTA_LOGE("Update Failed: MD5 mismatch, expected %s but got %s\n", _program_hash_.c_str(), md5str);
+    free(md5str);
+    return ok;
+}
+#endif
+
+NOTA_TEMPLATE bool NOTA_BASIC::confirmBoot() {
+#if defined(NOTA_AB_SLOTS) && defined(ARDUINO_ARCH_STM32)
+    return nota_boot_confirm();
+#elif defined(ESP32)
+    return esp_ota_mark_app_valid_cancel_rollback() == ESP_OK;
+#else
+    return true;
+#endif
+}
+
+NOTA_TEMPLATE bool NOTA_BASIC::isBootPending() {
+#if defined(NOTA_AB_SLOTS) && defined(ARDUINO_ARCH_STM32)
+    return nota_boot_pending();
+#elif defined(ESP32)
+    esp_ota_img_states_t state;
+    return esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY;
+#else
+    return false;
+#endif
+}
+
+NOTA_TEMPLATE int NOTA_BASIC::getBootSlot() {
+#if defined(NOTA_AB_SLOTS) && defined(ARDUINO_ARCH_STM32)
+    return nota_boot_running_slot();
+#elif defined(ESP32)
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    if (!running || running->subtype < ESP_PARTITION_SUBTYPE_APP_OTA_MIN || running->subtype >= ESP_PARTITION_SUBTYPE_APP_OTA_MAX) return -1;
+    return running->subtype - ESP_PARTITION_SUBTYPE_APP_OTA_MIN;
+#else
+    return -1;
+#endif
+}
+
+// Keeps the verified image of size bytes in the update slot and the running image booting
+NOTA_TEMPLATE bool NOTA_BASIC::stage_image(uint32_t size, const char* hash) {
+#if defined(ESP32)
+    // Update.end() selected the new image for the next boot, the stage record in NVS keeps it for applyStaged()
+    nvs_handle_t nvs;
+    bool ok = esp_ota_set_boot_partition(esp_ota_get_running_partition()) == ESP_OK && nvs_open("nota", NVS_READWRITE, &nvs) == ESP_OK;
+    if (ok) {
+        ok = nvs_set_u32(nvs, "staged_size", size) == ESP_OK && nvs_set_str(nvs, "staged", hash) == ESP_OK && nvs_commit(nvs) == ESP_OK;
+        nvs_close(nvs);
+    }
+#elif defined(ARDUINO_ARCH_STM32)
+    bool ok = InternalStorage.stage(size, hash);
+#else
+    bool ok = false;
+#endif
+    if (ok) NOTA_LOGI("Update staged: %s, waiting for applyStaged()\n", hash);
+    else NOTA_LOGE("Update staging failed\n");
+    return ok;
+}
+
+// Size and MD5 of the stage record, false when there is none. hash receives 33 bytes
+NOTA_TEMPLATE bool NOTA_BASIC::staged_image(uint32_t* size, char* hash) {
+#if defined(ESP32)
+    nvs_handle_t nvs;
+    if (nvs_open("nota", NVS_READONLY, &nvs) != ESP_OK) return false;
+    uint32_t staged_size = 0;
+    size_t length = 33;
+    bool ok = nvs_get_u32(nvs, "staged_size", &staged_size) == ESP_OK && nvs_get_str(nvs, "staged", hash, &length) == ESP_OK;
+    nvs_close(nvs);
+    const esp_partition_t* partition = esp_ota_get_next_update_partition(nullptr);
+    if (!ok || !partition || staged_size > partition->size) return false;
+    *size = staged_size;
+    return true;
+#elif defined(ARDUINO_ARCH_STM32)
+    return InternalStorage.staged(size, hash);
+#else
+    return false;
+#endif
+}
+
+NOTA_TEMPLATE void NOTA_BASIC::drop_staged() {
+#if defined(ESP32)
+    nvs_handle_t nvs;
+    if (nvs_open("nota", NVS_READWRITE, &nvs) != ESP_OK) return;
+    nvs_erase_key(nvs, "staged");
+    nvs_erase_key(nvs, "staged_size");
+    nvs_commit(nvs);
+    nvs_close(nvs);
+#elif defined(ARDUINO_ARCH_STM32)
+    InternalStorage.unstage();
+#endif
+}
+
+NOTA_TEMPLATE bool NOTA_BASIC::isStaged() { return getStagedHash().length() > 0; }
+
+NOTA_TEMPLATE String NOTA_BASIC::getStagedHash() {
+    uint32_t size;
+    char hash[33];
+    return staged_image(&size, hash) ? String(hash) : String();
+}
+
+NOTA_TEMPLATE bool NOTA_BASIC::applyStaged() {
+    uint32_t size;
+    char hash[33];
+    if (_state != OTA_IDLE || !staged_image(&size, hash)) return false;
+    MD5_CTX ctx;
+    uint8_t digest[16];
+    MD5::MD5Init(&ctx);
+#if defined(ESP32)
+    const esp_partition_t* partition = esp_ota_get_next_update_partition(nullptr);
+    for (uint32_t offset = 0; offset < size;) {
+        uint32_t buf[64];
+        uint32_t n = size - offset < sizeof(buf) ? size - offset : sizeof(buf);
+        esp_partition_read(partition, offset, buf, n);
+        MD5::MD5Update(&ctx, buf, n);
+        offset += n;
+    }
+#elif defined(ARDUINO_ARCH_STM32)
+    MD5::MD5Update(&ctx, (const uint8_t*) program_ota_address, size);
+#endif
+    MD5::MD5Final(digest, &ctx);
+    char* md5str = MD5::make_digest(digest, 16);
+    bool match = !strcasecmp(md5str, hash);
+    free(md5str);
+    // The record is dropped before the switch, so a failed switch never repeats
+    drop_staged();
+    if (!match) {
+        NOTA_LOGE("Staged image damaged: MD5 mismatch\n");
+        return false;
+    }
+    NOTA_LOGI("Applying the staged image %s\n", hash);
+#if defined(ESP32)
+    if (esp_ota_set_boot_partition(partition) != ESP_OK) {
+        NOTA_LOGE("Unable to set the boot partition\n");
+        return false;
+    }
+#elif defined(ARDUINO_ARCH_STM32)
+    InternalStorage.apply();
+#endif
+    reboot_after_update(true);
+    return true;
+}
+
+NOTA_TEMPLATE void NOTA_BASIC::ota_error(ota_error_t error) {
+    if (_last_result < 0) _last_result = error;
+    _last_duration = millis() - _session_start;
+    notify(OTA_EVENT_ERROR, error);
+}
+
+NOTA_TEMPLATE void NOTA_BASIC::dispatch(const ota_event_t& event) {
+    switch (event.type) {
+        case OTA_EVENT_REQUEST: _callbacks.request(); break;
+        case OTA_EVENT_START: _callbacks.start(); break;
+        case OTA_EVENT_END: _callbacks.end(); break;
+        case OTA_EVENT_ERROR: _callbacks.error((ota_error_t) event.a); break;
+        case OTA_EVENT_PROGRESS: _callbacks.progress(event.a, event.b); break;
+        case OTA_EVENT_CONFIG: _callbacks.config((const uint8_t*) (uintptr_t) event.a, event.b); break;
+    }
+}
+
+NOTA_TEMPLATE void NOTA_BASIC::notify(ota_event_type_t type, uint32_t a, uint32_t b) {
+    ota_event_t event = { type, a, b };
+#ifdef ESP32
+    if (_task && xTaskGetCurrentTaskHandle() == _task) {
+        // Progress events may be dropped when the application falls behind, the next one supersedes them
+        TickType_t wait = type == OTA_EVENT_PROGRESS ? 0 : pdMS_TO_TICKS(100);
+        xQueueSend(_events, &event, wait);
+        return;
+    }
+#endif
+    dispatch(event);
+}
+
+#ifdef ESP32
+NOTA_TEMPLATE void NOTA_BASIC::beginTask(BaseType_t core, UBaseType_t priority, UBaseType_t queue_length, uint32_t stack_size) {
+    if (_task) return;
+    if (!_events) _events = xQueueCreate(queue_length, sizeof(ota_event_t));
+    if (!_hash_lock) _hash_lock = xSemaphoreCreateMutex();
+    if (!_events || !_hash_lock) {
+        NOTA_LOGE("OTA task queue or lock allocation failed\n");
+        return;
+    }
+    if (xTaskCreatePinnedToCore(&NOTA_BASIC::task_main, "nota", stack_size, this, priority, &_task, core) != pdPASS) {
+        NOTA_LOGE("OTA task creation failed\n");
+        _task = nullptr;
+    }
+}
+
+NOTA_TEMPLATE void NOTA_BASIC::task_main(void* arg) {
+    NOTA_BASIC* ota = (NOTA_BASIC*) arg;
+    ota->begin();
+    for (;;) {
+        if (ota->_reconnect_request) {
+            ota->_reconnect_request = false;
+            ota->_initialized = false;
+            ota->begin();
+        }
+        ota->listener();
+        bool hashed = ota->_state == OTA_IDLE && ota->hash_step(NOTA_HASH_SLICE);
+#ifdef NOTA_BROADCAST
+        ota->handle_broadcast();
+#endif
+#ifdef NOTA_MULTICAST
+        ota->handle_multicast();
+#endif
+        // The task sleeps between checks instead, still every tick while a session or a hash is running
+        TickType_t wait = pdMS_TO_TICKS(ota->_poll_interval);
+        if (ota->_state != OTA_IDLE || !hashed || !wait) wait = 1;
+#ifdef NOTA_MULTICAST
+        if (ota->_mc_session) wait = 1;
+#endif
+        vTaskDelay(wait);
+    }
+}
+
+NOTA_TEMPLATE void NOTA_BASIC::wait_events_delivered(uint32_t timeout) {
+    if (!_task || xTaskGetCurrentTaskHandle() != _task) return;
+    uint32_t start = millis();
+    while (uxQueueMessagesWaiting(_events) && millis() - start < timeout) delay(10);
+}
+#endif // ESP32
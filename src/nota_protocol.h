@@ -0,0 +1,94 @@
+#pragma once
+
+// NOTA wire protocol definitions, shared by the device library (NOTA.h) and the host tools.
+// Keep this header free of Arduino dependencies.
+
+#include <stdint.h>
+
+#define NOTA_VERSION "0.0.3"
+
+// Request commands, the first token of a request line: "<cmd> <size> <md5>[ <key>=<value> ...]\n"
+#define NOTA_CMD_FLASH      0
+#define NOTA_CMD_FS         100
+#define NOTA_CMD_AUTH       200   // "<cmd> <cnonce> <response>\n" answering an AUTH challenge
+#define NOTA_CMD_TEST       201   // Like NOTA_CMD_AUTH, but only checks the password
+#define NOTA_CMD_QUERY      202   // "<cmd>\n", answered with a single STAT record
+#define NOTA_CMD_BLOCKS     203   // "<cmd> <block_size>\n", answered with "BLOCKS <block_size> <length> <hashes>\n"
+#define NOTA_CMD_MULTI      204   // "<cmd> <total size> <md5 of the manifest> parts=<manifest>\n", see below
+#define NOTA_CMD_CONFIG     300   // Part type of a config blob handed to the application
+
+// A device in stage only mode (OTA.setStageOnly()) records the verified image before its final reply and answers
+// ERR:STAGE instead of "OK" when that fails
+
+// Request options
+//   reflash=1                  upload even when the device already runs the image (it answers SAME otherwise)
+//   blocks=<size>:<bitmap>     delta transfer: bit i of the hex bitmap (LSB first per byte) marks block i as
+//                              unchanged, the device copies it from the running image and only changed blocks are sent
+//   parts=<cmd>:<size>:<md5>,...   manifest of a multi-part session (NOTA_CMD_CONFIG, NOTA_CMD_FLASH last).
+//                              Each part is opened by an "OK" from the device, the session ends with a single "OK".
+//                              Nothing takes effect before the last part is verified. NOTA_CMD_FS is refused with
+//                              ERR:PARTS: a filesystem image is written in place and is sent in a session of its own
+//   relay=<fan-out>            (NOTA_RELAY) after the final "OK" the device uploads the image to up to <fan-out> peers
+//                              of its board found by discovery, with the same option, before it reboots
+//   extents=<offset>:<length>,...  sparse transfer (hex): only these runs of the image are sent, in order. The bytes
+//                              between them are erased flash (0xFF) and the MD5 covers the full image with the gaps.
+//                              Offsets are ascending and word aligned, lengths too except for a run that ends the image
+//   hdr=1                      image header: once the request is accepted the device asks for a nota_image_header_t with
+//                              "OK" and checks it against the request and itself before the update slot is erased. The
+//                              usual "OK" follows when the slot is ready, ERR:HEADER, ERR:BOARD, ERR:ADDRESS or ERR:VECTOR
+//                              end the session with the flash untouched. Applies to the flash image of a session
+//   url=http://<host>[:<port>]/<path>  (NOTA_PULL) pull mode: after its "OK" the device fetches the flash image itself
+//                              with HTTP range requests, one at a time, and reports "<bytes written>\n" after each.
+//                              The session ends as usual, ERR:PULL when the server failed too often. Not combined with
+//                              blocks= or extents=
+//   ts=<n> mac=<hex>           single round trip authentication instead of the AUTH challenge: <n> is a timestamp or
+//                              counter that grows with every request (nota.js: ms since 1970), mac= comes last and is
+//                              HMAC-MD5(key = MD5(password) as hex, "<cmd> <size> <md5> <options before mac=>").
+//                              The device answers "OK" right away, ERR:AUTH for a wrong MAC and ERR:REPLAY for a <n>
+//                              it has seen or that is older than its window. Devices without it answer AUTH as before.
+//                              The highest <n> accepted survives restarts (NVS on ESP32, RTC backup registers on STM32).
+//                              A device that has none stored answers AUTH, and the first request that passes the
+//                              challenge sets it. nota.js only signs with --signed
+
+// Most runs of an extents= option
+#define NOTA_EXTENTS_MAX        16
+
+#define NOTA_HEADER_MAGIC       0x3148544EUL // "NTH1"
+
+// Image header of hdr=1, sent little-endian, 64 bytes
+typedef struct {
+    uint32_t magic;             // NOTA_HEADER_MAGIC
+    uint32_t image_size;        // Must match the request
+    uint32_t link_address;      // Address the image is linked for, 0 when unknown
+    uint32_t vector[2];         // First 8 bytes of the image: on Cortex-M the initial stack pointer and the reset vector
+    uint8_t md5[16];            // Must match the request
+    char board[16];             // Board the image is built for, zero padded, empty for any
+    char version[12];           // Image version, zero padded, only logged
+} nota_image_header_t;
+
+// Block hashes: first 8 bytes of the block MD5 as 16 hex characters, the last block may be shorter
+#define NOTA_BLOCK_HASH_SIZE    8
+
+// Separator of the metadata fields in replies: "<nota>|/<name>|/<platform>|/<board>|/<version>|/<image md5>"
+#define NOTA_META_SEPARATOR "|/"
+
+// Discovery (NOTA_BROADCAST)
+#define NOTA_BC_MAGIC           "NOTA_DISCOVERY"
+#define NOTA_BC_DISCOVERY_PORT  41234
+#define NOTA_BC_RESPONSE_PORT   41235
+
+// Multicast transfer (NOTA_MULTICAST) on the discovery group, one image to all devices at once
+//   host -> group:NOTA_MC_DATA_PORT     "NOTA_MC ANN <session> <size> <md5> <chunk> <board|-> <token|->"
+//                                       "NOTA_MC POLL <session>", "NOTA_MC ABORT <session>"
+//                                       data: NOTA_MC_DATA_MAGIC, session, chunk index (uint32 LE), length (uint16 LE), payload
+//   device -> host:NOTA_MC_REPORT_PORT  "NOTA_MC READY <session> <name>" once the update slot is erased
+//                                       "NOTA_MC NACK <session> <name> <missing> <first>-<last>,..." answering a poll
+//                                       "NOTA_MC DONE <session> <name> OK|SAME|ERR:<reason>"
+//   token = MD5(MD5(password):<session>:<md5>), "-" for devices without a password
+#define NOTA_MC_GROUP           "239.255.0.1"
+#define NOTA_MC_MAGIC           "NOTA_MC"
+#define NOTA_MC_DATA_MAGIC      "NMD\x01"
+#define NOTA_MC_DATA_PORT       41236
+#define NOTA_MC_REPORT_PORT     41237
+#define NOTA_MC_HEADER_SIZE     14
+#define NOTA_MC_CHUNK_MAX       1024
@@ -0,0 +1,89 @@
+#pragma once
+
+// Receive loop of a plain image part as a template, so the storage write, hashing and progress report inline
+// into the loop instead of going through std::function and per byte calls. Used by NOTABasic in NOTA.h with the
+// Storage and Hash policies of the instance, and by the host benchmark (tools/bench) with a RAM storage. Keep this header free of Arduino dependencies.
+//
+//   Storage    bool write(const uint8_t* data, uint32_t size)
+//   Hash       void begin(), void update(const uint8_t* data, uint32_t size), bool matches(const char* md5)
+//   Callbacks  any callable as progress(uint32_t received, uint32_t size): a functor, a function pointer or std::function
+//   Source     int available(), int read(uint8_t* buffer, size_t size) (EthernetClient, WiFiClient, ...)
+//
+// Features that are not needed compile away with the empty policies nota_no_hash and nota_no_progress.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "MD5.h"
+
+// No hash while receiving, the image is verified after the transfer (STM32 reads the slot back)
+struct nota_no_hash {
+    void begin() {}
+    void update(const uint8_t*, uint32_t) {}
+    bool matches(const char*) { return true; }
+};
+
+// MD5 of the received bytes
+struct nota_md5_hash {
+    MD5_CTX ctx;
+    void begin() { MD5::MD5Init(&ctx); }
+    void update(const uint8_t* data, uint32_t size) { MD5::MD5Update(&ctx, data, size); }
+    bool matches(const char* md5) {
+        uint8_t digest[16];
+        MD5::MD5Final(digest, &ctx);
+        static const char hex[] = "0123456789abcdef";
+        for (int i = 0; i < 16; i++) {
+            char high = md5[2 * i] | 0x20, low = md5[2 * i + 1] | 0x20; // Either case
+            if (high != hex[digest[i] >> 4] || low != hex[digest[i] & 15]) return false;
+        }
+        return md5[32] == '\0';
+    }
+};
+
+struct nota_no_progress {
+    void operator()(uint32_t, uint32_t) {}
+};
+
+template <typename Storage, typename Hash = nota_no_hash, typename Callbacks = nota_no_progress>
+class NOTAReceiver {
+public:
+    explicit NOTAReceiver(Storage& storage, Callbacks progress = Callbacks()) : _storage(storage), _progress(progress) {}
+
+    void begin(uint32_t size) {
+        _size = size;
+        _received = 0;
+        _hash.begin();
+    }
+
+    // Moves what the source has available into the storage, through buffer, without going past the part size
+    // or limit bytes (a rate limit). Returns the bytes taken, or -1 when the storage rejected a write
+    template <typename Source>
+    int32_t receive(Source& source, uint8_t* buffer, uint32_t buffer_size, uint32_t limit = UINT32_MAX) {
+        uint32_t taken = 0;
+        while (_received < _size && taken < limit && source.available() > 0) {
+            uint32_t n = _size - _received < buffer_size ? _size - _received : buffer_size;
+            if (limit - taken < n) n = limit - taken;
+            int read = source.read(buffer, n);
+            if (read <= 0) break;
+            if (!_storage.write(buffer, (uint32_t) read)) return -1;
+            _hash.update(buffer, (uint32_t) read);
+            _received += read;
+            taken += read;
+        }
+        if (taken) _progress(_received, _size);
+        return (int32_t) taken;
+    }
+
+    bool complete() const { return _received == _size; }
+    uint32_t received() const { return _received; }
+
+    // True when every byte arrived and the hash policy accepts it
+    bool finish(const char* md5) { return complete() && _hash.matches(md5); }
+
+private:
+    Storage& _storage;
+    Hash _hash;
+    Callbacks _progress;
+    uint32_t _size = 0;
+    uint32_t _received = 0;
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+// Update duration model, shared by the host tools (nota-fleet --predict / --compare).
+// Keep this header free of Arduino dependencies.
+//
+// A session is split into the phases the device goes through:
+//   handshake  connect, request line and reply
+//   erase      optional AUTH round trip, the reply delay and the slot erase before the device acks the start.
+//              STM32 erases every sector of the update slot, ESP erases each sector when the data reaches it
+//   transfer   stop-and-wait chunks: send time or device write time, whichever is longer, plus the ack round trip
+//   verify     MD5 of the received image and the delay before the final "OK"
+//   apply      STM32 without A/B slots copies the slot over the running image, then the device reboots
+// The delay() calls of NOTA.h are part of the model, keep the NOTA_T_* values in sync with them.
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+// Fixed device delays in ms (NOTA.h)
+#define NOTA_T_REPLY_DELAY      100     // ota_handle_idle(): after the handshake reply
+#define NOTA_T_START_DELAY      500     // ota_handle_update(): after the "OK" that opens the first part
+#define NOTA_T_FINISH_DELAY     2010    // ota_finish(): before the final "OK"
+#define NOTA_T_CLOSE_DELAY      1100    // ota_finish(): after the final "OK", before the image is applied
+#define NOTA_T_REBOOT_DELAY     1000    // reboot_after_update()
+
+typedef struct {
+    uint32_t size;          // Bytes per sector
+    uint32_t count;         // Consecutive sectors of this size
+    uint32_t erase_ms;      // Typical erase time of one sector
+} nota_sector_group_t;
+
+typedef struct {
+    const char* name;               // Matched against the start of the platform the device reports
+    nota_sector_group_t sectors[4]; // Sector map from the start of the flash, ends at a zero group
+    uint32_t program_word;          // Bytes programmed by one operation
+    uint32_t program_us;            // Typical time of one program operation
+    uint32_t receive_ns;            // CPU time per received byte: network stack read and write path
+    uint32_t hash_kbps;             // MD5 read back from flash in kB/s, 0 when the image is hashed while it is written
+    uint32_t boot_ms;               // Reset until the application calls OTA.begin(), ESP8266 includes the boot loader copy
+    uint8_t erase_ahead;            // 1: the whole slot is erased before the start is acked
+} nota_flash_family_t;
+
+// Typical datasheet timings. receive_ns is a starting point, nota-fleet --compare prints the value a measured run implies
+static const nota_flash_family_t nota_flash_families[] = {
+    // STM32F405/407/427/429 at 2.7-3.6 V (x32): 4 x 16 KB, 64 KB, 7 x 128 KB per bank, W5500 read byte by byte over SPI
+    { "STM32F4", { { 0x4000, 4, 250 }, { 0x10000, 1, 550 }, { 0x20000, 7, 1000 }, { 0, 0, 0 } }, 4, 16, 12000, 8000, 300, 1 },
+    // STM32F2 uses the same sector map and timings
+    { "STM32F2", { { 0x4000, 4, 250 }, { 0x10000, 1, 550 }, { 0x20000, 7, 1000 }, { 0, 0, 0 } }, 4, 16, 12000, 8000, 300, 1 },
+    // STM32F74x/75x single bank: 4 x 32 KB, 128 KB, 3 x 256 KB
+    { "STM32F7", { { 0x8000, 4, 250 }, { 0x20000, 1, 1000 }, { 0x40000, 3, 2000 }, { 0, 0, 0 } }, 4, 16, 6000, 16000, 300, 1 },
+    // External SPI NOR flash: 4 KB sectors, 256 byte pages
+    { "ESP32", { { 0x1000, 4096, 45 }, { 0, 0, 0 } }, 256, 700, 1000, 4000, 1500, 0 },
+    { "ESP8266", { { 0x1000, 4096, 45 }, { 0, 0, 0 } }, 256, 700, 2500, 0, 6000, 0 },
+};
+
+// Update slot of internal_flash.h (STM32). ESP writes the image from the start of its update partition
+typedef struct {
+    uint32_t ota_sector;        // ota_sector: first sector of the update slot
+    uint32_t ota_sector_count;  // ota_sector_count
+    uint32_t program_sector;    // First sector of the running image, where apply() copies the slot to
+    uint8_t copy_on_apply;      // 0 with NOTA_AB_SLOTS: the boot selector switches slots without a copy
+} nota_slot_layout_t;
+
+#define NOTA_LAYOUT_DEFAULT     { 6, 2, 0, 1 }  // internal_flash.h: 0x08040000, 256 KB over 0x08000000
+#define NOTA_LAYOUT_AB_SLOTS    { 7, 2, 5, 0 }  // boot_control.h: slot B while slot A runs
+
+typedef struct {
+    double rtt_ms;              // Round trip including the device loop latency, a QUERY measures it
+    double bandwidth_kbps;      // kB/s available to this session
+    uint32_t chunk;             // Host chunk size, one ack round trip each
+    uint8_t auth;               // Device has a password
+} nota_link_t;
+
+typedef struct {
+    double handshake_ms;
+    double erase_ms;
+    double transfer_ms;
+    double verify_ms;
+    double apply_ms;
+    double total_ms;            // Connect until the new image runs OTA.begin()
+    double blocked_ms;          // handle() does not return: the application loop is stalled
+    double offline_ms;          // Final "OK" until the new image runs OTA.begin(), the device does not answer
+    double irq_off_ms;          // Longest stretch with interrupts disabled: a sector erase or the copy of apply() on STM32
+} nota_prediction_t;
+
+// Family of a reported platform name ("STM32F407", "ESP32-S3", ...), NULL when unknown
+static inline const nota_flash_family_t* nota_flash_family(const char* platform) {
+    for (size_t i = 0; i < sizeof(nota_flash_families) / sizeof(nota_flash_families[0]); i++) {
+        const char* name = nota_flash_families[i].name;
+        if (platform && !strncasecmp(platform, name, strlen(name))) return &nota_flash_families[i];
+    }
+    return NULL;
+}
+
+static inline const nota_sector_group_t* nota_sector_group(const nota_flash_family_t* family, uint32_t index) {
+    for (const nota_sector_group_t* group = family->sectors; group->count; group++) {
+        if (index < group->count) return group;
+        index -= group->count;
+    }
+    return NULL;
+}
+
+// Erase time of count sectors starting at first, *bytes receives their size and *longest the slowest single erase
+static inline double nota_erase_ms(const nota_flash_family_t* family, uint32_t first, uint32_t count, uint32_t* bytes, double* longest) {
+    double total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const nota_sector_group_t* group = nota_sector_group(family, first + i);
+        if (!group) break;
+        total += group->erase_ms;
+        if (bytes) *bytes += group->size;
+        if (longest && group->erase_ms > *longest) *longest = group->erase_ms;
+    }
+    return total;
+}
+
+// Sectors from first needed to hold size bytes
+static inline uint32_t nota_sectors_for(const nota_flash_family_t* family, uint32_t first, uint32_t size) {
+    uint32_t count = 0, covered = 0;
+    while (covered < size) {
+        const nota_sector_group_t* group = nota_sector_group(family, first + count);
+        if (!group) break;
+        covered += group->size;
+        count++;
+    }
+    return count;
+}
+
+static inline double nota_program_ms(const nota_flash_family_t* family, uint32_t bytes) {
+    uint32_t operations = (bytes + family->program_word - 1) / family->program_word;
+    return operations * (double) family->program_us / 1000.0;
+}
+
+static inline nota_prediction_t nota_predict(const nota_flash_family_t* family, const nota_slot_layout_t* layout, const nota_link_t* link, uint32_t image_size) {
+    nota_prediction_t p;
+    memset(&p, 0, sizeof(p));
+    uint32_t chunk = link->chunk ? link->chunk : image_size;
+    double bytes_per_ms = link->bandwidth_kbps * 1024.0 / 1000.0;
+
+    // TCP connect, then request and reply
+    p.handshake_ms = 2 * link->rtt_ms;
+
+    p.erase_ms = (link->auth ? link->rtt_ms : 0) + NOTA_T_REPLY_DELAY;
+    if (family->erase_ahead) {
+        p.erase_ms += nota_erase_ms(family, layout->ota_sector, layout->ota_sector_count, NULL, &p.irq_off_ms);
+    }
+
+    // The device takes the bytes while they arrive, so a chunk costs the slower of link and device plus the ack
+    p.transfer_ms = NOTA_T_START_DELAY;
+    uint32_t erased = 0;        // Bytes of the update partition erased so far (ESP)
+    uint32_t sector = 0;
+    for (uint32_t offset = 0; offset < image_size; offset += chunk) {
+        uint32_t size = image_size - offset < chunk ? image_size - offset : chunk;
+        double send = bytes_per_ms > 0 ? size / bytes_per_ms : 0;
+        double device = size * family->receive_ns / 1e6 + nota_program_ms(family, size);
+        while (!family->erase_ahead && erased < offset + size) {
+            const nota_sector_group_t* group = nota_sector_group(family, sector++);
+            if (!group) break;
+            device += group->erase_ms;
+            erased += group->size;
+        }
+        p.transfer_ms += (send > device ? send : device) + link->rtt_ms;
+    }
+
+    p.verify_ms = (family->hash_kbps ? image_size / (family->hash_kbps * 1024.0 / 1000.0) : 0) + NOTA_T_FINISH_DELAY;
+
+    p.apply_ms = NOTA_T_CLOSE_DELAY + NOTA_T_REBOOT_DELAY + family->boot_ms;
+    if (family->erase_ahead && layout->copy_on_apply) {
+        // apply() copies the whole slot, not only the image
+        uint32_t slot = 0;
+        nota_erase_ms(family, layout->ota_sector, layout->ota_sector_count, &slot, NULL);
+        uint32_t count = nota_sectors_for(family, layout->program_sector, slot);
+        double copy = nota_erase_ms(family, layout->program_sector, count, NULL, NULL) + nota_program_ms(family, slot);
+        p.apply_ms += copy;
+        if (copy > p.irq_off_ms) p.irq_off_ms = copy; // The copy runs with interrupts disabled
+    }
+
+    p.total_ms = p.handshake_ms + p.erase_ms + p.transfer_ms + p.verify_ms + p.apply_ms;
+    p.blocked_ms = p.total_ms - p.handshake_ms;
+    p.offline_ms = p.apply_ms;
+    return p;
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+// A/B application slots for STM32 with boot confirmation and rollback.
+//
+// Flash layout (defaults for a 1 MB STM32F4, adjust the variables below to the target):
+//   sector 0     0x08000000  boot selector (small sketch calling nota_boot_selector())
+//   sectors 1-2  0x08004000  boot control log, two sectors used in turn
+//   sectors 5-6  0x08020000  application slot A
+//   sectors 7-8  0x08060000  application slot B
+//
+// Each application image is linked for its slot (FLASH origin and VECT_TAB_OFFSET), so an update
+// is written to the inactive slot and the switch is a single record in the boot control log.
+//
+// The boot control log is an append-only array of 32-bit records in its own sector. Every record
+// is programmed once from the erased state, so no erase is needed until the sector is full. Then the
+// current state is written into the other sector, and its first word, the generation of the log, goes
+// last. The full sector stays in use until then, so a reset at any point keeps the confirmed slot.
+// The selector starts a PENDING slot at most NOTA_BOOT_MAX_ATTEMPTS times. If the application does
+// not call OTA.confirmBoot() before the next reset (use a watchdog), the selector falls back to the
+// last CONFIRMED slot without copying anything.
+
+#include <Arduino.h>
+#include "nota_global.h"
+
+#ifndef NOTA_BOOT_MAX_ATTEMPTS
+#define NOTA_BOOT_MAX_ATTEMPTS 3
+#endif
+
+#define NOTA_BOOT_NONE          0xFF
+#define NOTA_BOOT_ERASED        0xFFFFFFFFUL
+#define NOTA_BOOT_TAG_MASK      0xFFFF0000UL
+#define NOTA_BOOT_PENDING       0xA5A50000UL // Image in slot was installed and waits for confirmation
+#define NOTA_BOOT_CONFIRMED     0x5A5A0000UL // Application in slot confirmed a healthy start
+#define NOTA_BOOT_ATTEMPT       0x3C3C0000UL // Selector started the pending slot
+#define NOTA_BOOT_ROLLBACK      0xC3C30000UL // Selector gave up on the pending slot
+#define NOTA_BOOT_SEQUENCE      0x7E7E0000UL // First word of a compacted log with its generation
+
+NOTA_GLOBAL(uint32_t, boot_control_address[2], { 0x08004000, 0x08008000 });
+NOTA_GLOBAL(uint32_t, boot_control_size, 0x00004000);
+NOTA_GLOBAL(uint32_t, boot_control_sector[2], { 1, 2 });
+NOTA_GLOBAL(uint32_t, slot_address[2], { 0x08020000, 0x08060000 });
+NOTA_GLOBAL(uint32_t, slot_sector[2], { 5, 7 });
+NOTA_GLOBAL(uint32_t, slot_sector_count, 2);
+NOTA_GLOBAL(uint32_t, slot_size, 0x00040000);
+NOTA_GLOBAL(uint32_t, boot_ram_start, 0x20000000);
+NOTA_GLOBAL(uint32_t, boot_ram_end, 0x20030000);
+
+typedef struct {
+    uint8_t confirmed;  // Last known good slot
+    uint8_t pending;    // Slot waiting for confirmation or NOTA_BOOT_NONE
+    uint8_t attempts;   // Times the selector started the pending slot
+    uint32_t used;      // Words of the log in use, the next record goes there
+    uint8_t log;        // Sector of the log in use, index into boot_control_address
+    uint16_t sequence;  // Its generation
+} nota_boot_state_t;
+
+inline bool nota_boot_generation(uint8_t log, uint16_t* sequence) {
+    uint32_t word = *(const volatile uint32_t*) boot_control_address[log];
+    *sequence = word & 0xFFFF;
+    return (word & NOTA_BOOT_TAG_MASK) == NOTA_BOOT_SEQUENCE;
+}
+
+inline nota_boot_state_t nota_boot_read() {
+    nota_boot_state_t state = { 0, NOTA_BOOT_NONE, 0, 0, 0, 0 };
+    // The log with the newer generation is in use. Without one, the first sector holds the log from
+    // its first word (never compacted, or written by an earlier version)
+    uint16_t sequence[2];
+    bool valid[2] = { nota_boot_generation(0, &sequence[0]), nota_boot_generation(1, &sequence[1]) };
+    if (valid[0] || valid[1]) {
+        state.log = valid[0] && valid[1] ? (int16_t) (uint16_t) (sequence[1] - sequence[0]) > 0 : valid[1];
+        state.sequence = sequence[state.log];
+        state.used = 1;
+    }
+    const volatile uint32_t* log = (const volatile uint32_t*) boot_control_address[state.log];
+    uint32_t count = boot_control_size / 4;
+    while (state.used < count) {
+        uint32_t record = log[state.used];
+        if (record == NOTA_BOOT_ERASED) break;
+        state.used++;
+        uint8_t slot = record & 0xFF;
+        if (slot > 1) continue;
+        switch (record & NOTA_BOOT_TAG_MASK) {
+            case NOTA_BOOT_PENDING: state.pending = slot; state.attempts = 0; break;
+            case NOTA_BOOT_CONFIRMED: state.confirmed = slot; if (state.pending == slot) state.pending = NOTA_BOOT_NONE; break;
+            case NOTA_BOOT_ATTEMPT: if (state.pending == slot) state.attempts++; break;
+            case NOTA_BOOT_ROLLBACK: if (state.pending == slot) state.pending = NOTA_BOOT_NONE; break;
+            default: break;
+        }
+    }
+    return state;
+}
+
+inline bool nota_boot_program(uint32_t address, uint32_t value) {
+    if (HAL_FLASH_Unlock() != HAL_OK) return false;
+    __disable_irq();
+    HAL_StatusTypeDef status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address, value);
+    __enable_irq();
+    HAL_FLASH_Lock();
+    return status == HAL_OK;
+}
+
+inline bool nota_boot_erase(uint8_t log) {
+    FLASH_EraseInitTypeDef erase;
+    erase.TypeErase = FLASH_TYPEERASE_SECTORS;
+    erase.Sector = boot_control_sector[log];
+    erase.NbSectors = 1;
+    erase.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+    uint32_t sectorError = 0;
+    if (HAL_FLASH_Unlock() != HAL_OK) return false;
+    // Single-bank flash: the CPU stalls during erase, keep ISRs from fetching from flash
+    __disable_irq();
+    HAL_StatusTypeDef status = HAL_FLASHEx_Erase(&erase, &sectorError);
+    __enable_irq();
+    HAL_FLASH_Lock();
+    return status == HAL_OK;
+}
+
+// Appends a record. When the sector is full, the current state is compacted into the other sector first
+inline bool nota_boot_append(uint32_t record) {
+    nota_boot_state_t state = nota_boot_read();
+    if ((state.used + 1 + NOTA_BOOT_MAX_ATTEMPTS + 2) * 4 > boot_control_size) {
+        uint8_t next = state.log ^ 1;
+        uint32_t base = boot_control_address[next];
+        if (!nota_boot_erase(next)) return false;
+        uint32_t used = 1;
+        bool ok = nota_boot_program(base + 4 * used++, NOTA_BOOT_CONFIRMED | state.confirmed);
+        if (state.pending != NOTA_BOOT_NONE) {
+            ok = ok && nota_boot_program(base + 4 * used++, NOTA_BOOT_PENDING | state.pending);
+            for (uint8_t i = 0; i < state.attempts; i++) ok = ok && nota_boot_program(base + 4 * used++, NOTA_BOOT_ATTEMPT | state.pending);
+        }
+        // The generation goes last: until it is there the full log stays in use
+        if (!ok || !nota_boot_program(base, NOTA_BOOT_SEQUENCE | (uint16_t) (state.sequence + 1))) return false;
+        state.log = next;
+        state.used = used;
+    }
+    return nota_boot_program(boot_control_address[state.log] + 4 * state.used, record);
+}
+
+// Slot the running application was started from, by its vector table location
+inline uint8_t nota_boot_running_slot() {
+    uint32_t vtor = SCB->VTOR;
+    for (uint8_t slot = 0; slot < 2; slot++) {
+        if (vtor >= slot_address[slot] && vtor < slot_address[slot] + slot_size) return slot;
+    }
+    return 0;
+}
+
+// A slot holds a startable image when the initial stack pointer is in RAM and the reset vector inside the slot
+inline bool nota_boot_slot_valid(uint8_t slot) {
+    const volatile uint32_t* vectors = (const volatile uint32_t*) slot_address[slot];
+    uint32_t sp = vectors[0];
+    uint32_t reset = vectors[1] & ~1UL;
+    return sp > boot_ram_start && sp <= boot_ram_end && reset >= slot_address[slot] && reset < slot_address[slot] + slot_size;
+}
+
+// Decides which slot to start, recording the attempt or the rollback in the log
+inline uint8_t nota_boot_select() {
+    nota_boot_state_t state = nota_boot_read();
+    if (state.pending != NOTA_BOOT_NONE) {
+        if (state.attempts < NOTA_BOOT_MAX_ATTEMPTS && nota_boot_slot_valid(state.pending)) {
+            nota_boot_append(NOTA_BOOT_ATTEMPT | state.pending);
+            return state.pending;
+        }
+        nota_boot_append(NOTA_BOOT_ROLLBACK | state.pending);
+    }
+    if (!nota_boot_slot_valid(state.confirmed) && nota_boot_slot_valid(state.confirmed ^ 1)) return state.confirmed ^ 1;
+    return state.confirmed;
+}
+
+inline void nota_boot_jump(uint8_t slot) {
+    uint32_t base = slot_address[slot];
+    uint32_t sp = ((const volatile uint32_t*) base)[0];
+    uint32_t reset = ((const volatile uint32_t*) base)[1];
+    __disable_irq();
+    SysTick->CTRL = 0;
+    for (uint8_t i = 0; i < sizeof(NVIC->ICER) / sizeof(NVIC->ICER[0]); i++) {
+        NVIC->ICER[i] = 0xFFFFFFFF;
+        NVIC->ICPR[i] = 0xFFFFFFFF;
+    }
+    HAL_DeInit();
+    SCB->VTOR = base;
+    __DSB();
+    __ISB();
+    __set_MSP(sp);
+    __enable_irq();
+    ((void (*)(void)) reset)();
+}
+
+// Entry point of the boot selector sketch: call it first thing in setup(), it does not return
+inline void nota_boot_selector() {
+    nota_boot_jump(nota_boot_select());
+}
+
+// Application side: mark the running slot as good, cancels the rollback
+inline bool nota_boot_confirm() {
+    nota_boot_state_t state = nota_boot_read();
+    uint8_t running = nota_boot_running_slot();
+    if (state.pending != running && state.confirmed == running) return true;
+    return nota_boot_append(NOTA_BOOT_CONFIRMED | running);
+}
+
+inline bool nota_boot_pending() {
+    return nota_boot_read().pending == nota_boot_running_slot();
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <Arduino.h>
+#include "internal_flash.h"
+#include "../MD5.h"
+
+// OTADataStorage::internalSector() knows the internal flash sectors of STM32F2 / STM32F4 only. Other families keep their
+// data partition on an external chip (nota_flash_driver_t) and define NOTA_DATA_EXTERNAL_ONLY
+#if !defined(STM32F2xx) && !defined(STM32F4xx) && !defined(NOTA_DATA_EXTERNAL_ONLY)
+#error "The data partition in internal flash needs STM32F2 / STM32F4, define NOTA_DATA_EXTERNAL_ONLY for an external chip"
+#endif
+
+// External flash chip of a data partition (SPI NOR, QSPI, ...), addresses are relative to the chip
+typedef struct {
+    uint32_t block_size;                                                    // Erase block, e.g. 4096 for most SPI NOR chips
+    bool (*erase)(uint32_t address);                                        // Erases the block at a block aligned address
+    bool (*program)(uint32_t address, const uint8_t* data, uint32_t size);  // Any length, the driver splits it into pages
+    bool (*read)(uint32_t address, uint8_t* data, uint32_t size);
+} nota_flash_driver_t;
+
+// Data partition that receives filesystem images (U_FS). The image is written in place: every erase block is erased
+// just before the writer reaches it and every write is read back, so nothing goes through the update slot and
+// nothing waits for a restart. Blocks behind the end of the image keep their content
+struct OTADataStorage {
+    uint32_t address = 0;   // Start of the partition
+    uint32_t size = 0;      // 0: no data partition
+    const nota_flash_driver_t* driver = nullptr; // nullptr: internal flash
+    uint32_t offset = 0;    // Write position in the partition
+    uint32_t erased = 0;    // The partition is erased for the current image up to here
+    uint8_t pending[4];     // Internal flash is programmed in words, the bytes of a partial one wait here
+    uint8_t pending_count = 0;
+
+    // Sector of internal flash at address, STM32F4 layout: 4 x 16 KB, 64 KB, then 128 KB sectors per bank
+    static bool internalSector(uint32_t at, uint32_t* sector, uint32_t* start, uint32_t* length) {
+#ifdef NOTA_DATA_EXTERNAL_ONLY
+        return false;
+#endif
+        if (at < 0x08000000) return false;
+        uint32_t offset = at - 0x08000000;
+        uint32_t first = 0;
+#ifdef FLASH_SECTOR_12
+        // Dual bank devices repeat the layout from 1 MB on
+        if (offset >= 0x100000) {
+            offset -= 0x100000;
+            first = 12;
+        }
+#endif
+        uint32_t index;
+        if (offset < 0x10000) index = offset / 0x4000;
+        else if (offset < 0x20000) index = 4;
+        else index = 5 + (offset - 0x20000) / 0x20000;
+        if (index > 11) return false;
+        uint32_t bank = at - offset;
+        *sector = first + index;
+        *start = bank + (index < 4 ? index * 0x4000 : index == 4 ? 0x10000 : 0x20000 + (index - 5) * 0x20000);
+        *length = index < 4 ? 0x4000 : index == 4 ? 0x10000 : 0x20000;
+        return true;
+    }
+
+    // Erase block that contains the partition offset at, start relative to the partition
+    bool block(uint32_t at, uint32_t* start, uint32_t* length, uint32_t* sector) {
+        if (driver) {
+            *start = (address + at) / driver->block_size * driver->block_size - address;
+            *length = driver->block_size;
+            *sector = 0;
+            return true;
+        }
+        uint32_t absolute;
+        if (!internalSector(address + at, sector, &absolute, length)) return false;
+        *start = absolute - address;
+        return true;
+    }
+
+    // Internal flash: sector aligned, inside flash and clear of the running image and the update slot, with A/B slots
+    // also of the boot selector and the boot control log
+    bool valid() {
+        if (!size) return false;
+        if (driver) return driver->block_size && driver->erase && driver->program && driver->read && address % driver->block_size == 0;
+        uint32_t sector, start, length;
+        if (!internalSector(address, &sector, &start, &length) || start != address) return false;
+        if (!internalSector(address + size - 1, &sector, &start, &length)) return false;
+        InternalStorage.layout();
+        uint32_t end = address + size;
+        bool running = address < program_memory_address + program_ota_max_size && end > program_memory_address;
+        bool slot = address < program_ota_address + program_ota_max_size && end > program_ota_address;
+#ifdef NOTA_AB_SLOTS
+        if (address < 0x08004000) return false; // Sector 0, the boot selector
+        for (int i = 0; i < 2; i++) {
+            if (address < boot_control_address[i] + boot_control_size && end > boot_control_address[i]) return false;
+        }
+#endif
+        return !running && !slot;
+    }
+
+    // 0 when the partition is ready for an image of image_size bytes, 1: too large, 2: unlock failed,
+    // 5: no data partition, 6: the partition is not usable (alignment, overlap with the firmware)
+    int open(uint32_t image_size) {
+        if (!size) return 5;
+        if (!valid()) return 6;
+        if (image_size > size) return 1;
+        if (!driver && !InternalStorage.unlocked && !InternalStorage.unlock()) return 2;
+        offset = 0;
+        erased = 0;
+        pending_count = 0;
+        return 0;
+    }
+
+    bool eraseSector(uint32_t sector) {
+        FLASH_EraseInitTypeDef EraseInitStruct;
+        EraseInitStruct.TypeErase = FLASH_TYPEERASE_SECTORS;
+        EraseInitStruct.Sector = sector;
+        EraseInitStruct.NbSectors = 1;
+        EraseInitStruct.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+        uint32_t pageError = 0;
+        HAL_StatusTypeDef status = HAL_ERROR;
+        for (int retries = 3; retries > 0 && status != HAL_OK; retries--) {
+            // Single bank flash stalls the CPU, see OTAStorage::erase()
+            __disable_irq();
+            status = HAL_FLASHEx_Erase(&EraseInitStruct, &pageError);
+            __enable_irq();
+        }
+        return status == HAL_OK;
+    }
+
+    // Erases the blocks up to the partition offset end, one at a time as the writer gets there
+    bool eraseTo(uint32_t end) {
+        while (erased < end) {
+            uint32_t start, length, sector;
+            if (!block(erased, &start, &length, &sector)) return false;
+            bool ok = driver ? driver->erase(address + start) : eraseSector(sector);
+            if (!ok) return false;
+            erased = start + length;
+        }
+        return true;
+    }
+
+    // Reads back what was just programmed
+    bool matches(uint32_t at, const uint8_t* data, uint32_t length) {
+        if (!driver) {
+            const volatile uint8_t* flash = (const volatile uint8_t*) (address + at);
+            for (uint32_t i = 0; i < length; i++) {
+                if (flash[i] != data[i]) return false;
+            }
+            return true;
+        }
+        uint8_t buffer[64];
+        for (uint32_t i = 0; i < length; i += sizeof(buffer)) {
+            uint32_t n = length - i < sizeof(buffer) ? length - i : sizeof(buffer);
+            if (!driver->read(address + at + i, buffer, n) || memcmp(buffer, data + i, n)) return false;
+        }
+        return true;
+    }
+
+    bool programWord(const uint8_t* bytes) {
+        uint32_t value;
+        memcpy(&value, bytes, 4);
+        if (!InternalStorage.program(address + offset, value) || !matches(offset, bytes, 4)) return false;
+        offset += 4;
+        pending_count = 0;
+        return true;
+    }
+
+    bool write(const uint8_t* data, uint32_t length) {
+        if (offset + pending_count + length > size || !eraseTo(offset + pending_count + length)) return false;
+        if (driver) {
+            if (!driver->program(address + offset, data, length) || !matches(offset, data, length)) return false;
+            offset += length;
+            return true;
+        }
+        for (uint32_t i = 0; i < length;) {
+            if (pending_count || length - i < 4) {
+                pending[pending_count++] = data[i++];
+                if (pending_count == 4 && !programWord(pending)) return false;
+                continue;
+            }
+            if (!programWord(data + i)) return false;
+            i += 4;
+        }
+        return true;
+    }
+
+    bool close() {
+        if (driver) return true;
+        // Pad the last partial word with erased bytes
+        if (pending_count) {
+            while (pending_count < 4) pending[pending_count++] = 0xFF;
+            if (!programWord(pending)) return false;
+        }
+        return InternalStorage.lock();
+    }
+
+    // MD5 of the first length bytes of the partition
+    bool digest(uint32_t length, uint8_t* out) {
+        MD5_CTX ctx;
+        MD5::MD5Init(&ctx);
+        if (!driver) {
+            MD5::MD5Update(&ctx, (const uint8_t*) address, length);
+        } else {
+            uint8_t buffer[256];
+            for (uint32_t i = 0; i < length; i += sizeof(buffer)) {
+                uint32_t n = length - i < sizeof(buffer) ? length - i : sizeof(buffer);
+                if (!driver->read(address + i, buffer, n)) return false;
+                MD5::MD5Update(&ctx, buffer, n);
+            }
+        }
+        MD5::MD5Final(out, &ctx);
+        return true;
+    }
+};
+
+NOTA_GLOBAL(OTADataStorage, DataStorage, {});
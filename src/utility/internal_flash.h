@@ -2,12 +2,32 @@
 
 #include <Arduino.h>
 #include "stm32_flash_boot.h"
+#include "nota_global.h"
+#ifdef NOTA_AB_SLOTS
+#include "boot_control.h"
+#else
+// RAM of the target, the initial stack pointer of an image must point into it (boot_control.h has its own)
+NOTA_GLOBAL(uint32_t, boot_ram_start, 0x20000000);
+NOTA_GLOBAL(uint32_t, boot_ram_end, 0x20030000);
+#endif
 
-uint32_t program_memory_address = 0x08000000;
-uint32_t program_ota_address = 0x08040000;
-uint32_t program_ota_max_size = 0x00040000;
-uint32_t ota_sector = 6;
-uint32_t ota_sector_count = 2;
+NOTA_GLOBAL(uint32_t, program_memory_address, 0x08000000);
+NOTA_GLOBAL(uint32_t, program_ota_address, 0x08040000);
+NOTA_GLOBAL(uint32_t, program_ota_max_size, 0x00040000);
+NOTA_GLOBAL(uint32_t, ota_sector, 6);
+NOTA_GLOBAL(uint32_t, ota_sector_count, 2);
+
+#define NOTA_STAGE_MAGIC 0x4753544EUL // "NTSG"
+
+// Stage record in the last bytes of the update slot: a verified image that waits for OTA.applyStaged().
+// It is erased with the slot by the next open(), applyStaged() clears the magic word without an erase.
+// No image reaches into it, so a record that apply() copies along or that stays in a slot which boots is never
+// part of the running image
+typedef struct {
+    uint32_t magic;
+    uint32_t size;
+    char md5[32];
+} ota_stage_record_t;
 
 struct OTAStorage {
     uint32_t program_ota_index = 0;
@@ -45,12 +65,43 @@ struct OTAStorage {
         return false;
     }
 
+    // With A/B slots the running slot is the program region and the other slot receives the update
+    void layout() {
+#ifdef NOTA_AB_SLOTS
+        uint8_t running = nota_boot_running_slot();
+        program_memory_address = slot_address[running];
+        program_ota_address = slot_address[running ^ 1];
+        program_ota_max_size = slot_size;
+        ota_sector = slot_sector[running ^ 1];
+        ota_sector_count = slot_sector_count;
+#endif
+    }
+
+    // Largest image, the stage record is kept clear of it
     uint32_t maxSize() {
-        return program_ota_max_size;
+        return program_ota_max_size - sizeof(ota_stage_record_t);
+    }
+
+    // Address the update runs from: the place of the running image, with A/B slots the slot it is written to
+    uint32_t runAddress() {
+#ifdef NOTA_AB_SLOTS
+        return program_ota_address;
+#else
+        return program_memory_address;
+#endif
+    }
+
+    // A startable vector table: initial stack pointer in RAM, Thumb reset vector inside the region the image runs from
+    bool vectorsValid(uint32_t sp, uint32_t reset) {
+        layout();
+        uint32_t base = runAddress();
+        uint32_t entry = reset & ~1UL;
+        return sp > boot_ram_start && sp <= boot_ram_end && (reset & 1) && entry >= base && entry < base + program_ota_max_size;
     }
 
     int open(uint32_t size) {
-        if (size > program_ota_max_size) return 1;
+        layout();
+        if (size > maxSize()) return 1;
 
         if (!unlocked) {
             bool didUnlock = unlock();
@@ -89,35 +140,130 @@ struct OTAStorage {
         }
         return status == HAL_OK;
     }
+    bool program(uint32_t address, uint32_t value) {
+        int retries = 3;
+        HAL_StatusTypeDef status = HAL_OK;
+        while (true) {
+            __disable_irq();
+            status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address, value);
+            __enable_irq();
+            if (status == HAL_OK) break;
+            retries--;
+            if (retries == 0) break;
+            delay(1);
+        }
+        return status == HAL_OK;
+    }
     bool write(uint8_t b) {
         if (!unlocked) unlock();
         if (data_idx == 0) data = 0;
         data |= b << (data_idx * 8);
         data_idx++;
         if (data_idx == 4) {
-            int retries = 3;
-            HAL_StatusTypeDef status = HAL_OK;
-            while (true) {
-                __disable_irq();
-                status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, program_ota_address + program_ota_index, data);
-                __enable_irq();
-                if (status == HAL_OK) break;
-                retries--;
-                if (retries == 0) break;
-                delay(1);
-            }
-            if (status != HAL_OK) return false;
+            if (!program(program_ota_address + program_ota_index, data)) return false;
             program_ota_index += 4;
             data_idx = 0;
         }
         return true;
     }
+    // Programs the whole words of the buffer directly, only a partial word at either end is collected byte by byte
+    bool write(const uint8_t* buffer, uint32_t size) {
+        uint32_t i = 0;
+        while (i < size && data_idx) {
+            if (!write(buffer[i++])) return false;
+        }
+        if (!unlocked) unlock();
+        for (; i + 4 <= size; i += 4) {
+            uint32_t value;
+            memcpy(&value, buffer + i, 4);
+            if (!program(program_ota_address + program_ota_index, value)) return false;
+            program_ota_index += 4;
+        }
+        while (i < size) {
+            if (!write(buffer[i++])) return false;
+        }
+        return true;
+    }
+    // Leaves size bytes as erased by open(): the gaps of a sparse transfer are neither sent nor programmed.
+    // Only a gap at the end of the image may end off a word boundary
+    bool skip(uint32_t size) {
+        if (data_idx || program_ota_index + size > maxSize()) return false;
+        program_ota_index += size;
+        return true;
+    }
+    // Programs data at a word aligned offset of the OTA region, for transfers that arrive out of order.
+    // A partial last word is padded with erased bytes
+    bool writeAt(uint32_t offset, const uint8_t* buffer, uint32_t size) {
+        if (offset % 4 || offset + size > maxSize()) return false;
+        if (!unlocked) unlock();
+        for (uint32_t i = 0; i < size; i += 4) {
+            uint32_t value = 0xFFFFFFFF;
+            memcpy(&value, buffer + i, size - i < 4 ? size - i : 4);
+            if (!program(program_ota_address + offset + i, value)) return false;
+        }
+        return true;
+    }
+
+    bool close() {
+        // Pad the last partial word with erased bytes
+        while (data_idx) {
+            if (!write(0xFF)) return false;
+        }
+        return lock();
+    }
+
+    uint32_t stageAddress() {
+        layout();
+        return program_ota_address + program_ota_max_size - sizeof(ota_stage_record_t);
+    }
+
+    // Marks the verified image of size bytes as staged. The magic word goes last, so a torn record never counts
+    bool stage(uint32_t size, const char* md5) {
+        if (size > maxSize() || strlen(md5) != 32) return false;
+        uint32_t address = stageAddress();
+        if (!unlocked && !unlock()) return false;
+        bool ok = program(address + 4, size);
+        for (uint32_t i = 0; i < 32 && ok; i += 4) {
+            uint32_t value;
+            memcpy(&value, md5 + i, 4);
+            ok = program(address + 8 + i, value);
+        }
+        ok = ok && program(address, NOTA_STAGE_MAGIC);
+        lock();
+        return ok;
+    }
+
+    // Size and MD5 of the staged image, false when there is none
+    bool staged(uint32_t* size, char* md5) {
+        const volatile ota_stage_record_t* record = (const volatile ota_stage_record_t*) stageAddress();
+        if (record->magic != NOTA_STAGE_MAGIC || record->size > maxSize()) return false;
+        if (size) *size = record->size;
+        if (md5) {
+            for (int i = 0; i < 32; i++) md5[i] = record->md5[i];
+            md5[32] = '\0';
+        }
+        return true;
+    }
 
-    bool close() { return lock(); }
+    bool unstage() {
+        uint32_t address = stageAddress();
+        if (*(const volatile uint32_t*) address != NOTA_STAGE_MAGIC) return true;
+        if (!unlocked && !unlock()) return false;
+        bool ok = program(address, 0);
+        lock();
+        return ok;
+    }
 
     void apply() {
+#ifdef NOTA_AB_SLOTS
+        // No copy: the boot selector starts the other slot on the next reset and rolls back if it is never confirmed
+        nota_boot_append(NOTA_BOOT_PENDING | (nota_boot_running_slot() ^ 1));
+#else
         if (!unlocked) unlock();
         noInterrupts();
         copy_flash_pages_nota(program_memory_address, (uint8_t*) program_ota_address, program_ota_max_size, true);
+#endif
     }
-} InternalStorage;
\ No newline at end of file
+};
+
+NOTA_GLOBAL(OTAStorage, InternalStorage, {});
\ No newline at end of file
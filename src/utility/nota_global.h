@@ -0,0 +1,12 @@
+#pragma once
+
+// Variables defined in the NOTA headers: NOTA_GLOBAL(type, name, initializer). From C++17 on they are inline variables,
+// one object however many translation units include NOTA.h. Before C++17 they are extern everywhere and defined in the
+// one translation unit that defines NOTA_IMPLEMENTATION before it includes NOTA.h
+#if __cplusplus >= 201703L
+#define NOTA_GLOBAL(type, name, ...) inline type name = __VA_ARGS__
+#elif defined(NOTA_IMPLEMENTATION)
+#define NOTA_GLOBAL(type, name, ...) type name = __VA_ARGS__
+#else
+#define NOTA_GLOBAL(type, name, ...) extern type name
+#endif
@@ -0,0 +1,221 @@
+// #############################################################################################################################################
+// 'nota-receive-bench'
+// #############################################################################################################################################
+// Measures the receive loop of NOTA.h on the host: time and cycles per byte and code size of NOTAReceiver with different policies,
+// next to the per byte loop it replaced (one read() and one std::function write per byte, like the STM32 path of NOTAClass).
+//
+// use it like: nota-receive-bench [image size in kB, default 1024]
+//
+// The source hands out the image in TCP segments of 1460 bytes, the storage programs 32-bit words into RAM the way
+// InternalStorage programs the flash. The numbers compare loop overhead only: flash program time and the network stack
+// are not part of it, see src/nota_timing.h for those.
+// #############################################################################################################################################
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <functional>
+#include <vector>
+
+#include "MD5.h"
+#include "nota_receiver.h"
+
+#define SEGMENT 1460
+#define BUFFER_SIZE 1024  // NOTA_COPY_SIZE
+#define ROUNDS 5
+
+// Image in TCP segments: available() reports what is left of the current segment
+struct segment_source {
+    const uint8_t* data;
+    uint32_t size;
+    uint32_t offset = 0;
+    uint32_t segment_end = 0;
+    int available() {
+        if (offset == segment_end) segment_end = offset + SEGMENT < size ? offset + SEGMENT : size;
+        return segment_end - offset;
+    }
+    int read() { return available() > 0 ? data[offset++] : -1; }
+    int read(uint8_t* buffer, size_t n) {
+        uint32_t count = available();
+        if (count > n) count = n;
+        memcpy(buffer, data + offset, count);
+        offset += count;
+        return count;
+    }
+};
+
+// RAM stand-in for InternalStorage: collects bytes into words, programs whole words
+struct ram_storage {
+    volatile uint32_t* words;
+    uint32_t index = 0;
+    uint32_t data = 0;
+    int data_idx = 0;
+    bool program(uint32_t value) {
+        words[index++] = value;
+        return true;
+    }
+    bool write(uint8_t b) {
+        if (data_idx == 0) data = 0;
+        data |= b << (data_idx * 8);
+        if (++data_idx == 4) {
+            data_idx = 0;
+            return program(data);
+        }
+        return true;
+    }
+    bool write(const uint8_t* buffer, uint32_t size) {
+        uint32_t i = 0;
+        while (i < size && data_idx) {
+            if (!write(buffer[i++])) return false;
+        }
+        for (; i + 4 <= size; i += 4) {
+            uint32_t value;
+            memcpy(&value, buffer + i, 4);
+            if (!program(value)) return false;
+        }
+        while (i < size) {
+            if (!write(buffer[i++])) return false;
+        }
+        return true;
+    }
+};
+
+static volatile uint32_t progress_sink;
+static void progress_fn(uint32_t received, uint32_t) { progress_sink = received; }
+
+struct progress_functor {
+    void operator()(uint32_t received, uint32_t) { progress_sink = received; }
+};
+
+static uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// The loop NOTAReceiver replaced: a read() and a std::function write per byte, size checks per byte
+__attribute__((noinline)) static bool bench_legacy(segment_source& source, ram_storage& storage, const char*) {
+    std::function<bool(const uint8_t*, uint32_t)> write = [&](const uint8_t* data, uint32_t size) {
+        for (uint32_t i = 0; i < size; i++) if (!storage.write(data[i])) return false;
+        return true;
+    };
+    std::function<void(uint32_t, uint32_t)> progress = progress_fn;
+    uint32_t total = 0;
+    while (total < source.size) {
+        uint32_t written = 0;
+        while (source.available()) {
+            uint8_t b = source.read();
+            if (!write(&b, 1)) return false;
+            written++;
+            if (total + written > source.size) return false;
+        }
+        total += written;
+        if (written) progress(total, source.size);
+    }
+    return true;
+}
+
+template <typename Hash, typename Callbacks>
+static bool run_receiver(segment_source& source, ram_storage& storage, const char* md5, Callbacks progress) {
+    static uint8_t buffer[BUFFER_SIZE];
+    NOTAReceiver<ram_storage, Hash, Callbacks> receiver(storage, progress);
+    receiver.begin(source.size);
+    while (!receiver.complete()) {
+        if (receiver.receive(source, buffer, sizeof(buffer)) < 0) return false;
+    }
+    return receiver.finish(md5);
+}
+
+// NOTAClass on STM32: no hash while receiving, no progress callback in the loop
+__attribute__((noinline)) static bool bench_receiver(segment_source& source, ram_storage& storage, const char* md5) {
+    return run_receiver<nota_no_hash>(source, storage, md5, nota_no_progress());
+}
+
+__attribute__((noinline)) static bool bench_receiver_fn(segment_source& source, ram_storage& storage, const char* md5) {
+    return run_receiver<nota_no_hash>(source, storage, md5, &progress_fn);
+}
+
+__attribute__((noinline)) static bool bench_receiver_functor(segment_source& source, ram_storage& storage, const char* md5) {
+    return run_receiver<nota_no_hash>(source, storage, md5, progress_functor());
+}
+
+__attribute__((noinline)) static bool bench_receiver_std_function(segment_source& source, ram_storage& storage, const char* md5) {
+    return run_receiver<nota_no_hash>(source, storage, md5, std::function<void(uint32_t, uint32_t)>(progress_fn));
+}
+
+__attribute__((noinline)) static bool bench_receiver_md5(segment_source& source, ram_storage& storage, const char* md5) {
+    return run_receiver<nota_md5_hash>(source, storage, md5, nota_no_progress());
+}
+
+int main(int argc, char** argv) {
+    uint32_t size = (argc > 1 ? atoi(argv[1]) : 1024) * 1024 + 3; // Odd size: the last word is partial
+    std::vector<uint8_t> image(size);
+    srand(1);
+    for (uint8_t& b : image) b = rand();
+    std::vector<uint32_t> flash(size / 4 + 1);
+
+    MD5_CTX ctx;
+    uint8_t digest[16];
+    MD5::MD5Init(&ctx);
+    MD5::MD5Update(&ctx, image.data(), size);
+    MD5::MD5Final(digest, &ctx);
+    char* md5 = MD5::make_digest(digest, 16);
+
+    struct {
+        const char* name;
+        bool (*run)(segment_source&, ram_storage&, const char*);
+        size_t ram;
+    } variants[] = {
+        { "per byte loop (before)", bench_legacy, 0 },
+        { "NOTAReceiver (STM32 default)", bench_receiver, sizeof(NOTAReceiver<ram_storage>) },
+        { "  + function pointer progress", bench_receiver_fn, sizeof(NOTAReceiver<ram_storage, nota_no_hash, void (*)(uint32_t, uint32_t)>) },
+        { "  + functor progress", bench_receiver_functor, sizeof(NOTAReceiver<ram_storage, nota_no_hash, progress_functor>) },
+        { "  + std::function progress", bench_receiver_std_function, sizeof(NOTAReceiver<ram_storage, nota_no_hash, std::function<void(uint32_t, uint32_t)>>) },
+        { "  + MD5 while receiving", bench_receiver_md5, sizeof(NOTAReceiver<ram_storage, nota_md5_hash>) },
+    };
+
+    printf("%u byte image in %d byte segments, best of %d rounds\n", size, SEGMENT, ROUNDS);
+    printf("%-32s %10s %12s %10s\n", "variant", "ns/byte", "cycles/byte", "RAM bytes");
+    int failed = 0;
+    for (auto& variant : variants) {
+        double best_ns = 0;
+        uint64_t best_cycles = 0;
+        for (int round = 0; round < ROUNDS; round++) {
+            memset(flash.data(), 0xFF, flash.size() * 4);
+            segment_source source = { image.data(), size };
+            ram_storage storage = { flash.data() };
+            double start = now_ns();
+            uint64_t start_cycles = cycles();
+            bool ok = variant.run(source, storage, md5);
+            // Flush the partial last word the way close() does
+            while (storage.data_idx) storage.write((uint8_t) 0xFF);
+            uint64_t used_cycles = cycles() - start_cycles;
+            double used = now_ns() - start;
+            if (!ok || memcmp(flash.data(), image.data(), size)) {
+                printf("%-32s FAILED\n", variant.name);
+                failed++;
+                break;
+            }
+            if (!round || used < best_ns) best_ns = used;
+            if (!round || used_cycles < best_cycles) best_cycles = used_cycles;
+        }
+        if (variant.ram) printf("%-32s %10.3f %12.2f %10zu\n", variant.name, best_ns / size, (double) best_cycles / size, variant.ram);
+        else printf("%-32s %10.3f %12.2f %10s\n", variant.name, best_ns / size, (double) best_cycles / size, "-");
+    }
+    free(md5);
+    return failed ? 1 : 0;
+}
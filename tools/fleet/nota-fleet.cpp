@@ -0,0 +1,642 @@
+// #############################################################################################################################################
+// 'nota-fleet' by J.Vovk
+// #############################################################################################################################################
+// Uploads one firmware image to many NOTA devices in parallel from a single epoll event loop (Linux).
+//
+// use it like: nota-fleet -f <sketch.bin> [-p port] [-a password] [-j concurrency] [-c chunk] [-s] [-b board] [--reflash] [--hosts file] <host[:port]> ...
+//
+// With [--predict] nothing is uploaded: every device is queried for its platform and round trip time and the duration of each
+// update phase is predicted with the model of src/nota_timing.h. [--compare] uploads and prints the measured phases next to the
+// predicted ones, with [--tolerance <percent>] a phase that takes longer than predicted fails the run (regression check).
+// The model needs [--bandwidth <kB/s>] per session, [--family <name>] for devices that report an unknown platform and
+// [--ab] or [--layout <ota sector>:<count>[:<program sector>]] when the STM32 slot layout differs from internal_flash.h.
+//
+// [--rate <kB/s>] limits every session to that rate (the aggregate is up to -j times as much), so updates can share the
+// links with application traffic.
+//
+// The image is mapped into memory once and shared by all sessions. Every session speaks the same protocol as nota.js:
+// request line, optional AUTH round trip, then stop-and-wait chunks acked with the received byte count and a final "OK".
+// Protocol constants come from src/nota_protocol.h and hashing from src/MD5.cpp, the same code that runs on the device.
+// #############################################################################################################################################
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "MD5.h"
+#include "nota_protocol.h"
+#include "nota_timing.h"
+
+#define DEFAULT_PORT            8266
+#define DEFAULT_CHUNK_SIZE      2048
+#define DEFAULT_CONCURRENCY     32
+#define CONNECT_TIMEOUT         5.0     // seconds
+#define REPLY_SETTLE            0.05    // wait for the rest of a handshake reply, it has no terminator
+#define BEGIN_TIMEOUT           30.0    // device erases the slot before it acks the start
+#define ACK_TIMEOUT             5.0
+#define FINISH_TIMEOUT          20.0
+#define DEFAULT_BANDWIDTH       1000.0  // kB/s per session for the prediction
+
+typedef enum {
+    S_WAITING,
+    S_CONNECTING,
+    S_REQUEST,
+    S_AUTH,
+    S_BEGIN,
+    S_STREAM,
+    S_FINISH,
+    S_DONE,
+    S_FAILED
+} session_state_t;
+
+struct session_t {
+    std::string host;
+    uint16_t port = DEFAULT_PORT;
+    int fd = -1;
+    session_state_t state = S_WAITING;
+    uint32_t events = 0;
+    std::string rx;
+    std::string tx;
+    uint32_t offset = 0;        // Start of the chunk in flight
+    uint32_t chunk = 0;         // Size of the chunk in flight
+    uint32_t chunk_sent = 0;
+    double started = 0;
+    double connected = 0;
+    double replied = 0;         // Handshake reply, or the STAT record with --predict
+    double stream_started = 0;
+    double stream_done = 0;
+    double chunk_started = 0;
+    double send_at = 0;         // --rate: the next chunk waits until then
+    double finished = 0;
+    double deadline = 0;
+    double settle = 0;
+    std::string name;
+    std::string board;
+    std::string platform;
+    std::string error;
+    bool auth = false;
+    bool same = false;          // Device already runs the image
+};
+
+static const uint8_t* image = nullptr;
+static uint32_t image_size = 0;
+static std::string image_md5;
+static std::string image_path;
+static std::string password_md5;
+static std::string expected_board;
+static uint32_t chunk_size = DEFAULT_CHUNK_SIZE;
+static int command = NOTA_CMD_FLASH;
+static bool reflash = false;
+static int epoll_fd = -1;
+static bool predict_only = false;
+static bool compare = false;
+static double tolerance = 0;    // Percent a measured phase may exceed the prediction, 0 to only report
+static double bandwidth_kbps = DEFAULT_BANDWIDTH;
+static const nota_flash_family_t* forced_family = nullptr;
+static nota_slot_layout_t layout = NOTA_LAYOUT_DEFAULT;
+static bool regression = false;
+static double rate_limit = 0;   // bytes/s per session, 0 = unlimited
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static std::string md5_hex(const void* data, size_t size) {
+    MD5_CTX ctx;
+    unsigned char digest[16];
+    MD5::MD5Init(&ctx);
+    MD5::MD5Update(&ctx, data, size);
+    MD5::MD5Final(digest, &ctx);
+    char* hex = MD5::make_digest(digest, 16);
+    std::string result = hex;
+    free(hex);
+    return result;
+}
+static std::string md5_hex(const std::string& text) { return md5_hex(text.data(), text.size()); }
+
+// Acks are undelimited decimal byte counts, one per receive burst on the device.
+// Check whether the received digits split into counts that add up to the chunk size. Positions that
+// failed with a given remainder are remembered, so the search stays polynomial like the one of nota.js
+typedef std::set<std::pair<size_t, uint32_t>> ack_memo_t;
+static bool ack_split(const std::string& digits, size_t i, uint32_t left, ack_memo_t& failed) {
+    if (i == digits.size()) return left == 0;
+    if (left == 0 || digits[i] == '0') return false;
+    if (failed.count({ i, left })) return false;
+    uint32_t value = 0;
+    for (size_t j = i; j < digits.size(); j++) {
+        if (digits[j] < '0' || digits[j] > '9') return false;
+        value = value * 10 + (digits[j] - '0');
+        if (value > left) break;
+        if (ack_split(digits, j + 1, left - value, failed)) return true;
+    }
+    failed.insert({ i, left });
+    return false;
+}
+static bool ack_matches(const std::string& digits, uint32_t size) {
+    ack_memo_t failed;
+    return !digits.empty() && digits.size() <= 10 * 4 && ack_split(digits, 0, size, failed);
+}
+
+static std::vector<std::string> split(const std::string& text, const std::string& separator) {
+    std::vector<std::string> parts;
+    size_t start = 0, index;
+    while ((index = text.find(separator, start)) != std::string::npos) {
+        parts.push_back(text.substr(start, index - start));
+        start = index + separator.size();
+    }
+    parts.push_back(text.substr(start));
+    return parts;
+}
+
+static void watch(session_t& s) {
+    uint32_t events = EPOLLIN;
+    bool pending_chunk = s.state == S_STREAM && s.chunk_sent < s.chunk && now() >= s.send_at;
+    if (s.state == S_CONNECTING || !s.tx.empty() || pending_chunk) events |= EPOLLOUT;
+    if (events == s.events) return;
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.ptr = &s;
+    epoll_ctl(epoll_fd, s.events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, s.fd, &ev);
+    s.events = events;
+}
+
+static bool predict(const session_t& s, double rtt_ms, nota_prediction_t& p) {
+    const nota_flash_family_t* family = forced_family ? forced_family : nota_flash_family(s.platform.c_str());
+    if (!family) return false;
+    nota_link_t link = { rtt_ms, bandwidth_kbps, chunk_size, (uint8_t) s.auth };
+    p = nota_predict(family, &layout, &link, image_size);
+    return true;
+}
+
+static void print_prediction(const session_t& s, const char* full_name) {
+    nota_prediction_t p;
+    double rtt = (s.replied - s.connected) * 1000;
+    if (!predict(s, rtt, p)) {
+        printf("%s:%u: %s unknown platform \"%s\", use [--family]\n", s.host.c_str(), s.port, full_name, s.platform.c_str());
+        return;
+    }
+    printf("%s:%u: %s rtt %.1f ms: handshake %.2f s, erase %.2f s, transfer %.2f s, verify %.2f s, apply %.2f s = %.2f s\n",
+        s.host.c_str(), s.port, full_name, rtt, p.handshake_ms / 1000, p.erase_ms / 1000, p.transfer_ms / 1000, p.verify_ms / 1000,
+        p.apply_ms / 1000, p.total_ms / 1000);
+    printf("    blocked %.2f s, offline %.2f s, interrupts off up to %.0f ms\n", p.blocked_ms / 1000, p.offline_ms / 1000, p.irq_off_ms);
+}
+
+// Measured phases of a finished upload next to the prediction. Apply is not observable from here, the device is gone
+static void print_comparison(const session_t& s) {
+    nota_prediction_t p;
+    double rtt = (s.connected - s.started) * 1000; // TCP connect
+    if (!predict(s, rtt, p)) {
+        printf("    unknown platform \"%s\", use [--family]\n", s.platform.c_str());
+        return;
+    }
+    const char* names[] = { "handshake", "erase", "transfer", "verify" };
+    double predicted[] = { p.handshake_ms, p.erase_ms, p.transfer_ms, p.verify_ms };
+    double measured[] = { (s.replied - s.started) * 1000, (s.stream_started - s.replied) * 1000,
+        (s.stream_done - s.stream_started) * 1000, (s.finished - s.stream_done) * 1000 };
+    for (int i = 0; i < 4; i++) {
+        bool slow = tolerance > 0 && measured[i] > predicted[i] * (1 + tolerance / 100);
+        if (slow) regression = true;
+        printf("    %-10s predicted %8.2f s  measured %8.2f s  %+6.1f%%%s\n", names[i], predicted[i] / 1000, measured[i] / 1000,
+            predicted[i] > 0 ? (measured[i] / predicted[i] - 1) * 100 : 0.0, slow ? "  SLOW" : "");
+    }
+    // Per byte device cost the measured transfer implies, when the device and not the link is the bottleneck
+    const nota_flash_family_t* family = forced_family ? forced_family : nota_flash_family(s.platform.c_str());
+    uint32_t chunks = (image_size + chunk_size - 1) / chunk_size;
+    double per_chunk = (measured[2] - NOTA_T_START_DELAY) / chunks - rtt;
+    double device = per_chunk - nota_program_ms(family, chunk_size);
+    if (device > chunk_size / (bandwidth_kbps * 1.024)) printf("    implied receive_ns %.0f (model %u)\n", device / chunk_size * 1e6, family->receive_ns);
+}
+
+static void finish(session_t& s, session_state_t state, const std::string& error = "") {
+    if (s.fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s.fd, nullptr);
+        close(s.fd);
+        s.fd = -1;
+    }
+    s.state = state;
+    s.error = error;
+    s.finished = now();
+    std::string full_name = s.name + (s.board.size() ? " (" + s.board + ")" : "");
+    if (state == S_DONE && predict_only) {
+        print_prediction(s, full_name.c_str());
+    } else if (state == S_DONE && s.same) {
+        printf("%s:%u: SAME %s already runs this image\n", s.host.c_str(), s.port, full_name.c_str());
+    } else if (state == S_DONE) {
+        double transfer = s.finished - s.stream_started;
+        printf("%s:%u: OK %s %u bytes in %.2f s (%.1f kB/s transfer, %.2f s total)\n", s.host.c_str(), s.port, full_name.c_str(),
+            image_size, transfer, image_size / 1024.0 / (transfer > 0 ? transfer : 1e-3), s.finished - s.started);
+        if (compare) print_comparison(s);
+    } else {
+        printf("%s:%u: FAILED %s%s%s\n", s.host.c_str(), s.port, full_name.c_str(), full_name.size() ? " " : "", error.c_str());
+    }
+    fflush(stdout);
+}
+
+static void start(session_t& s) {
+    s.started = now();
+    struct addrinfo hints = {}, * res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    std::string port = std::to_string(s.port);
+    int rc = getaddrinfo(s.host.c_str(), port.c_str(), &hints, &res);
+    if (rc != 0 || !res) return finish(s, S_FAILED, std::string("resolve: ") + gai_strerror(rc));
+    s.fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s.fd < 0) {
+        freeaddrinfo(res);
+        return finish(s, S_FAILED, std::string("socket: ") + strerror(errno));
+    }
+    int one = 1;
+    setsockopt(s.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    rc = connect(s.fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (rc < 0 && errno != EINPROGRESS) return finish(s, S_FAILED, std::string("connect: ") + strerror(errno));
+    s.state = S_CONNECTING;
+    s.deadline = now() + CONNECT_TIMEOUT;
+    watch(s);
+}
+
+static void next_chunk(session_t& s) {
+    s.offset += s.chunk;
+    s.rx.clear();
+    if (s.offset >= image_size) {
+        s.chunk = 0;
+        s.stream_done = now();
+        s.state = S_FINISH;
+        s.deadline = now() + FINISH_TIMEOUT;
+        return;
+    }
+    // Stop-and-wait pacing: a chunk starts no earlier than the previous start plus its size at the rate
+    if (rate_limit > 0) s.send_at = s.chunk_started + s.chunk / rate_limit;
+    s.chunk = image_size - s.offset < chunk_size ? image_size - s.offset : chunk_size;
+    s.chunk_sent = 0;
+    s.deadline = std::max(now(), s.send_at) + ACK_TIMEOUT;
+}
+
+static void begin_stream(session_t& s) {
+    s.state = S_STREAM;
+    s.stream_started = now();
+    s.offset = 0;
+    s.chunk = 0;
+    next_chunk(s);
+}
+
+// Handshake reply: "OK <meta>", "AUTH <nonce> <meta>", "SAME <meta>" or "ERR:<reason> <meta>"
+static void parse_reply(session_t& s) {
+    std::vector<std::string> tokens = split(s.rx, " ");
+    size_t i = 0;
+    while (i < tokens.size() && tokens[i] != "OK" && tokens[i] != "AUTH" && tokens[i] != "SAME") i++;
+    if (i == tokens.size()) return finish(s, S_FAILED, "bad invitation response: " + s.rx);
+    std::string response = tokens[i++];
+    std::string nonce = response == "AUTH" && i < tokens.size() ? tokens[i++] : "";
+    std::string meta;
+    for (; i < tokens.size(); i++) meta += (meta.empty() ? "" : " ") + tokens[i];
+    std::vector<std::string> fields = split(meta, NOTA_META_SEPARATOR);
+    if (fields.size() > 1) s.name = fields[1];
+    if (fields.size() > 2) s.platform = fields[2];
+    if (fields.size() > 3) s.board = fields[3];
+    if (expected_board.size() && s.board != expected_board) return finish(s, S_FAILED, "board mismatch, expected " + expected_board);
+    s.rx.clear();
+    s.auth = response == "AUTH";
+    if (response == "SAME") {
+        s.same = true;
+        return finish(s, S_DONE);
+    }
+    if (response == "OK") {
+        s.state = S_BEGIN;
+        s.deadline = now() + BEGIN_TIMEOUT;
+        return;
+    }
+    if (password_md5.empty()) return finish(s, S_FAILED, "target requires authentication, use [-a]");
+    std::string cnonce = md5_hex(image_path + std::to_string(image_size) + image_md5 + s.host);
+    std::string challenge = md5_hex(password_md5 + ":" + nonce + ":" + cnonce);
+    s.tx += std::to_string(NOTA_CMD_AUTH) + " " + cnonce + " " + challenge + "\n";
+    s.state = S_AUTH;
+    s.deadline = now() + BEGIN_TIMEOUT;
+}
+
+// STAT record of a query: "STAT <nota>|/<name>|/<platform>|/<board>|/..."
+static void parse_stat(session_t& s) {
+    size_t start = s.rx.find("STAT ");
+    if (start == std::string::npos) return finish(s, S_FAILED, "bad query response: " + s.rx);
+    std::vector<std::string> fields = split(s.rx.substr(start + 5, s.rx.find('\n', start) - start - 5), NOTA_META_SEPARATOR);
+    if (fields.size() > 1) s.name = fields[1];
+    if (fields.size() > 2) s.platform = fields[2];
+    if (fields.size() > 3) s.board = fields[3];
+    if (expected_board.size() && s.board != expected_board) return finish(s, S_FAILED, "board mismatch, expected " + expected_board);
+    finish(s, S_DONE);
+}
+
+static void process(session_t& s) {
+    if (s.rx.find("ERR") != std::string::npos && s.state != S_REQUEST) return finish(s, S_FAILED, s.rx);
+    switch (s.state) {
+        case S_REQUEST:
+            if (!s.replied) s.replied = now();
+            if (predict_only) {
+                if (s.rx.find('\n') != std::string::npos) parse_stat(s);
+                break;
+            }
+            if (!s.rx.empty() && !s.settle) s.settle = now() + REPLY_SETTLE;
+            break;
+        case S_AUTH:
+        case S_BEGIN:
+            if (s.rx.find("OK") != std::string::npos) begin_stream(s);
+            break;
+        case S_STREAM:
+            if (s.chunk_sent == s.chunk && ack_matches(s.rx, s.chunk)) next_chunk(s);
+            break;
+        case S_FINISH:
+            if (s.rx.find("OK") != std::string::npos) return finish(s, S_DONE);
+            break;
+        default:
+            break;
+    }
+}
+
+static void flush(session_t& s) {
+    while (!s.tx.empty()) {
+        ssize_t n = send(s.fd, s.tx.data(), s.tx.size(), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            return finish(s, S_FAILED, std::string("send: ") + strerror(errno));
+        }
+        s.tx.erase(0, n);
+    }
+    if (s.state == S_STREAM && s.chunk_sent == 0 && s.chunk) {
+        if (now() < s.send_at) return;
+        s.chunk_started = now();
+    }
+    while (s.state == S_STREAM && s.chunk_sent < s.chunk) {
+        ssize_t n = send(s.fd, image + s.offset + s.chunk_sent, s.chunk - s.chunk_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            return finish(s, S_FAILED, std::string("send: ") + strerror(errno));
+        }
+        s.chunk_sent += n;
+    }
+}
+
+static void on_event(session_t& s, uint32_t events) {
+    if (s.state == S_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(s.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) return finish(s, S_FAILED, std::string("connect: ") + strerror(err));
+        if (!(events & EPOLLOUT)) return;
+        s.tx = std::to_string(command) + " " + std::to_string(image_size) + " " + image_md5 + (reflash ? " reflash=1" : "") + "\n";
+        if (predict_only) s.tx = std::to_string(NOTA_CMD_QUERY) + "\n";
+        s.connected = now();
+        s.state = S_REQUEST;
+        s.deadline = now() + CONNECT_TIMEOUT;
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        char buf[1024];
+        while (s.fd >= 0) {
+            ssize_t n = recv(s.fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                s.rx.append(buf, n);
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            process(s);
+            if (s.fd >= 0) finish(s, S_FAILED, n == 0 ? "connection closed by device" : std::string("recv: ") + strerror(errno));
+            return;
+        }
+        process(s);
+    }
+    if (s.fd >= 0) flush(s);
+    if (s.fd >= 0) watch(s);
+}
+
+static void on_timer(session_t& s, double t) {
+    if (s.state == S_REQUEST && s.settle && t >= s.settle) {
+        s.settle = 0;
+        parse_reply(s);
+        if (s.fd >= 0) process(s);
+        if (s.fd >= 0) flush(s);
+        if (s.fd >= 0) watch(s);
+        return;
+    }
+    if (s.state == S_STREAM && s.send_at && s.chunk_sent == 0 && s.chunk && t >= s.send_at) {
+        flush(s);
+        if (s.fd >= 0) watch(s);
+        if (s.fd < 0) return;
+    }
+    if (t < s.deadline) return;
+    static const char* names[] = { "waiting", "connecting", "request", "authentication", "begin", "transfer", "finish" };
+    finish(s, S_FAILED, std::string("timeout during ") + names[s.state] + (s.rx.size() ? ", received " + s.rx : ""));
+}
+
+static bool map_image(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    madvise(map, st.st_size, MADV_WILLNEED);
+    image = (const uint8_t*) map;
+    image_size = (uint32_t) st.st_size;
+    image_md5 = md5_hex(image, image_size);
+    return true;
+}
+
+static void add_host(std::vector<session_t>& sessions, std::string target, uint16_t port) {
+    size_t colon = target.rfind(':');
+    session_t s;
+    s.host = target;
+    s.port = port;
+    if (colon != std::string::npos && target.find(':') == colon) {
+        s.host = target.substr(0, colon);
+        s.port = (uint16_t) atoi(target.substr(colon + 1).c_str());
+    }
+    sessions.push_back(s);
+}
+
+static void usage() {
+    fprintf(stderr,
+        "usage: nota-fleet -f <image.bin> [-p port] [-a password] [-j concurrency] [-c chunk] [-s] [-b board] [--reflash] [--hosts file] <host[:port]> ...\n"
+        "  -f, --file         image to upload\n"
+        "  -p, --port         default device port (%d)\n"
+        "  -a, --auth         device password\n"
+        "  -j, --jobs         concurrent sessions (%d)\n"
+        "  -c, --chunk        chunk size in bytes (%d)\n"
+        "  -s, --spiffs       upload a filesystem image\n"
+        "  -b, --board        only update devices reporting this board\n"
+        "      --reflash      upload even to devices that already run the image\n"
+        "      --hosts        file with one host[:port] per line\n"
+        "      --rate         kB/s per session\n"
+        "      --predict      query the devices and predict the update phases, nothing is uploaded\n"
+        "      --compare      upload and print the measured phases next to the prediction\n"
+        "      --tolerance    with --compare, fail when a phase exceeds the prediction by this many percent\n"
+        "      --bandwidth    kB/s per session for the prediction (%.0f)\n"
+        "      --family       flash family for the prediction (STM32F4, STM32F2, STM32F7, ESP32, ESP8266)\n"
+        "      --ab           STM32 A/B slot layout of boot_control.h\n"
+        "      --layout       STM32 update slot <ota sector>:<count>[:<program sector>] (6:2:0)\n",
+        DEFAULT_PORT, DEFAULT_CONCURRENCY, DEFAULT_CHUNK_SIZE, DEFAULT_BANDWIDTH);
+}
+
+int main(int argc, char** argv) {
+    uint16_t port = DEFAULT_PORT;
+    int concurrency = DEFAULT_CONCURRENCY;
+    std::vector<std::string> targets;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if ((arg == "-f" || arg == "--file") && has_value) image_path = argv[++i];
+        else if ((arg == "-p" || arg == "--port") && has_value) port = (uint16_t) atoi(argv[++i]);
+        else if ((arg == "-a" || arg == "--auth") && has_value) password_md5 = md5_hex(std::string(argv[++i]));
+        else if ((arg == "-j" || arg == "--jobs") && has_value) concurrency = atoi(argv[++i]);
+        else if ((arg == "-c" || arg == "--chunk") && has_value) chunk_size = (uint32_t) atoi(argv[++i]);
+        else if ((arg == "-b" || arg == "--board") && has_value) expected_board = argv[++i];
+        else if (arg == "-s" || arg == "--spiffs") command = NOTA_CMD_FS;
+        else if (arg == "--reflash") reflash = true;
+        else if (arg == "--predict") predict_only = true;
+        else if (arg == "--rate" && has_value) rate_limit = atof(argv[++i]) * 1024;
+        else if (arg == "--compare") compare = true;
+        else if (arg == "--tolerance" && has_value) tolerance = atof(argv[++i]);
+        else if (arg == "--bandwidth" && has_value) bandwidth_kbps = atof(argv[++i]);
+        else if (arg == "--ab") layout = NOTA_LAYOUT_AB_SLOTS;
+        else if (arg == "--layout" && has_value) {
+            unsigned first = 0, count = 0, program = 0;
+            int n = sscanf(argv[++i], "%u:%u:%u", &first, &count, &program);
+            if (n < 2) {
+                usage();
+                return 1;
+            }
+            layout = { first, count, program, layout.copy_on_apply };
+        } else if (arg == "--family" && has_value) {
+            forced_family = nota_flash_family(argv[++i]);
+            if (!forced_family) {
+                fprintf(stderr, "Unknown flash family %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (arg == "--hosts" && has_value) {
+            std::ifstream file(argv[++i]);
+            if (!file) {
+                fprintf(stderr, "Cannot read host list %s\n", argv[i]);
+                return 1;
+            }
+            std::string line;
+            while (std::getline(file, line)) {
+                size_t comment = line.find('#');
+                if (comment != std::string::npos) line.erase(comment);
+                line.erase(0, line.find_first_not_of(" \t\r"));
+                line.erase(line.find_last_not_of(" \t\r") + 1);
+                if (!line.empty()) targets.push_back(line);
+            }
+        } else if (arg == "-h" || arg == "--help") {
+            usage();
+            return 0;
+        } else if (arg.size() && arg[0] != '-') targets.push_back(arg);
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (image_path.empty() || targets.empty() || concurrency < 1 || chunk_size < 64) {
+        usage();
+        return 1;
+    }
+    if (!map_image(image_path.c_str())) {
+        fprintf(stderr, "Cannot map image %s: %s\n", image_path.c_str(), strerror(errno));
+        return 1;
+    }
+
+    std::vector<session_t> sessions;
+    sessions.reserve(targets.size()); // Sessions are referenced from epoll by address
+    for (const std::string& target : targets) add_host(sessions, target, port);
+    printf("%s %s (%u bytes, MD5 %s) to %zu devices, %d at a time\n", predict_only ? "Predicting" : "Uploading", image_path.c_str(), image_size,
+        image_md5.c_str(), sessions.size(), concurrency);
+    fflush(stdout);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    double wall_start = now();
+    size_t next = 0;
+    int active = 0;
+    struct epoll_event events[64];
+    while (next < sessions.size() || active > 0) {
+        while (active < concurrency && next < sessions.size()) {
+            session_t& s = sessions[next++];
+            start(s);
+            if (s.fd >= 0) active++;
+        }
+        int n = epoll_wait(epoll_fd, events, 64, 10);
+        for (int i = 0; i < n; i++) {
+            session_t& s = *(session_t*) events[i].data.ptr;
+            if (s.fd < 0) continue;
+            on_event(s, events[i].events);
+            if (s.fd < 0) active--;
+        }
+        double t = now();
+        for (size_t i = 0; i < next; i++) {
+            session_t& s = sessions[i];
+            if (s.fd < 0) continue;
+            on_timer(s, t);
+            if (s.fd < 0) active--;
+        }
+    }
+    double wall = now() - wall_start;
+
+    if (predict_only) {
+        // Sessions occupy a slot from connect to the final "OK", apply and reboot run on the device alone
+        std::vector<double> slots(concurrency, 0);
+        double end = 0;
+        size_t known = 0;
+        for (const session_t& s : sessions) {
+            nota_prediction_t p;
+            if (s.state != S_DONE || !predict(s, (s.replied - s.connected) * 1000, p)) continue;
+            double& slot = *std::min_element(slots.begin(), slots.end());
+            slot += (p.total_ms - p.apply_ms) / 1000;
+            end = std::max(end, slot + p.apply_ms / 1000);
+            known++;
+        }
+        printf("\nPredicted rollout of %zu devices, %d at a time: %.1f s until the last one runs the image\n", known, concurrency, end);
+        munmap((void*) image, image_size);
+        close(epoll_fd);
+        return known == sessions.size() ? 0 : 1;
+    }
+
+    size_t ok = 0, same = 0;
+    for (const session_t& s : sessions) if (s.state == S_DONE) s.same ? same++ : ok++;
+    double bytes = (double) ok * image_size;
+    if (same) printf("\n%zu devices already ran the image", same);
+    printf("\n%zu of %zu devices updated in %.2f s, %.1f kB delivered (%.1f kB/s aggregate)\n", ok, sessions.size(), wall, bytes / 1024.0, bytes / 1024.0 / (wall > 0 ? wall : 1e-3));
+    if (ok + same != sessions.size()) {
+        printf("Failed:");
+        for (const session_t& s : sessions) if (s.state != S_DONE) printf(" %s:%u", s.host.c_str(), s.port);
+        printf("\n");
+    }
+    munmap((void*) image, image_size);
+    close(epoll_fd);
+    if (regression) printf("Measured phases exceed the prediction by more than %.0f%%\n", tolerance);
+    return ok + same == sessions.size() && !regression ? 0 : 1;
+}
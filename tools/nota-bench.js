@@ -0,0 +1,247 @@
+// #############################################################################################################################################
+// 'nota-bench.js'
+// #############################################################################################################################################
+// This Node.JS script measures uploads with nota.js over impaired links, so protocol changes can be judged on numbers.
+//
+// use it like: node nota-bench [-f <sketch.bin>] [--latency 0,20,100] [--loss 0,0.01,0.05] [--bandwidth 0,100] [--repeat 3]
+//
+// nota-sim.js plays the device and nota-proxy.js sits in between, every combination of the comma separated lists of
+// [--latency <ms>] (one way), [--jitter <ms>], [--loss <p>], [--bandwidth <kB/s>] (0: unlimited) and [--reorder <p>]
+// is run [--repeat <n>] times (default 3). Without [-f] a random image of [--size <kB>] (default 256) is sent.
+// Each grid point reports the completion rate, the median session time, the median transfer throughput of the
+// completed runs, the median time to failure of the failed ones and the failure reasons the simulated device logged.
+// [-a password] sets a device password, [--write <kB/s>], [--erase <ms>] and [--sector-erase <ms>] are passed to
+// nota-sim.js, [--nota "<args>"] adds arguments to every nota.js run (e.g. --nota="--chunk 4096"), [--timeout <s>]
+// ends a run that hangs (default 120), [--seed <n>] repeats the same impairments, [--port <port>] is the first local
+// port used (default 18300) and [--json] prints the results as JSON.
+//
+// The exit code is 0 when every run completed.
+// #############################################################################################################################################
+// @ts-check
+(async () => {
+    "use strict"
+
+    /** @param { Error } e */
+    const throw_error = async e => {
+        console.error('    ' + e.message);
+        process.exit(1)
+    }
+    process.on('uncaughtException', throw_error)
+    process.on('unhandledRejection', throw_error)
+
+    const { spawn } = require('child_process')
+    const fs = require('fs')
+    const os = require('os')
+    const path = require('path')
+    const crypto = require('crypto')
+    /** @param { number } ms */
+    const delay = ms => new Promise(r => setTimeout(r, ms))
+    /** @param { any[] } args */
+    const print = (...args) => process.stdout.write(args.filter(x => x !== undefined).join(' '))
+    /** @param { any[] } args */
+    const println = (...args) => print(...args, '\r\n')
+
+    /** @param { string[] } args */
+    const argParser = (args) => {
+        /** @type { { [key: string]: any } } */
+        const argv = {}
+        for (let i = 0; i < args.length; i++) {
+            if (args[i]) {
+                if (args[i].startsWith('--')) { // parse: `--key value` or `--key` or `--key=value`
+                    const arg = args[i].substring(2)
+                    if (arg.includes('=')) {
+                        const parts = arg.split('=')
+                        const key = parts.shift() || ''
+                        argv[key.toLowerCase()] = parts.join('=')
+                    } else if (args[i + 1] && !args[i + 1].startsWith('-')) {
+                        const key = arg
+                        argv[key.toLowerCase()] = args[++i]
+                    } else {
+                        const key = arg
+                        argv[key.toLowerCase()] = true
+                    }
+                } else if (args[i] && args[i].startsWith('-') && (args[i + 1] || '').startsWith('-')) {
+                    const key = args[i].substring(1)
+                    argv[key.toLowerCase()] = true
+                } else if (args[i] && args[i].startsWith('-')) {
+                    const key = args[i].substring(1)
+                    argv[key.toLowerCase()] = args[++i]
+                }
+            }
+        }
+        return argv
+    }
+
+    const argv = argParser(process.argv.slice(2))
+    /** @param { string } key @param { string } fallback */
+    const list = (key, fallback) => {
+        const values = `${argv[key] === undefined ? fallback : argv[key]}`.split(',').map(Number)
+        if (values.some(x => !(x >= 0))) throw new Error(`Invalid ${key} list ${JSON.stringify(argv[key])}. Use comma separated numbers of at least 0.`)
+        return values
+    }
+    const latencies = list('latency', '0,20,100')
+    const jitters = list('jitter', '0')
+    const losses = list('loss', '0,0.01,0.05')
+    const bandwidths = list('bandwidth', '0')
+    const reorders = list('reorder', '0')
+    const repeat = +(argv.repeat || 3)
+    const size_kb = +(argv.size || 256)
+    const auth = `${argv.a || argv.auth || ''}`
+    const timeout = +(argv.timeout || 120) * 1000
+    const base_port = +(argv.port || 18300)
+    const seed = +(argv.seed || 1)
+    const nota_args = typeof argv.nota === 'string' ? argv.nota.split(' ').filter(Boolean) : []
+    const json = !!argv.json
+    if (argv.nota === true) throw new Error('Pass the nota.js arguments as [--nota="<args>"].')
+    if (!(repeat >= 1 && Number.isInteger(repeat))) throw new Error(`Invalid repeat count ${JSON.stringify(argv.repeat)}.`)
+    if (!(base_port > 0 && base_port < 65000)) throw new Error(`Invalid port ${JSON.stringify(argv.port)}.`)
+    if (losses.concat(reorders).some(p => p >= 1)) throw new Error('Loss and reorder are probabilities below 1.')
+
+    let image = `${argv.f || argv.file || ''}`
+    if (image && !fs.existsSync(image)) throw new Error(`File ${JSON.stringify(image)} does not exist.`)
+    if (!image) {
+        if (!(size_kb > 0)) throw new Error(`Invalid image size ${JSON.stringify(argv.size)}. Use [--size <kB>].`)
+        image = path.join(os.tmpdir(), `nota-bench-${process.pid}.bin`)
+        fs.writeFileSync(image, crypto.randomBytes(Math.round(size_kb * 1024)))
+        process.on('exit', () => { try { fs.unlinkSync(image) } catch (e) { } })
+    }
+    const image_size = fs.statSync(image).size
+
+    /** @type { import('child_process').ChildProcess[] } */
+    const children = []
+    process.on('exit', () => children.forEach(child => child.kill()))
+
+    /**
+     * Starts a tool and waits for its first line of output, which it prints once it listens
+     * @param { string } script @param { string[] } args
+     */
+    const start = (script, args) => new Promise((resolve, reject) => {
+        const child = spawn(process.execPath, [path.join(__dirname, script), ...args], { stdio: ['ignore', 'pipe', 'pipe'] })
+        children.push(child)
+        let output = ''
+        const lines = /** @type { string[] } */ ([])
+        const on_data = (/** @type { Buffer } */ data) => {
+            output += data.toString()
+            const parts = output.split('\n')
+            output = parts.pop() || ''
+            lines.push(...parts.map(x => x.trim()))
+            if (lines.length) resolve({ child, lines })
+        }
+        if (child.stdout) child.stdout.on('data', on_data)
+        if (child.stderr) child.stderr.on('data', data => reject(new Error(`${script}: ${data.toString().trim()}`)))
+        child.on('exit', code => reject(new Error(`${script} exited with code ${code}`)))
+    })
+
+    /** @param { import('child_process').ChildProcess } child */
+    const stop = async child => {
+        child.kill()
+        const i = children.indexOf(child)
+        if (i >= 0) children.splice(i, 1)
+        await delay(50)
+    }
+
+    /**
+     * One nota.js upload: exit code, run time, transfer time from its progress line
+     * @param { number } port
+     * @returns { Promise<{ ok: boolean, ms: number, transfer_ms: number, error: string }> }
+     */
+    const upload = port => new Promise(resolve => {
+        const args = [path.join(__dirname, 'nota.js'), '-i', '127.0.0.1', '-p', `${port}`, '-f', image, '--force', '--reflash', ...nota_args]
+        if (auth) args.push('-a', auth)
+        const started = Date.now()
+        const child = spawn(process.execPath, args, { stdio: ['ignore', 'pipe', 'pipe'] })
+        let output = ''
+        child.stdout.on('data', data => output += data.toString())
+        child.stderr.on('data', data => output += data.toString())
+        const timer = setTimeout(() => child.kill(), timeout)
+        child.on('exit', code => {
+            clearTimeout(timer)
+            const progress = output.match(/\] ([\d.]+) seconds/)
+            const last = output.trim().split('\n').pop() || ''
+            resolve({
+                ok: code === 0,
+                ms: Date.now() - started,
+                transfer_ms: progress ? +progress[1] * 1000 : 0,
+                error: code === 0 ? '' : code === null ? 'TIMEOUT (host)' : last.trim(),
+            })
+        })
+    })
+
+    /** @param { number[] } values */
+    const median = values => {
+        if (!values.length) return NaN
+        const sorted = values.slice().sort((a, b) => a - b)
+        const mid = sorted.length >> 1
+        return sorted.length % 2 ? sorted[mid] : (sorted[mid - 1] + sorted[mid]) / 2
+    }
+
+    const grid = []
+    for (const latency of latencies) for (const jitter of jitters) for (const loss of losses) for (const bandwidth of bandwidths) for (const reorder of reorders) {
+        grid.push({ latency, jitter, loss, bandwidth, reorder })
+    }
+
+    const sim_port = base_port
+    const sim_args = ['--port', `${sim_port}`]
+    if (auth) sim_args.push('-a', auth)
+    for (const key of ['write', 'erase', 'sector-erase']) if (argv[key] !== undefined) sim_args.push(`--${key}`, `${argv[key]}`)
+    const sim = /** @type { { child: import('child_process').ChildProcess, lines: string[] } } */ (await start('nota-sim.js', sim_args))
+    if (!json) {
+        println(`${image_size} byte image, ${grid.length} grid point(s) x ${repeat} run(s)`)
+        println(sim.lines[0])
+        println(`${'latency'.padStart(8)} ${'jitter'.padStart(7)} ${'loss'.padStart(6)} ${'kB/s'.padStart(6)} ${'reorder'.padStart(7)} | ${'done'.padStart(5)} ${'session'.padStart(8)} ${'kB/s'.padStart(7)} ${'failure'.padStart(8)}  reasons`)
+    }
+
+    const results = []
+    let run = 0
+    for (let i = 0; i < grid.length; i++) {
+        const point = grid[i]
+        const port = base_port + 1 + i
+        const proxy = /** @type { { child: import('child_process').ChildProcess, lines: string[] } } */ (await start('nota-proxy.js', [
+            '--target', `127.0.0.1:${sim_port}`, '--listen', `${port}`,
+            '--latency', `${point.latency}`, '--jitter', `${point.jitter}`, '--loss', `${point.loss}`,
+            '--bandwidth', `${point.bandwidth}`, '--reorder', `${point.reorder}`, '--seed', `${seed + i}`,
+        ]))
+        const runs = []
+        for (let r = 0; r < repeat; r++) {
+            const logged = sim.lines.length
+            const result = await upload(port)
+            // The device logs its session once it is done with it (after the close delay or a timeout)
+            for (let wait = 0; sim.lines.length === logged && wait < 3000; wait += 50) await delay(50)
+            const session = sim.lines.slice(logged).find(x => x.startsWith('session ')) || ''
+            const reason = session.split(' ')[2] || ''
+            runs.push({ ...result, device: reason })
+            run++
+            if (!json) print(`\r${run}/${grid.length * repeat}`)
+            await delay(200)
+        }
+        await stop(proxy.child)
+
+        const done = runs.filter(x => x.ok)
+        const failed = runs.filter(x => !x.ok)
+        /** @type { { [reason: string]: number } } */
+        const reasons = {}
+        for (const x of failed) {
+            const reason = x.device && x.device !== 'OK' ? x.device : x.error || 'unknown'
+            reasons[reason] = (reasons[reason] || 0) + 1
+        }
+        const result = {
+            ...point,
+            runs: runs.length,
+            completed: done.length,
+            completion: done.length / runs.length,
+            session_ms: median(done.map(x => x.ms)),
+            throughput_kbps: median(done.filter(x => x.transfer_ms > 0).map(x => image_size / 1024 / (x.transfer_ms / 1000))),
+            failure_ms: median(failed.map(x => x.ms)),
+            reasons,
+        }
+        results.push(result)
+        if (!json) {
+            const f = (/** @type { number } */ x, /** @type { number } */ digits, /** @type { number } */ width) => (Number.isNaN(x) ? '-' : x.toFixed(digits)).padStart(width)
+            print('\r')
+            println(`${f(point.latency, 0, 8)} ${f(point.jitter, 0, 7)} ${f(point.loss, 3, 6)} ${point.bandwidth ? f(point.bandwidth, 0, 6) : '-'.padStart(6)} ${f(point.reorder, 3, 7)} | ${`${done.length}/${runs.length}`.padStart(5)} ${f(result.session_ms / 1000, 2, 8)} ${f(result.throughput_kbps, 1, 7)} ${f(result.failure_ms / 1000, 2, 8)}  ${Object.entries(reasons).map(([k, v]) => `${k} x${v}`).join(', ')}`)
+        }
+    }
+    await stop(sim.child)
+    if (json) println(JSON.stringify({ image_size, repeat, results }, null, 2))
+    process.exit(results.every(x => x.completed === x.runs) ? 0 : 1)
+})()
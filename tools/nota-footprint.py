@@ -0,0 +1,218 @@
+####### nota-footprint.py #######
+# Static RAM and worst-case stack report of a sketch build that includes NOTA.h.
+# Build the sketch once per configuration (defines, board) with stack usage and call graph output, for example:
+#
+#   arduino-cli compile -b <fqbn> --build-path build \
+#       --build-property "compiler.cpp.extra_flags=-fstack-usage -fcallgraph-info=su -DNOTA_FOOTPRINT_SMALL"
+#
+# and run:
+#
+#   python3 nota-footprint.py build [--nm arm-none-eabi-nm] [--elf build/sketch.ino.elf] [--json]
+#
+# RAM:   the statically allocated NOTA objects (the OTA object with its scratch arena, InternalStorage,
+#        the discovery and transfer sockets), read from the symbol table of the ELF file.
+# Stack: the deepest call chain below each NOTA entry point (handle(), begin(), task_main(), getImageHash()),
+#        summed from the frame sizes of the call graph files (*.ci). Callees outside the build (ROM, precompiled
+#        SDK libraries) and calls through function pointers count as 0 bytes and are listed, so the result is a
+#        lower bound for those. Without *.ci files only the largest NOTA frames from the *.su files are listed.
+
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+
+# Members of NOTABasic<...>, whatever policies the sketch uses
+ENTRY_POINTS = [
+    "handle()",
+    "begin()",
+    "task_main(void*)",
+    "getImageHash()",
+]
+NOTA_MEMBER = re.compile(r"\bNOTABasic<.*>::")
+RAM_SYMBOLS = re.compile(r"^(OTA|InternalStorage|udp_mc|udp_b|udp_data|program_\w+|ota_sector\w*)$|nota", re.IGNORECASE)
+NOTA_FUNCTION = re.compile(r"NOTABasic<|OTAStorage::|\bMD5\b|nota_|\bmc_|relay_")
+
+
+def find_files(root, extension):
+    for folder, _, files in os.walk(root):
+        for name in files:
+            if name.endswith(extension):
+                yield os.path.join(folder, name)
+
+
+def find_elf(root):
+    elfs = sorted(find_files(root, ".elf"), key=os.path.getmtime)
+    return elfs[-1] if elfs else ""
+
+
+# Statically allocated NOTA symbols: (name, size)
+def ram_report(elf, nm):
+    output = subprocess.run([nm, "-S", "-C", "--size-sort", elf], capture_output=True, text=True, check=True).stdout
+    symbols = []
+    for line in output.splitlines():
+        parts = line.split(None, 3)
+        if len(parts) != 4 or parts[2] not in "bBdD":
+            continue
+        name = parts[3]
+        if RAM_SYMBOLS.search(name):
+            symbols.append((name, int(parts[1], 16)))
+    return sorted(symbols, key=lambda x: -x[1])
+
+
+# GCC labels some nodes (clones, variadic functions) with a broken name, use the demangled symbol for those
+def symbol_names(titles):
+    symbols = [re.sub(r"\.(part|isra|constprop|cold)\.\d+", "", t.split(":")[-1]) for t in titles]
+    try:
+        output = subprocess.run(["c++filt"], input="\n".join(symbols), capture_output=True, text=True, check=True).stdout
+        return output.splitlines()
+    except (OSError, subprocess.CalledProcessError):
+        return symbols
+
+
+# Call graph of all *.ci files (GCC VCG output): { title: (name, frame bytes or None, bounded) }, { title: [callee titles] }
+def load_call_graph(root):
+    nodes, edges = {}, {}
+    node_re = re.compile(r'^node: \{ title: "([^"]+)" label: "((?:[^"\\]|\\.)*)"')
+    edge_re = re.compile(r'^edge: \{ sourcename: "([^"]+)" targetname: "([^"]+)"')
+    for path in find_files(root, ".ci"):
+        with open(path, encoding="utf-8", errors="replace") as f:
+            for line in f:
+                match = node_re.match(line)
+                if match:
+                    title, label = match.groups()
+                    lines = label.split("\\n")
+                    frame = re.match(r"(\d+) bytes \((\w[\w,]*)\)", lines[-1]) if len(lines) > 1 else None
+                    size = int(frame.group(1)) if frame else None
+                    bounded = frame is None or frame.group(2) in ("static", "dynamic,bounded")
+                    # A declaration seen in another file does not replace a definition with a frame size
+                    if title not in nodes or nodes[title][1] is None:
+                        nodes[title] = (lines[0], size, bounded)
+                    continue
+                match = edge_re.match(line)
+                if match:
+                    edges.setdefault(match.group(1), []).append(match.group(2))
+    broken = [t for t, node in nodes.items() if not re.match(r"^[A-Za-z_~].*\(", node[0])]
+    for title, name in zip(broken, symbol_names(broken)):
+        nodes[title] = (name,) + nodes[title][1:]
+    return nodes, edges
+
+
+# Deepest stack below a node: (bytes, [titles along the path], unknown callees, unbounded frames, recursion)
+def deepest(title, nodes, edges, memo, active):
+    if title in memo:
+        return memo[title]
+    if title in active:
+        return (0, [], set(), set(), True)
+    active.add(title)
+    name, size, bounded = nodes.get(title, (title, None, True))
+    best = (0, [], set(), set(), False)
+    unknown, unbounded, recursive = set(), set(), False
+    for callee in edges.get(title, []):
+        result = deepest(callee, nodes, edges, memo, active)
+        unknown |= result[2]
+        unbounded |= result[3]
+        recursive = recursive or result[4]
+        if result[0] > best[0] or not best[1]:
+            best = result
+    active.discard(title)
+    if size is None:
+        unknown.add(name)
+    if not bounded:
+        unbounded.add(name)
+    result = ((size or 0) + best[0], [title] + best[1], unknown, unbounded, recursive)
+    memo[title] = result
+    return result
+
+
+def stack_report(root):
+    nodes, edges = load_call_graph(root)
+    if not nodes:
+        return None
+    memo, report = {}, []
+    for entry in ENTRY_POINTS:
+        titles = [t for t, node in nodes.items() if node[0].endswith("::" + entry) and NOTA_MEMBER.search(node[0]) and node[1] is not None]
+        if not titles:
+            continue
+        total, path, unknown, unbounded, recursive = max((deepest(t, nodes, edges, memo, set()) for t in titles), key=lambda r: r[0])
+        report.append({
+            "entry": entry,
+            "bytes": total,
+            "path": [{"function": nodes[t][0], "bytes": nodes[t][1] or 0} for t in path if t in nodes],
+            "unknown": sorted(unknown),
+            "unbounded": sorted(unbounded),
+            "recursive": recursive,
+        })
+    return report
+
+
+# Largest NOTA frames of the *.su files: [(function, bytes, kind)]
+def frame_report(root, count=15):
+    frames = {}
+    for path in find_files(root, ".su"):
+        with open(path, encoding="utf-8", errors="replace") as f:
+            for line in f:
+                parts = line.rstrip("\n").split("\t")
+                if len(parts) != 3:
+                    continue
+                function = parts[0].split(":", 3)[-1]
+                if NOTA_FUNCTION.search(function):
+                    frames[function] = max(frames.get(function, (0, ""))[0], int(parts[1])), parts[2]
+    return sorted(((f, size, kind) for f, (size, kind) in frames.items()), key=lambda x: -x[1])[:count]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Static RAM and worst-case stack report of a NOTA build")
+    parser.add_argument("build", help="build folder with the *.su / *.ci files and the ELF file")
+    parser.add_argument("--elf", default="", help="ELF file, the newest *.elf of the build folder by default")
+    parser.add_argument("--nm", default="nm", help="nm of the target toolchain, e.g. arm-none-eabi-nm or xtensa-esp32-elf-nm")
+    parser.add_argument("--json", action="store_true", help="print the report as JSON")
+    args = parser.parse_args()
+
+    elf = args.elf or find_elf(args.build)
+    ram = ram_report(elf, args.nm) if elf else []
+    stack = stack_report(args.build)
+    frames = frame_report(args.build)
+
+    if args.json:
+        print(json.dumps({
+            "elf": elf,
+            "ram": [{"symbol": name, "bytes": size} for name, size in ram],
+            "ram_total": sum(size for _, size in ram),
+            "stack": stack,
+            "frames": [{"function": f, "bytes": size, "kind": kind} for f, size, kind in frames],
+        }, indent=2))
+        return 0
+
+    if elf:
+        print(f"Static RAM ({elf}):")
+        for name, size in ram:
+            print(f"  {size:8d}  {name}")
+        print(f"  {sum(size for _, size in ram):8d}  total")
+    else:
+        print("Static RAM: no ELF file found, use --elf")
+    if stack is None:
+        print("Worst-case stack: no call graph (*.ci) files found, build with -fcallgraph-info=su")
+    else:
+        for entry in stack:
+            print(f"Worst-case stack below {entry['entry']}: {entry['bytes']} bytes")
+            for frame in entry["path"]:
+                print(f"  {frame['bytes']:8d}  {frame['function']}")
+            if entry["unbounded"]:
+                print(f"  dynamic frames: {', '.join(entry['unbounded'])}")
+            if entry["recursive"]:
+                print("  recursion in the call graph, counted once")
+            if entry["unknown"]:
+                print(f"  {len(entry['unknown'])} callee(s) without frame size counted as 0 bytes")
+    if frames:
+        print("Largest NOTA frames:")
+        for function, size, kind in frames:
+            print(f"  {size:8d}  {function} ({kind})")
+    elif not stack:
+        print("No stack usage (*.su) files found, build with -fstack-usage")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,213 @@
+// #############################################################################################################################################
+// 'nota-mcast.js'
+// #############################################################################################################################################
+// This Node.JS script sends one binary image to every listening device at once over UDP multicast.
+// The devices must be built with NOTA_MULTICAST.
+//
+// use it like: node nota-mcast -f <sketch.bin> [-a password] [-b <board>] [--expect <count>]
+// The image is announced to the group, every matching device erases its update slot and answers READY.
+// The data is sent once to the group at [--rate <kB/s>] (default 200), then the devices are polled for the chunks they missed
+// and only those are sent again, until every device reports DONE. Devices that already run the image report SAME.
+// Use [-b <board>] to address only one board type, [--expect <count>] to wait for that many devices to be ready,
+// [--chunk <bytes>] to change the datagram payload (multiple of 4, at most 1024), [--iface <local IP>] to pick the network interface,
+// [--group <address>] to use another multicast group and [--timeout <s>] to give up (default 120).
+//
+// The exit code is 0 only when every device that answered READY reports OK or SAME.
+// #############################################################################################################################################
+// @ts-check
+(async () => {
+    "use strict"
+
+    /** @param { Error } e */
+    const throw_error = async e => {
+        console.error('    ' + e.message);
+        process.exit(1)
+    }
+    process.on('uncaughtException', throw_error)
+    process.on('unhandledRejection', throw_error)
+
+    const dgram = require('dgram')
+    const fs = require('fs')
+    const crypto = require('crypto')
+    /** @param { string | Buffer } data */
+    const md5 = data => crypto.createHash('md5').update(typeof data === 'string' ? Buffer.from(data) : data).digest("hex")
+    /** @param { number } ms */
+    const delay = ms => new Promise(r => setTimeout(r, ms))
+    /** @param { any[] } args */
+    const print = (...args) => process.stdout.write(args.filter(x => x !== undefined).join(' '))
+    /** @param { any[] } args */
+    const println = (...args) => print(...args, '\r\n')
+
+    /** @param { string[] } args */
+    const argParser = (args) => {
+        /** @type { { [key: string]: any } } */
+        const argv = {}
+        for (let i = 0; i < args.length; i++) {
+            if (args[i]) {
+                if (args[i].startsWith('--')) { // parse: `--key value` or `--key` or `--key=value`
+                    const arg = args[i].substring(2)
+                    if (arg.includes('=')) {
+                        const parts = arg.split('=')
+                        const key = parts.shift() || ''
+                        argv[key.toLowerCase()] = parts.join('=')
+                    } else if (args[i + 1] && !args[i + 1].startsWith('-')) {
+                        const key = arg
+                        argv[key.toLowerCase()] = args[++i]
+                    } else {
+                        const key = arg
+                        argv[key.toLowerCase()] = true
+                    }
+                } else if (args[i] && args[i].startsWith('-') && (args[i + 1] || '').startsWith('-')) {
+                    const key = args[i].substring(1)
+                    argv[key.toLowerCase()] = true
+                } else if (args[i] && args[i].startsWith('-')) {
+                    const key = args[i].substring(1)
+                    argv[key.toLowerCase()] = args[++i]
+                }
+            }
+        }
+        return argv
+    }
+
+    // Protocol, see src/nota_protocol.h
+    const MC_GROUP = '239.255.0.1'
+    const MC_MAGIC = 'NOTA_MC'
+    const MC_DATA_MAGIC = Buffer.from('NMD\x01', 'latin1')
+    const MC_DATA_PORT = 41236
+    const MC_REPORT_PORT = 41237
+    const MC_HEADER_SIZE = 14
+    const MC_CHUNK_MAX = 1024
+
+    const ANNOUNCE_ROUNDS = 3
+    const READY_WAIT = 5000 // ms to collect READY answers when no count is expected
+    const POLL_INTERVAL = 500 // ms between repair rounds
+
+    const argv = argParser(process.argv.slice(2))
+    const image = argv.f || argv.file || ''
+    const auth = argv.a || argv.auth || ''
+    const board = argv.b || argv.board || ''
+    const expect = +(argv.expect || 0)
+    const rate = +(argv.rate || 200)
+    const chunk = +(argv.chunk || MC_CHUNK_MAX)
+    const iface = argv.iface || ''
+    const group = argv.group || MC_GROUP
+    const timeout = +(argv.timeout || 120) * 1000
+    const debug = !!(argv.d || argv.debug || false)
+
+    if (!image || image === true || !fs.existsSync(image)) throw new Error('Missing parameter [-f] / [--file] for the binary image file.')
+    if (!(chunk >= 64 && chunk <= MC_CHUNK_MAX && chunk % 4 === 0)) throw new Error(`Invalid chunk size ${JSON.stringify(argv.chunk)}. Use a multiple of 4 between 64 and ${MC_CHUNK_MAX}.`)
+    if (!(rate > 0)) throw new Error(`Invalid rate ${JSON.stringify(argv.rate)}.`)
+
+    const data = fs.readFileSync(image)
+    const size = data.length
+    const hash = md5(data)
+    const chunks = Math.ceil(size / chunk)
+    const session = crypto.randomBytes(4).readUInt32LE(0) || 1
+    const token = auth ? md5(`${md5(auth)}:${session}:${hash}`) : '-'
+
+    const socket = dgram.createSocket({ type: 'udp4', reuseAddr: true })
+    await new Promise((resolve, reject) => {
+        socket.once('error', reject)
+        socket.bind(MC_REPORT_PORT, () => resolve(1))
+    })
+    socket.setMulticastTTL(1)
+    socket.setMulticastLoopback(true)
+    if (iface) socket.setMulticastInterface(iface)
+
+    /** @type { Map<string, { address: string, state: string, missing: Set<number>, polled: boolean }> } */
+    const devices = new Map()
+    socket.on('message', (msg, rinfo) => {
+        const parts = msg.toString().trim().split(' ')
+        if (parts[0] !== MC_MAGIC || +parts[2] !== session) return
+        if (debug) println(`< FROM ${rinfo.address}: ${JSON.stringify(msg.toString())}`)
+        const [, kind, , name] = parts
+        const key = `${name}@${rinfo.address}`
+        let device = devices.get(key)
+        if (!device) {
+            device = { address: rinfo.address, state: 'READY', missing: new Set(), polled: false }
+            devices.set(key, device)
+        }
+        if (kind === 'NACK' && device.state === 'READY') {
+            device.missing.clear()
+            for (const range of (parts[5] || '').split(',').filter(x => x)) {
+                const [first, last] = range.split('-').map(x => +x)
+                for (let i = first; i <= last && i < chunks; i++) device.missing.add(i)
+            }
+            device.polled = true
+        } else if (kind === 'DONE') {
+            device.state = parts[4] || 'ERR'
+        }
+    })
+
+    /** @param { string | Buffer } message */
+    const send = message => new Promise((resolve, reject) => {
+        socket.send(message, MC_DATA_PORT, group, e => e ? reject(e) : resolve(1))
+        if (debug && typeof message === 'string') println(`> TO ${group}: ${JSON.stringify(message)}`)
+    })
+
+    let bytes_sent = 0
+    /** @param { number[] } indexes */
+    const send_chunks = async indexes => {
+        const start = Date.now()
+        let sent = 0
+        for (const index of indexes) {
+            const payload = data.subarray(index * chunk, Math.min(size, (index + 1) * chunk))
+            const packet = Buffer.alloc(MC_HEADER_SIZE + payload.length)
+            MC_DATA_MAGIC.copy(packet, 0)
+            packet.writeUInt32LE(session, 4)
+            packet.writeUInt32LE(index, 8)
+            packet.writeUInt16LE(payload.length, 12)
+            payload.copy(packet, MC_HEADER_SIZE)
+            await send(packet)
+            sent += payload.length
+            bytes_sent += payload.length
+            // Pace to the rate the slowest device can write
+            const ahead = sent / rate - (Date.now() - start)
+            if (ahead > 1) await delay(ahead)
+        }
+    }
+
+    const pending = () => [...devices.values()].filter(d => d.state === 'READY')
+
+    const started = Date.now()
+    println(`Multicast ${image} (${size} bytes, ${chunks} chunks of ${chunk}) to ${group}, session ${session}`)
+    for (let i = 0; i < ANNOUNCE_ROUNDS; i++) {
+        await send(`${MC_MAGIC} ANN ${session} ${size} ${hash} ${chunk} ${board || '-'} ${token}`)
+        await delay(200)
+    }
+    const ready_deadline = Date.now() + (expect ? timeout : READY_WAIT)
+    while (Date.now() < ready_deadline && !(expect && devices.size >= expect)) await delay(100)
+    const ready = pending().length
+    println(`${devices.size} device(s) answered, ${ready} ready to receive`)
+
+    let rounds = 0
+    if (ready) {
+        await send_chunks([...Array(chunks).keys()])
+        while (pending().length && Date.now() - started < timeout) {
+            for (const device of pending()) device.polled = false
+            await send(`${MC_MAGIC} POLL ${session}`)
+            await delay(POLL_INTERVAL)
+            /** @type { Set<number> } */
+            const missing = new Set()
+            for (const device of pending()) if (device.polled) for (const index of device.missing) missing.add(index)
+            if (missing.size) {
+                rounds++
+                if (debug) println(`Repair round ${rounds}: ${missing.size} chunk(s)`)
+                await send_chunks([...missing].sort((a, b) => a - b))
+            }
+        }
+        if (pending().length) await send(`${MC_MAGIC} ABORT ${session}`)
+    }
+
+    const elapsed = (Date.now() - started) / 1000
+    let failed = expect > devices.size
+    for (const [key, device] of devices) {
+        const state = device.state === 'READY' ? 'TIMEOUT' : device.state
+        if (state !== 'OK' && state !== 'SAME') failed = true
+        println(`    ${key}: ${state}`)
+    }
+    if (expect > devices.size) println(`    ${expect - devices.size} expected device(s) did not answer`)
+    println(`Sent ${bytes_sent} bytes for a ${size} byte image (${(bytes_sent / size).toFixed(2)}x) in ${elapsed.toFixed(1)} s, ${rounds} repair round(s)`)
+    socket.close()
+    process.exit(failed || !devices.size ? 1 : 0)
+})()
@@ -0,0 +1,176 @@
+// #############################################################################################################################################
+// 'nota-proxy.js'
+// #############################################################################################################################################
+// This Node.JS script forwards TCP connections to a device (or to nota-sim.js) through an impaired link, to see how the upload
+// behaves on slow and lossy networks without one.
+//
+// use it like: node nota-proxy --target <host:port> [--listen <port>] [--latency <ms>] [--jitter <ms>] [--loss <p>] [--bandwidth <kB/s>] [--reorder <p>]
+// and point nota.js at the listen port (default 18266) instead of the device.
+//
+// Both directions are impaired the same way. The data is cut into segments of [--mss <bytes>] (default 1460), each one is
+// delayed by [--latency <ms>] (one way) plus a random [--jitter <ms>] and serialized at [--bandwidth <kB/s>] (0: unlimited).
+// A proxy sits on top of TCP and cannot drop packets, so loss is modelled the way a TCP receiver sees it: a lost segment
+// arrives one retransmission timeout [--rto <ms>] (default 200, the Linux minimum) later, doubled for every further loss
+// of the same segment. A reordered segment [--reorder <p>] arrives half a latency plus the jitter later.
+// Data is delivered in order, so everything behind a late segment waits for it (head of line blocking).
+// Use [--seed <n>] for a repeatable run and [--debug] to log every connection.
+// For packet level loss on a real interface use netem instead: tc qdisc add dev <if> root netem delay 50ms loss 1%
+// #############################################################################################################################################
+// @ts-check
+(async () => {
+    "use strict"
+
+    /** @param { Error } e */
+    const throw_error = async e => {
+        console.error('    ' + e.message);
+        process.exit(1)
+    }
+    process.on('uncaughtException', throw_error)
+    process.on('unhandledRejection', throw_error)
+
+    const net = require('net')
+    /** @param { any[] } args */
+    const print = (...args) => process.stdout.write(args.filter(x => x !== undefined).join(' '))
+    /** @param { any[] } args */
+    const println = (...args) => print(...args, '\r\n')
+
+    /** @param { string[] } args */
+    const argParser = (args) => {
+        /** @type { { [key: string]: any } } */
+        const argv = {}
+        for (let i = 0; i < args.length; i++) {
+            if (args[i]) {
+                if (args[i].startsWith('--')) { // parse: `--key value` or `--key` or `--key=value`
+                    const arg = args[i].substring(2)
+                    if (arg.includes('=')) {
+                        const parts = arg.split('=')
+                        const key = parts.shift() || ''
+                        argv[key.toLowerCase()] = parts.join('=')
+                    } else if (args[i + 1] && !args[i + 1].startsWith('-')) {
+                        const key = arg
+                        argv[key.toLowerCase()] = args[++i]
+                    } else {
+                        const key = arg
+                        argv[key.toLowerCase()] = true
+                    }
+                } else if (args[i] && args[i].startsWith('-') && (args[i + 1] || '').startsWith('-')) {
+                    const key = args[i].substring(1)
+                    argv[key.toLowerCase()] = true
+                } else if (args[i] && args[i].startsWith('-')) {
+                    const key = args[i].substring(1)
+                    argv[key.toLowerCase()] = args[++i]
+                }
+            }
+        }
+        return argv
+    }
+
+    const argv = argParser(process.argv.slice(2))
+    const listen_port = +(argv.listen || argv.l || 18266)
+    const target = `${argv.target || argv.t || ''}`
+    const latency = +(argv.latency || 0)
+    const jitter = +(argv.jitter || 0)
+    const loss = +(argv.loss || 0)
+    const rto = +(argv.rto || 200)
+    const bandwidth = +(argv.bandwidth || 0) * 1024 / 1000 // Bytes per ms, 0: unlimited
+    const reorder = +(argv.reorder || 0)
+    const mss = +(argv.mss || 1460)
+    const seed = +(argv.seed || Date.now())
+    const debug = !!(argv.d || argv.debug || false)
+
+    const [target_host, target_port] = target.includes(':') ? [target.substring(0, target.lastIndexOf(':')), +target.substring(target.lastIndexOf(':') + 1)] : ['', 0]
+    if (!target_host || !(target_port > 0)) throw new Error(`Invalid target ${JSON.stringify(argv.target || '')}. Use [--target <host:port>].`)
+    if (!(listen_port > 0 && listen_port < 65536)) throw new Error(`Invalid listen port ${JSON.stringify(argv.listen)}.`)
+    for (const [name, p] of [['loss', loss], ['reorder', reorder]]) {
+        if (!(p >= 0 && p < 1)) throw new Error(`Invalid ${name} ${JSON.stringify(argv[name])}. Use a probability from 0 to below 1.`)
+    }
+    for (const [name, ms] of [['latency', latency], ['jitter', jitter], ['rto', rto], ['bandwidth', bandwidth]]) {
+        if (!(ms >= 0)) throw new Error(`Invalid ${name} ${JSON.stringify(argv[name])}. Use a number of at least 0.`)
+    }
+    if (!(mss >= 64)) throw new Error(`Invalid segment size ${JSON.stringify(argv.mss)}. Use [--mss <bytes>] with at least 64 bytes.`)
+
+    // mulberry32, so a seed gives the same impairments on every run
+    let random_state = seed >>> 0
+    const random = () => {
+        random_state = (random_state + 0x6D2B79F5) >>> 0
+        let t = random_state
+        t = Math.imul(t ^ (t >>> 15), t | 1)
+        t ^= t + Math.imul(t ^ (t >>> 7), t | 61)
+        return ((t ^ (t >>> 14)) >>> 0) / 4294967296
+    }
+
+    const stats = { connections: 0, segments: 0, lost: 0, reordered: 0, bytes: 0 }
+
+    /**
+     * One direction of the link: segments leave one after the other at the link bandwidth and are delivered in order
+     * @param { net.Socket } to
+     */
+    const create_link = to => {
+        let link_free = 0       // The link is busy sending until then
+        let last_delivery = 0   // Delivery is in order
+        let pending = 0
+        let ended = false
+        const finish = () => { if (ended && !pending) to.end() }
+        return {
+            /** @param { Buffer } data */
+            send: data => {
+                for (let offset = 0; offset < data.length; offset += mss) {
+                    const segment = data.subarray(offset, offset + mss)
+                    const now = Date.now()
+                    link_free = Math.max(now, link_free) + (bandwidth ? segment.length / bandwidth : 0)
+                    let arrival = link_free + latency + jitter * random()
+                    for (let backoff = rto; random() < loss; backoff *= 2) {
+                        arrival += backoff
+                        stats.lost++
+                    }
+                    if (reorder && random() < reorder) {
+                        arrival += latency / 2 + jitter
+                        stats.reordered++
+                    }
+                    last_delivery = Math.max(last_delivery, arrival)
+                    stats.segments++
+                    stats.bytes += segment.length
+                    pending++
+                    setTimeout(() => {
+                        pending--
+                        if (!to.destroyed) to.write(segment)
+                        finish()
+                    }, Math.max(0, last_delivery - now))
+                }
+            },
+            end: () => {
+                ended = true
+                finish()
+            },
+        }
+    }
+
+    const server = net.createServer(client => {
+        const id = ++stats.connections
+        const device = net.connect(target_port, target_host)
+        const upstream = create_link(device)
+        const downstream = create_link(client)
+        if (debug) println(`[${id}] ${client.remoteAddress}:${client.remotePort} -> ${target}`)
+        client.on('data', data => upstream.send(data))
+        device.on('data', data => downstream.send(data))
+        client.on('end', () => upstream.end())
+        device.on('end', () => downstream.end())
+        const close = () => {
+            client.destroy()
+            device.destroy()
+        }
+        client.on('error', close)
+        device.on('error', close)
+        client.on('close', () => { if (debug) println(`[${id}] closed`) })
+    })
+    server.on('error', throw_error)
+    server.listen(listen_port, () => {
+        println(`Proxy listening on port ${listen_port} -> ${target}: latency ${latency} ms, jitter ${jitter} ms, loss ${loss}, rto ${rto} ms, bandwidth ${bandwidth ? `${+argv.bandwidth} kB/s` : 'unlimited'}, reorder ${reorder}, seed ${seed}`)
+    })
+    const shutdown = () => {
+        println(`Proxy: ${stats.connections} connection(s), ${stats.segments} segments, ${stats.bytes} bytes, ${stats.lost} lost, ${stats.reordered} reordered`)
+        process.exit(0)
+    }
+    process.on('SIGINT', shutdown)
+    process.on('SIGTERM', shutdown)
+})()
@@ -0,0 +1,447 @@
+// #############################################################################################################################################
+// 'nota-sim.js'
+// #############################################################################################################################################
+// This Node.JS script plays a NOTA device on the host, so nota.js and the tools built on it can be tried without hardware.
+//
+// use it like: node nota-sim [--port <port>] [-a password] [--write <kB/s>] [--erase <ms>] [--sector-erase <ms>]
+//
+// The device side of the protocol runs the way listener() and ota_handle_update() of NOTA.h do, one blocking step after
+// the other, with the same delays and timeouts:
+//   - the request is read 10 ms after the first byte arrived, the reply is followed by 100 ms of delay(), then the
+//     AUTH answer is read right away, whatever has arrived by then
+//   - the update slot is erased ([--erase <ms>], STM32 erases the whole slot), bytes received meanwhile are dropped,
+//     then "OK" and another 500 ms
+//   - every read is written at [--write <kB/s>] (default 250) plus [--sector-erase <ms>] (default 45) for every 4 KB
+//     sector the data reaches (ESP) and acked with the byte count. 1000 ms without data fail the transfer
+//   - the MD5 is checked, the final "OK" follows 2000 ms later and the connection is closed 1000 ms after it
+// A failed session ends with an error message on the connection, which is then closed. The simulated device keeps
+// running its own image ([--hash <md5>]), so the same file can be sent again and again. QUERY is answered with a STAT
+// record, delta, sparse, multi-part and image header sessions are not simulated.
+// A signed request (ts= and mac=) is authenticated without the AUTH challenge, with the device's replay window. Like a
+// device without a stored replay floor, the first one after start gets the challenge and sets the floor once it passes.
+// A pull session (url=, NOTA_PULL) fetches the image with HTTP range requests of 4 KB from the uploader, programs each
+// one at the write rate before asking for the next one and reports "<bytes written>\n". A failed range is asked for
+// again after a backoff, up to 5 times. Unlike the device, a range that broke off is fetched again as a whole.
+// One line per session is printed: "session <n> <OK|reason> <received>/<size> bytes <ms> ms", nota-bench.js reads it.
+// Use [-n <name>], [-b <board>] and [--platform <platform>] to change what the device reports.
+// #############################################################################################################################################
+// @ts-check
+(async () => {
+    "use strict"
+
+    /** @param { Error } e */
+    const throw_error = async e => {
+        console.error('    ' + e.message);
+        process.exit(1)
+    }
+    process.on('uncaughtException', throw_error)
+    process.on('unhandledRejection', throw_error)
+
+    const net = require('net')
+    const http = require('http')
+    const crypto = require('crypto')
+    /** @param { string | Buffer } data */
+    const md5 = data => crypto.createHash('md5').update(typeof data === 'string' ? Buffer.from(data) : data).digest("hex")
+    /** @param { number } ms */
+    const delay = ms => new Promise(r => setTimeout(r, ms))
+    /** @param { any[] } args */
+    const print = (...args) => process.stdout.write(args.filter(x => x !== undefined).join(' '))
+    /** @param { any[] } args */
+    const println = (...args) => print(...args, '\r\n')
+
+    /** @param { string[] } args */
+    const argParser = (args) => {
+        /** @type { { [key: string]: any } } */
+        const argv = {}
+        for (let i = 0; i < args.length; i++) {
+            if (args[i]) {
+                if (args[i].startsWith('--')) { // parse: `--key value` or `--key` or `--key=value`
+                    const arg = args[i].substring(2)
+                    if (arg.includes('=')) {
+                        const parts = arg.split('=')
+                        const key = parts.shift() || ''
+                        argv[key.toLowerCase()] = parts.join('=')
+                    } else if (args[i + 1] && !args[i + 1].startsWith('-')) {
+                        const key = arg
+                        argv[key.toLowerCase()] = args[++i]
+                    } else {
+                        const key = arg
+                        argv[key.toLowerCase()] = true
+                    }
+                } else if (args[i] && args[i].startsWith('-') && (args[i + 1] || '').startsWith('-')) {
+                    const key = args[i].substring(1)
+                    argv[key.toLowerCase()] = true
+                } else if (args[i] && args[i].startsWith('-')) {
+                    const key = args[i].substring(1)
+                    argv[key.toLowerCase()] = args[++i]
+                }
+            }
+        }
+        return argv
+    }
+
+    // Protocol, see src/nota_protocol.h
+    const NOTA_VERSION = '0.0.3'
+    const FLASH = 0
+    const SPIFFS = 100
+    const AUTH = 200
+    const TEST = 201
+    const QUERY = 202
+    const SECTOR_SIZE = 4096
+
+    // NOTA.h timing
+    const REQUEST_DELAY = 10        // listener(): after the first byte of a request
+    const REPLY_DELAY = 100         // ota_handle_idle(): after the reply
+    const START_DELAY = 500         // ota_handle_update(): after the "OK" of the first part
+    const RECEIVE_TIMEOUT = 1000    // ota_receive_part(): waited = 1000
+    const FINISH_DELAY = 2010       // ota_finish(): before the final "OK"
+    const CLOSE_DELAY = 1000        // ota_finish(): after the final "OK"
+    const STATE_TIMEOUT = 5000      // listener(): authentication and update timeouts
+    const AUTH_WINDOW = 8           // NOTA_AUTH_WINDOW
+    const PULL_RANGE = 4096         // NOTA_PULL_RANGE
+    const PULL_RETRIES = 5          // NOTA_PULL_RETRIES
+    const PULL_TIMEOUT = 5000       // NOTA_PULL_TIMEOUT
+
+    const argv = argParser(process.argv.slice(2))
+    const port = +(argv.p || argv.port || 8266)
+    const password = `${argv.a || argv.auth || ''}`
+    const name = `${argv.n || argv.name || 'nota-sim'}`
+    const board = `${argv.b || argv.board || 'SIM'}`
+    const platform = `${argv.platform || 'ESP32'}`
+    const version = `${argv.version || '0.0.0'}`
+    const image_hash = `${argv.hash || md5(name)}`
+    const write_rate = +(argv.write || 250) * 1024 / 1000 // Bytes per ms
+    const erase_ms = +(argv.erase || 0)
+    const sector_erase_ms = +(argv['sector-erase'] === undefined ? 45 : argv['sector-erase'])
+    const free_space = +(argv.free || 0x180000)
+    const debug = !!(argv.d || argv.debug || false)
+    if (!(port > 0 && port < 65536)) throw new Error(`Invalid port ${JSON.stringify(argv.port)}.`)
+    if (!(write_rate > 0)) throw new Error(`Invalid write rate ${JSON.stringify(argv.write)}. Use [--write <kB/s>] with a positive number.`)
+    if (!(erase_ms >= 0 && sector_erase_ms >= 0)) throw new Error('Invalid erase time. Use a number of ms of at least 0.')
+
+    const boot = Date.now()
+    const millis = () => Date.now() - boot
+
+    /**
+     * Accepted connection with the Stream methods NOTA.h uses
+     * @param { net.Socket } socket
+     */
+    const create_client = socket => {
+        let data = Buffer.alloc(0)
+        let connected = true
+        socket.on('data', d => { data = Buffer.concat([data, d]) })
+        socket.on('end', () => { connected = false })
+        socket.on('close', () => { connected = false })
+        socket.on('error', () => { connected = false })
+        const client = {
+            available: () => data.length,
+            connected: () => connected,
+            peek: () => data.length ? data[0] : -1,
+            read: () => {
+                if (!data.length) return -1
+                const b = data[0]
+                data = data.subarray(1)
+                return b
+            },
+            /** @param { number } size */
+            readBytes: size => {
+                const out = data.subarray(0, size)
+                data = data.subarray(out.length)
+                return out
+            },
+            flush: () => { data = Buffer.alloc(0) },
+            /** @param { string } text */
+            write: text => { if (connected) socket.write(text) },
+            stop: () => {
+                connected = false
+                socket.end()
+            },
+        }
+        return client
+    }
+
+    /** @type { ReturnType<create_client>[] } */
+    const clients = []
+    const server = net.createServer(socket => {
+        socket.setNoDelay(true)
+        clients.push(create_client(socket))
+    })
+
+    // Device state, see NOTAClass
+    let state = 'idle'
+    let last_auth_time = 0, last_update_time = 0
+    let nonce = ''
+    let cmd = 0, size = 0, program_hash = '', pull_url = ''
+    let session = 0
+    /** @type { number[] } */
+    let auth_window = []
+    let auth_floor = 0
+    let auth_floor_known = false // Nothing is stored across starts
+    let auth_ts = 0 // Timestamp of a signed request that got the challenge
+    /** @type { ReturnType<create_client> | null } */
+    let ota_client = null
+
+    const parseInt = () => {
+        const c = /** @type { ReturnType<create_client> } */ (ota_client)
+        while (c.available() && c.peek() === 0x20) c.read()
+        let text = ''
+        for (let i = 0; i <= 15 && c.available() && c.peek() && c.peek() !== 0x20; i++) {
+            const value = c.read()
+            if (value === 0x0A || value === 0x0D) break
+            text += String.fromCharCode(value)
+        }
+        return Number.parseInt(text) || 0
+    }
+
+    /** @param { number } end */
+    const readStringUntil = end => {
+        const c = /** @type { ReturnType<create_client> } */ (ota_client)
+        let res = ''
+        while (true) {
+            const value = c.read()
+            if (value < 0 || value === 0 || value === end) return res
+            res += String.fromCharCode(value)
+        }
+    }
+
+    /** @param { string } prefix */
+    const reply = prefix => ota_client && ota_client.write(`${prefix} ${[NOTA_VERSION, name, platform, board, version, image_hash].join('|/')}`)
+
+    /** @param { string } result @param { number } received @param { number } started */
+    const report = (result, received, started) => {
+        println(`session ${++session} ${result} ${received}/${size} bytes ${millis() - started} ms`)
+    }
+
+    /**
+     * Single round trip handshake, see auth_mac_valid() and auth_window_accept() in NOTA.h
+     * @param { string } options
+     * @returns { string } the error reply, empty when accepted, AUTH when the challenge has to set the floor first
+     */
+    const check_signed = options => {
+        const mac = / mac=([0-9a-fA-F]+)$/.exec(` ${options}`)
+        const ts = / ts=(\d+)/.exec(` ${options}`)
+        const signed = `${cmd} ${size} ${program_hash}${` ${options}`.substring(0, ` ${options}`.lastIndexOf(' mac='))}`
+        if (!mac || !ts || crypto.createHmac('md5', md5(password)).update(signed).digest('hex') !== mac[1].toLowerCase()) return 'ERR:AUTH'
+        const value = +ts[1]
+        if (!auth_floor_known) return 'AUTH'
+        if (!value || value <= auth_floor || auth_window.includes(value)) return 'ERR:REPLAY'
+        auth_window.push(value)
+        auth_window.sort((a, b) => b - a)
+        if (auth_window.length > AUTH_WINDOW) auth_floor = Math.max(auth_floor, /** @type { number } */ (auth_window.pop()))
+        return ''
+    }
+
+    /** @param { string } message */
+    const fail = message => {
+        if (!ota_client) return
+        ota_client.write(`ERROR: ${message}`)
+        ota_client.stop()
+    }
+
+    const handle_idle = async () => {
+        const c = /** @type { ReturnType<create_client> } */ (ota_client)
+        await delay(REQUEST_DELAY)
+        const command = parseInt()
+        if (command === QUERY) {
+            c.flush()
+            c.write(`STAT ${[NOTA_VERSION, name, platform, board, version, image_hash, free_space, millis(), '-', 0, '-', '-'].join('|/')}\n`)
+            return
+        }
+        if (command !== FLASH && command !== SPIFFS) {
+            if (debug) println(`Unknown command: ${command}`)
+            c.flush()
+            return
+        }
+        cmd = command
+        c.read()
+        size = parseInt()
+        c.read()
+        const request = readStringUntil(0x0A).trim()
+        c.flush()
+        program_hash = request.split(' ')[0]
+        const options = request.substring(program_hash.length).trim()
+        const url = / url=(\S+)/.exec(` ${options}`)
+        pull_url = url ? url[1] : ''
+        let signed_error = ''
+        if (program_hash.length !== 32) {
+            reply('ERR:HASH')
+        } else if (cmd === FLASH && program_hash.toLowerCase() === image_hash && !options.includes('reflash=1')) {
+            reply('SAME')
+        } else if (/(^| )(blocks|extents|parts|hdr)=/.test(options)) {
+            reply('ERR:OPTION')
+        } else if (pull_url && (cmd !== FLASH || !pull_url.startsWith('http://'))) {
+            reply('ERR:PULL')
+        } else if (password && / mac=/.test(` ${options}`) && (signed_error = check_signed(options)) !== 'AUTH') {
+            reply(signed_error || 'OK')
+            await delay(REPLY_DELAY)
+            if (signed_error) report(signed_error === 'ERR:AUTH' ? 'AUTH' : 'REPLAY', 0, millis())
+            else state = 'update'
+            last_update_time = millis()
+        } else if (password) {
+            const ts = / ts=(\d+)/.exec(` ${options}`)
+            auth_ts = signed_error && ts ? +ts[1] : 0
+            nonce = md5(`${Date.now()}${Math.random()}`)
+            reply(`AUTH ${nonce}`)
+            await delay(REPLY_DELAY)
+            state = 'auth'
+            last_auth_time = millis()
+        } else {
+            reply('OK')
+            await delay(REPLY_DELAY)
+            state = 'update'
+            last_update_time = millis()
+        }
+    }
+
+    const handle_auth = async () => {
+        const c = /** @type { ReturnType<create_client> } */ (ota_client)
+        const command = parseInt()
+        state = 'idle'
+        if (command !== AUTH && command !== TEST) {
+            c.write('ERR:CMD')
+            report('AUTH_CMD', 0, millis())
+            return
+        }
+        c.read()
+        const cnonce = readStringUntil(0x20)
+        const response = readStringUntil(0x0A)
+        c.flush()
+        if (cnonce.length !== 32 || response.length !== 32) {
+            c.write('ERR:KEY')
+            report('AUTH_KEY', 0, millis())
+            return
+        }
+        if (md5(`${md5(password)}:${nonce}:${cnonce}`) !== response) {
+            c.write('ERR:AUTH')
+            report('AUTH', 0, millis())
+            return
+        }
+        if (command === TEST) {
+            await delay(100)
+            c.write('OK')
+            await delay(100)
+            c.flush()
+            return
+        }
+        if (auth_ts && !auth_floor_known) {
+            auth_floor = auth_ts
+            auth_floor_known = true
+        }
+        state = 'update'
+        last_update_time = millis()
+    }
+
+    const pull_agent = new http.Agent({ keepAlive: true, maxSockets: 1 })
+
+    /**
+     * One range of the pulled image, rejected unless the server answers 206 for the asked offset
+     * @param { number } offset @param { number } length
+     * @returns { Promise<Buffer> }
+     */
+    const fetch_range = (offset, length) => new Promise((resolve, reject) => {
+        const request = http.get(pull_url, { agent: pull_agent, headers: { Range: `bytes=${offset}-${offset + length - 1}` }, timeout: PULL_TIMEOUT }, res => {
+            /** @type { Buffer[] } */
+            const chunks = []
+            res.on('data', d => chunks.push(d))
+            res.on('error', reject)
+            res.on('end', () => {
+                const range = /^bytes (\d+)-/.exec(`${res.headers['content-range'] || ''}`)
+                if (res.statusCode !== 206 || !range || +range[1] !== offset) reject(new Error(`HTTP ${res.statusCode}`))
+                else resolve(Buffer.concat(chunks).subarray(0, length))
+            })
+        })
+        request.on('timeout', () => request.destroy(new Error('Timeout')))
+        request.on('error', reject)
+    })
+
+    const handle_update = async () => {
+        const c = /** @type { ReturnType<create_client> } */ (ota_client)
+        const started = millis()
+        await delay(erase_ms)
+        c.flush() // Whatever arrived during the erase is dropped
+        c.write('OK')
+        await delay(START_DELAY)
+        const hash = crypto.createHash('md5')
+        let total = 0
+        let erased = 0
+        let busy_until = 0 // The device is writing until then
+        let last_data = millis()
+        let result = ''
+        /** @param { Buffer } data */
+        const program = async data => {
+            hash.update(data)
+            let work = data.length / write_rate
+            for (; erased < total + data.length; erased += SECTOR_SIZE) work += sector_erase_ms
+            busy_until = Math.max(millis(), busy_until) + work
+            if (busy_until - millis() >= 1) await delay(busy_until - millis())
+            total += data.length
+        }
+        for (let failures = 0; pull_url && total < size && c.connected();) {
+            try {
+                await program(await fetch_range(total, Math.min(PULL_RANGE, size - total)))
+                failures = 0
+                c.write(`${total}\n`)
+            } catch (e) {
+                if (debug) println(`Pull at ${total} failed: ${e.message}`)
+                if (++failures > PULL_RETRIES) {
+                    c.write('ERR:PULL')
+                    result = 'PULL'
+                    break
+                }
+                await delay(100 * 2 ** failures)
+            }
+        }
+        while (!pull_url && total < size && (c.connected() || c.available())) {
+            if (!c.available()) {
+                if (millis() - last_data > RECEIVE_TIMEOUT) {
+                    result = 'TIMEOUT'
+                    break
+                }
+                await delay(1)
+                continue
+            }
+            const data = c.readBytes(size - total)
+            await program(data)
+            c.write(`${data.length}`)
+            last_data = millis()
+        }
+        state = 'idle'
+        if (!result && total !== size) result = 'DISCONNECTED'
+        if (!result && hash.digest('hex') !== program_hash.toLowerCase()) result = 'MD5'
+        if (result) {
+            fail(result === 'MD5' ? 'MD5 Check Failed' : `Receive Failed: ${result}`)
+            report(result, total, started)
+            return
+        }
+        await delay(FINISH_DELAY)
+        c.write('OK')
+        await delay(CLOSE_DELAY)
+        c.stop()
+        report('OK', total, started)
+    }
+
+    const listener = async () => {
+        if (state === 'auth' && last_auth_time + STATE_TIMEOUT < millis()) state = 'idle'
+        if (state === 'update' && last_update_time + STATE_TIMEOUT < millis()) state = 'idle'
+        for (let i = clients.length - 1; i >= 0; i--) {
+            if (!clients[i].connected() && !clients[i].available()) clients.splice(i, 1)
+        }
+        const client = clients.find(x => x.available())
+        if (!client) return
+        ota_client = client
+        if (state === 'idle') await handle_idle()
+        if (state === 'auth') await handle_auth()
+        if (state === 'update') await handle_update()
+        client.flush()
+        ota_client = null
+    }
+
+    server.on('error', throw_error)
+    server.listen(port, () => println(`Simulated ${platform} device ${JSON.stringify(name)} on port ${port}: write ${+(argv.write || 250)} kB/s, erase ${erase_ms} ms, sector erase ${sector_erase_ms} ms${password ? ', password' : ''}`))
+    process.on('SIGINT', () => process.exit(0))
+    process.on('SIGTERM', () => process.exit(0))
+    while (true) {
+        await listener()
+        await delay(1)
+    }
+})()
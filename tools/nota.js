@@ -6,6 +6,35 @@
 // use it like: node nota -i <ESP_IP_address> -p <ESP_port> [-a password] -f <sketch.bin>
 // Or to upload SPIFFS image:
 // node nota -i <ESP_IP_address> -p <ESP_port> [-a password] -s -f <spiffs.bin>
+// Add [--autotune] to measure the ack round trip of different chunk sizes during the first part of the upload and keep the fastest.
+// The result is cached per device name and board in ~/.nota/autotune.json and used as the starting point of later sessions.
+// Use [--chunk <bytes>] to force a fixed chunk size instead.
+// A device that already runs the image answers the request with SAME and nothing is uploaded. Add [--reflash] to upload anyway.
+// Add [--delta] (or [--delta <block size>], default 4096) to fetch the block hashes of the running image first and send only the changed blocks.
+// The device copies the unchanged blocks from its running image.
+// Add [--sparse] to send only the data runs of the image, the device leaves the erased (0xFF) gaps between them untouched.
+// With an ELF file the image is built from its PT_LOAD segments with 0xFF gaps instead of the zero filled objcopy output.
+// Add [--config <file>] to send a config blob together with the firmware in one authenticated session. The device hands it
+// to the application only once the firmware is verified, then reboots once. A filesystem image is written in place, so
+// it is sent on its own with [-s].
+// Add [--relay <fan-out>] to have a device built with NOTA_RELAY pass the image on to up to <fan-out> peers of the same board
+// before it reboots, each of which does the same. Only the first device is uploaded from this host.
+// Add [--rate <kB/s>] to limit the upload rate, so the transfer shares the device's network link with the application traffic.
+// Add [--header] to send an image header first: the device checks the board of [-b], the link address of the ELF file
+// (or [--link <hex address>]) and the vector table before it erases anything, and refuses a wrong image right away.
+// [--image-version <version>] is passed along in the header.
+// Add [--pull] to have a device built with NOTA_PULL fetch the image itself: this script serves it over HTTP and the device
+// asks for it with range requests at the pace its flash takes it. [--pull-host <address>] sets the address the device is
+// told to fetch from, by default the local address of the route to the device.
+// With [-a] the device sends an AUTH challenge first. Add [--signed] to sign the request with the password instead, so a
+// device that supports it starts right away, which saves two round trips. Its timestamp (ms since 1970) must grow from
+// upload to upload, a device without a stored replay floor still sends the challenge once.
+// Prepared artifacts (the BIN of an ELF file, sparse extents, block hash tables and deltas) are cached in ~/.nota/cache under
+// the content hash of the image, and of the running image for deltas, so a rollout to many devices prepares them once.
+// Add [--no-cache] to prepare everything again.
+// For A/B slot targets the file name may contain {slot}, which is replaced with the slot the device will write (A or B).
+// Or to query the status of one or more devices without starting an update:
+// node nota -i <IP_1>,<IP_2>,... -p <ESP_port> --query [--json]
 //
 // This script is based on the espota.py script from the ESP8266 Arduino library.
 // The main difference between this script and the original espota.py is that now the OTA update process is fully done over the micro-controllers' TCP/IP socket.
@@ -37,6 +66,10 @@
 
     const net = require('net')
     const fs = require('fs')
+    const os = require('os')
+    const path = require('path')
+    const http = require('http')
+    const dgram = require('dgram')
     const crypto = require('crypto')
     /** @param { string | Buffer } data */
     const md5 = data => crypto.createHash('md5').update(typeof data === 'string' ? Buffer.from(data) : data).digest("hex")
@@ -84,12 +117,28 @@
     // const CHUNK_SIZE = 1460 * 4 // nota.js: tested with ESP8266 and seems to be fast and reliable at 4x the size of the original espota.py
     const CHUNK_SIZE = 2048 // nota.js: tested with STM32F4 using W5500
     const DEFAULT_PORT = 8266
+    const CHUNK_CANDIDATES = [1024, 1460, 2048, 1460 * 2, 4096, 1460 * 4, 8192]
+    const AUTOTUNE_ROUNDS = 4 // chunks measured per candidate size
+    const AUTOTUNE_BUDGET = 0.25 // fraction of the image that may be spent on probing
+    const AUTOTUNE_CACHE = path.join(os.homedir(), '.nota', 'autotune.json')
+    const ARTIFACT_CACHE = path.join(os.homedir(), '.nota', 'cache')
+    const ARTIFACT_CACHE_SIZE = 256 * 1024 * 1024 // bytes kept, the least recently used artifacts go first
 
     // Commands
     const FLASH = 0
     const SPIFFS = 100
     const AUTH = 200
     const TEST = 201
+    const QUERY = 202
+    const BLOCKS = 203
+    const MULTI = 204
+    const CONFIG = 300
+    const DELTA_BLOCK_SIZE = 4096
+    const BLOCK_HASH_SIZE = 8 // bytes of the block MD5
+    const EXTENTS_MAX = 16 // NOTA_EXTENTS_MAX
+    const HEADER_MAGIC = 0x3148544E // NOTA_HEADER_MAGIC
+    const HEADER_SIZE = 64 // nota_image_header_t
+    const SPARSE_MIN_GAP = 64 // shorter 0xFF runs are sent
     const total_bars = 40
 
     const supported_versions = ['0.0.2', '0.0.3']
@@ -103,18 +152,48 @@
     const host = argv.i || argv.ip || ''
     const port = argv.p || argv.port || DEFAULT_PORT
     const auth = argv.a || argv.auth || ''
-    const image = argv.f || argv.file || ''
+    let image = argv.f || argv.file || ''
     const command = (argv.s || argv.spiffs || false) ? SPIFFS : FLASH
     const debug = !!(argv.d || argv.debug || false)
     const ts = !!(argv.t || argv.timestamp || false)
     const force = argv.force || false
     const test = argv.test || false
+    const query = argv.q || argv.query || false
+    const json = argv.json || false
+    const autotune = argv.autotune || false
+    const chunk_arg = +(argv.chunk || 0)
+    const reflash = argv.reflash || false
+    const delta = argv.delta || false
+    const delta_block_size = delta === true ? DELTA_BLOCK_SIZE : +delta
+    const config_file = argv.config || ''
+    const relay = +(argv.relay || 0)
+    const rate = +(argv.rate || 0) * 1024
+    const sparse = argv.sparse || false
+    const header = argv.header || false
+    const link_address = argv.link ? parseInt(`${argv.link}`, 16) : 0
+    const image_version = `${argv['image-version'] || ''}`
+    const pull = argv.pull || false
+    const pull_host = argv['pull-host'] || ''
+    const no_cache = argv['no-cache'] || false
+    const signed_request = argv.signed || false
 
-    const upload = !test
+    const upload = !test && !query
 
     if (!host) throw new Error('Missing parameter [-i] / [--ip] for the target IP address.')
+    if (argv.chunk && !(chunk_arg >= 64)) throw new Error(`Invalid chunk size ${JSON.stringify(argv.chunk)}. Use [--chunk <bytes>] with at least 64 bytes.`)
+    if (delta && !(delta_block_size >= 256 && delta_block_size <= 65536 && delta_block_size % 256 === 0)) throw new Error(`Invalid delta block size ${JSON.stringify(argv.delta)}. Use a multiple of 256 between 256 and 65536.`)
+    if (config_file && (config_file === true || !fs.existsSync(config_file))) throw new Error(`File ${JSON.stringify(config_file)} does not exist.`)
+    if (argv.fs) throw new Error('A filesystem image cannot be part of a firmware session, send it on its own with [-s].')
+    if (argv.rate && !(rate > 0)) throw new Error(`Invalid rate ${JSON.stringify(argv.rate)}. Use [--rate <kB/s>] with a positive number.`)
+    if (argv.relay && !(relay >= 1 && relay <= 8 && Number.isInteger(relay))) throw new Error(`Invalid relay fan-out ${JSON.stringify(argv.relay)}. Use a number between 1 and 8.`)
+    if (argv.link && !(link_address >= 0 && link_address <= 0xFFFFFFFF)) throw new Error(`Invalid link address ${JSON.stringify(argv.link)}. Use [--link <hex address>].`)
+    if (sparse && delta) throw new Error('Use either [--sparse] or [--delta], not both.')
+    if (config_file && command === SPIFFS) throw new Error('[--config] goes with a flash image, not with [-s].')
+    if (pull && (sparse || delta)) throw new Error('Use either [--pull] or [--sparse] / [--delta], not both.')
+    if (pull && (config_file || command === SPIFFS)) throw new Error('[--pull] only sends a flash image, not [-s] or [--config].')
+    if (pull_host === true) throw new Error('Missing address of [--pull-host <address>].')
     if (upload && !image) throw new Error('Missing parameter [-f] / [--file] for the binary image file.')
-    if (upload && !fs.existsSync(image)) throw new Error(`File ${JSON.stringify(image)} does not exist.`)
+    if (upload && !fs.existsSync(image) && !`${image}`.includes('{slot}')) throw new Error(`File ${JSON.stringify(image)} does not exist.`)
 
     /** 
      * @param { { host: String, port: Number, debug?: Boolean} } remote_address
@@ -195,15 +274,15 @@
         c.connect(port, host)
     })
 
-    const connect = async (message = '') => {
+    const connect = async (message = '', target = host, quiet = false) => {
         if (!message) throw new Error('No message to send.')
         let sock = undefined
         let con_retries = 0, connected = false
         for (; con_retries < 10 && !connected;) {
-            if (con_retries === 1) { print(`${timestamp(ts)}Retrying...`) }
-            if (con_retries > 1) print('.')
+            if (con_retries === 1 && !quiet) { print(`${timestamp(ts)}Retrying...`) }
+            if (con_retries > 1 && !quiet) print('.')
             try {
-                sock = await socket_connect({ host, port, debug }) // @ts-ignore // Create a TCP/IP client socket connection
+                sock = await socket_connect({ host: target, port, debug }) // @ts-ignore // Create a TCP/IP client socket connection
             } catch (e) { throw new Error(e && e.message) }
             try {
                 sock.setTimeout(100)
@@ -216,10 +295,192 @@
                 con_retries++
             }
         }
-        if (con_retries > 0) println(connected ? ' connected!' : ' failed!')
-        if (!sock) throw new Error(`Failed to connect to ${host}:${port}`)
+        if (con_retries > 0 && !quiet) println(connected ? ' connected!' : ' failed!')
+        if (!sock || !connected) throw new Error(`Failed to connect to ${target}:${port}`)
         return sock
     }
+
+    /**
+     * @template T, R
+     * @param { T[] } items
+     * @param { number } limit
+     * @param { (item: T) => Promise<R> } fn
+     * @returns { Promise<R[]> }
+     */
+    const parallel = async (items, limit, fn) => {
+        /** @type { R[] } */
+        const results = []
+        let next = 0
+        const worker = async () => {
+            while (next < items.length) {
+                const index = next++
+                results[index] = await fn(items[index])
+            }
+        }
+        await Promise.all(Array.from({ length: Math.min(limit, items.length) }, worker))
+        return results
+    }
+
+    /**
+     * Image of the PT_LOAD segments of a 32-bit little-endian ELF file at their load addresses, the gaps erased (0xFF)
+     * @param { Buffer } elf
+     */
+    const load_elf = elf => {
+        if (elf.readUInt32BE(0) !== 0x7F454C46 || elf[4] !== 1 || elf[5] !== 1) throw new Error('Only 32-bit little-endian ELF files can be sent with [--sparse] or [--header].')
+        const phoff = elf.readUInt32LE(28)
+        const phentsize = elf.readUInt16LE(42)
+        const phnum = elf.readUInt16LE(44)
+        /** @type { { address: number, data: Buffer }[] } */
+        const segments = []
+        for (let i = 0; i < phnum; i++) {
+            const at = phoff + i * phentsize
+            const type = elf.readUInt32LE(at)
+            const offset = elf.readUInt32LE(at + 4)
+            const paddr = elf.readUInt32LE(at + 12)
+            const filesz = elf.readUInt32LE(at + 16)
+            if (type === 1 && filesz > 0) segments.push({ address: paddr, data: elf.subarray(offset, offset + filesz) }) // PT_LOAD
+        }
+        if (!segments.length) throw new Error('The ELF file has no loadable segments.')
+        const base = Math.min(...segments.map(x => x.address))
+        const image = Buffer.alloc(Math.max(...segments.map(x => x.address + x.data.length)) - base, 0xFF)
+        for (const segment of segments) segment.data.copy(image, segment.address - base)
+        return { image, base }
+    }
+
+    /**
+     * Image header of [--header], see nota_image_header_t in src/nota_protocol.h
+     * @param { Buffer } data @param { number } address @param { string } board @param { string } version
+     */
+    const image_header = (data, address, board, version) => {
+        const out = Buffer.alloc(HEADER_SIZE)
+        out.writeUInt32LE(HEADER_MAGIC, 0)
+        out.writeUInt32LE(data.length, 4)
+        out.writeUInt32LE(address >>> 0, 8)
+        data.copy(out, 12, 0, 8) // vector table
+        Buffer.from(md5(data), 'hex').copy(out, 20)
+        out.write(board.substring(0, 16), 36, 'latin1')
+        out.write(version.substring(0, 12), 52, 'latin1')
+        return out
+    }
+
+    /**
+     * Data runs of an image for [--sparse]: word aligned 0xFF runs of at least SPARSE_MIN_GAP bytes are left out.
+     * The smallest gaps are sent after all when there are more than EXTENTS_MAX runs
+     * @param { Buffer } image
+     */
+    const find_extents = image => {
+        /** @type { { offset: number, length: number }[] } */
+        const runs = []
+        let start = -1
+        for (let i = 0; i < image.length;) {
+            if (i % 4 === 0 && image[i] === 0xFF) {
+                let j = i
+                while (j < image.length && image[j] === 0xFF) j++
+                const gap_end = j === image.length ? j : j - j % 4
+                if (gap_end - i >= SPARSE_MIN_GAP) {
+                    if (start >= 0) runs.push({ offset: start, length: i - start })
+                    start = -1
+                    i = gap_end
+                    continue
+                }
+            }
+            if (start < 0) start = i
+            i++
+        }
+        if (start >= 0) runs.push({ offset: start, length: image.length - start })
+        while (runs.length > EXTENTS_MAX) {
+            let smallest = 0
+            for (let i = 1; i < runs.length - 1; i++) {
+                const gap = runs[i + 1].offset - runs[i].offset - runs[i].length
+                if (gap < runs[smallest + 1].offset - runs[smallest].offset - runs[smallest].length) smallest = i
+            }
+            runs[smallest].length = runs[smallest + 1].offset + runs[smallest + 1].length - runs[smallest].offset
+            runs.splice(smallest + 1, 1)
+        }
+        return runs
+    }
+
+    /**
+     * Token bucket of [--rate]: take() resolves once the bytes fit the rate. It holds up to a chunk or 100 ms of traffic.
+     * @param { number } bytes_per_second
+     */
+    const create_bucket = bytes_per_second => {
+        let tokens = 0
+        let last = Date.now()
+        return {
+            /** @param { number } bytes */
+            take: async bytes => {
+                const depth = Math.max(bytes, bytes_per_second / 10)
+                for (;;) {
+                    const now = Date.now()
+                    tokens = Math.min(depth, tokens + (now - last) * bytes_per_second / 1000)
+                    last = now
+                    if (tokens >= bytes) break
+                    await delay(Math.ceil((bytes - tokens) * 1000 / bytes_per_second))
+                }
+                tokens -= bytes
+            }
+        }
+    }
+
+    /** @param { string } target */
+    const query_device = async target => {
+        const sock = await connect(`${QUERY}\n`, target, true)
+        try {
+            while (!sock.peekAll().includes('\n')) await sock.doAwait(sock.available() + 1)
+            const reply = sock.readUntil('\n').trim()
+            if (!reply.startsWith('STAT ')) throw new Error(`Bad status response: ${JSON.stringify(reply)}`)
+            const [nota, name, platform, board, version, hash, free, uptime, last, last_ms, slot, staged] = reply.substring(5).split('|/')
+            return { host: target, nota, name, platform, board, version, hash, free: +free, uptime: +uptime, last, last_ms: +last_ms, slot: slot || '-', staged: staged || '-' }
+        } finally { sock.end() }
+    }
+
+    /** @param { string } target @param { number } block_size */
+    const query_blocks = async (target, block_size) => {
+        const sock = await connect(`${BLOCKS} ${block_size}\n`, target, true)
+        try {
+            while (!sock.peekAll().includes('\n') && !sock.peekAll().startsWith('ERR')) await sock.doAwait(sock.available() + 1)
+            const reply = sock.readUntil('\n').trim()
+            const [tag, size, length, hashes] = reply.split(' ')
+            if (tag !== 'BLOCKS' || +size !== block_size) throw new Error(`Bad block hash response: ${JSON.stringify(reply)}`)
+            const count = Math.ceil(+length / block_size)
+            const hash_length = BLOCK_HASH_SIZE * 2
+            if ((hashes || '').length !== count * hash_length) throw new Error(`Bad block hash response: expected ${count} hashes`)
+            return Array.from({ length: count }, (_, i) => hashes.substring(i * hash_length, (i + 1) * hash_length))
+        } finally { sock.end() }
+    }
+
+    if (query) {
+        const hosts = `${host}`.split(',').map(x => x.trim()).filter(Boolean)
+        const results = await parallel(hosts, 64, async target => {
+            try {
+                const stat = await query_device(target)
+                if (json) println(JSON.stringify(stat))
+                else {
+                    const full_name = [stat.name, stat.board ? `(${stat.board})` : '', stat.platform ? `[${stat.platform}]` : '', stat.version].filter(Boolean).join(' ')
+                    const uptime = `${(stat.uptime / 1000).toFixed(0)}s`
+                    const slot = stat.slot !== '-' ? ` next slot ${stat.slot}` : ''
+                    const staged = stat.staged !== '-' ? ` staged ${stat.staged}` : ''
+                    println(`${timestamp(ts)}${target}: ${full_name} NOTA v${stat.nota} image ${stat.hash} free ${stat.free} bytes uptime ${uptime} last update ${stat.last}${stat.last !== '-' ? ` (${stat.last_ms} ms)` : ''}${slot}${staged}`)
+                }
+                return true
+            } catch (e) {
+                if (json) println(JSON.stringify({ host: target, error: e.message }))
+                else println(`${timestamp(ts)}${target}: ${e.message}`)
+                return false
+            }
+        })
+        process.exit(results.every(Boolean) ? 0 : 1)
+    }
+
+    if (upload && `${image}`.includes('{slot}')) {
+        // A/B slot images are linked for their slot, ask the device which one it will write
+        const stat = await query_device(host)
+        if (stat.slot === '-') throw new Error(`Target ${host}:${port} does not use A/B slots, but the file name ${JSON.stringify(image)} expects one.`)
+        image = `${image}`.split('{slot}').join(stat.slot)
+        println(`${timestamp(ts)}Target writes slot ${stat.slot}, using ${JSON.stringify(image)}`)
+        if (!fs.existsSync(image)) throw new Error(`File ${JSON.stringify(image)} does not exist.`)
+    }
     /** @param { any } sock */
     const verify = sock => new Promise(async (resolve, reject) => {
         try {
@@ -246,6 +507,261 @@
         println()
     })
 
+    /**
+     * Acks are plain decimal byte counts without a separator, one per receive burst on the device.
+     * Check whether the received digits can be split into counts that add up to the chunk size.
+     * @param { string } digits
+     * @param { number } size
+     */
+    const ack_matches = (digits, size) => {
+        if (!/^[0-9]+$/.test(digits)) return false
+        /** @type { Map<string, boolean> } */
+        const memo = new Map()
+        /** @param { number } i @param { number } left @returns { boolean } */
+        const split = (i, left) => {
+            if (i === digits.length) return left === 0
+            if (left <= 0 || digits[i] === '0') return false
+            const key = `${i}:${left}`
+            const cached = memo.get(key)
+            if (cached !== undefined) return cached
+            let ok = false
+            for (let j = i + 1, value = 0; j <= digits.length && !ok; j++) {
+                value = value * 10 + +digits[j - 1]
+                if (value > left) break
+                ok = split(j, left - value)
+            }
+            memo.set(key, ok)
+            return ok
+        }
+        return split(0, size)
+    }
+
+    /** @param { any } sock @param { number } size */
+    const await_ack = async (sock, size) => {
+        let response = ''
+        while (true) {
+            try {
+                await sock.doAwait()
+            } catch (e) {
+                throw new Error(response ? `Bad response: ${JSON.stringify(response)} (expected: ${JSON.stringify(`${size}`)})` : e.message)
+            }
+            response += sock.readAll()
+            if (response.includes('OK') || response.includes('ERR')) return response
+            if (ack_matches(response, size)) return response
+        }
+    }
+
+    /**
+     * Waits for the "OK" that opens the next part of a multi-part session, the device verifies the previous part
+     * and prepares the storage of the next one meanwhile
+     * @param { any } sock
+     */
+    const await_part_start = async sock => {
+        const deadline = Date.now() + 30000
+        let response = ''
+        while (!response.includes('OK')) {
+            if (response.includes('ERR')) throw new Error(`Bad response: ${JSON.stringify(response)}`)
+            if (Date.now() > deadline) throw new Error('Timeout while waiting for the next part to start')
+            await delay(10)
+            response += sock.readAll()
+        }
+    }
+
+    const artifact_prune = () => {
+        const entries = fs.readdirSync(ARTIFACT_CACHE).filter(name => !name.endsWith('.tmp')).map(name => {
+            const file = path.join(ARTIFACT_CACHE, name)
+            const stat = fs.statSync(file)
+            return { file, size: stat.size, used: stat.mtimeMs }
+        }).sort((a, b) => b.used - a.used)
+        let kept = 0
+        for (const entry of entries) {
+            kept += entry.size
+            if (kept > ARTIFACT_CACHE_SIZE) fs.unlinkSync(entry.file)
+        }
+    }
+
+    /**
+     * Artifacts in ARTIFACT_CACHE, named by the content hash of what they are made from. Entries are written through a
+     * temporary file, so uploads running in parallel never read half an entry. A hit counts as a use for the pruning
+     */
+    const artifact_cache = {
+        /** @param { string } key @returns { Buffer | null } */
+        get: key => {
+            if (no_cache) return null
+            const file = path.join(ARTIFACT_CACHE, key)
+            try {
+                const data = fs.readFileSync(file)
+                const now = new Date()
+                fs.utimesSync(file, now, now)
+                return data
+            } catch (e) { return null }
+        },
+        /** @param { string } key @param { Buffer | string } data */
+        put: (key, data) => {
+            if (no_cache) return
+            try {
+                fs.mkdirSync(ARTIFACT_CACHE, { recursive: true })
+                const file = path.join(ARTIFACT_CACHE, key)
+                const temp = `${file}.${process.pid}.tmp`
+                fs.writeFileSync(temp, data)
+                fs.renameSync(temp, file)
+                artifact_prune()
+            } catch (e) {
+                println(`${timestamp(ts)}Warning: Could not write the artifact cache ${JSON.stringify(ARTIFACT_CACHE)}: ${e.message}`)
+            }
+        },
+    }
+
+    /**
+     * Cached artifact that is plain data
+     * @template T
+     * @param { string } key @param { () => T } prepare
+     * @returns { T }
+     */
+    const cached_json = (key, prepare) => {
+        const hit = artifact_cache.get(key)
+        if (hit) {
+            try { return JSON.parse(hit.toString()) } catch (e) { } // Damaged entry, prepared again
+        }
+        const value = prepare()
+        artifact_cache.put(key, JSON.stringify(value))
+        return value
+    }
+
+    const autotune_load = () => {
+        try { return JSON.parse(fs.readFileSync(AUTOTUNE_CACHE, 'utf8')) } catch (e) { return {} }
+    }
+
+    /** @param { string[] } keys @param { { chunk: number, goodput: number } } entry */
+    const autotune_save = (keys, entry) => {
+        try {
+            const cache = autotune_load()
+            for (const key of keys) cache[key] = { ...entry, updated: new Date().toISOString() }
+            fs.mkdirSync(path.dirname(AUTOTUNE_CACHE), { recursive: true })
+            fs.writeFileSync(AUTOTUNE_CACHE, JSON.stringify(cache, null, 2))
+        } catch (e) {
+            println(`${timestamp(ts)}Warning: Could not save autotune cache ${JSON.stringify(AUTOTUNE_CACHE)}: ${e.message}`)
+        }
+    }
+
+    /**
+     * Measures the goodput of each candidate chunk size over a few stop-and-wait rounds and settles on the fastest.
+     * @param { number[] } candidates
+     * @param { number } budget bytes that may be spent on probing
+     */
+    const create_tuner = (candidates, budget) => {
+        const stats = candidates.map(size => ({ size, bytes: 0, ms: 0, rounds: 0 }))
+        let index = 0, spent = 0
+        /** @type { { size: number, bytes: number, ms: number, rounds: number } | null } */
+        let best = null
+        /** @param { { bytes: number, ms: number } } x */
+        const goodput = x => x.bytes / Math.max(x.ms, 0.01)
+        return {
+            first: () => stats[0].size,
+            /** @param { number } bytes @param { number } ms */
+            next: (bytes, ms) => {
+                if (best) return best.size
+                const current = stats[index]
+                current.bytes += bytes
+                current.ms += ms
+                current.rounds++
+                spent += bytes
+                if (current.rounds >= AUTOTUNE_ROUNDS) index++
+                if (index < stats.length && spent < budget) return stats[index].size
+                best = stats.filter(x => x.rounds > 0).reduce((a, b) => goodput(b) > goodput(a) ? b : a)
+                return best.size
+            },
+            result: () => best && { chunk: best.size, goodput: Math.round(goodput(best) * 1000) },
+        }
+    }
+
+    /**
+     * Serves the image for pull mode. Range requests get 206 with the asked part, limited by [--rate]
+     * @param { Buffer } data @param { string } url_path
+     * @returns { Promise<http.Server> }
+     */
+    const serve_image = (data, url_path) => new Promise((resolve, reject) => {
+        const bucket = rate ? create_bucket(rate) : null
+        const server = http.createServer(async (req, res) => {
+            if (debug) println(`${timestamp(ts)}< HTTP ${req.method} ${req.url} ${req.headers.range || ''}`)
+            if (req.method !== 'GET' || req.url !== url_path) {
+                res.writeHead(404)
+                res.end()
+                return
+            }
+            const range = /^bytes=(\d+)-(\d*)$/.exec(`${req.headers.range || ''}`)
+            if (!range) {
+                res.writeHead(200, { 'Content-Length': data.length })
+                res.end(data)
+                return
+            }
+            const start = +range[1]
+            const end = Math.min(range[2] ? +range[2] : data.length - 1, data.length - 1)
+            if (start > end) {
+                res.writeHead(416, { 'Content-Range': `bytes */${data.length}` })
+                res.end()
+                return
+            }
+            if (bucket) await bucket.take(end - start + 1)
+            res.writeHead(206, { 'Content-Range': `bytes ${start}-${end}/${data.length}`, 'Content-Length': end - start + 1 })
+            res.end(data.subarray(start, end + 1))
+        })
+        server.on('error', reject)
+        server.listen(0, () => resolve(server))
+    })
+
+    /**
+     * Local address of the route to the target, the one the device can reach this host at
+     * @param { string } target
+     * @returns { Promise<string> }
+     */
+    const local_address = target => new Promise((resolve, reject) => {
+        const udp = dgram.createSocket(target.includes(':') ? 'udp6' : 'udp4')
+        udp.on('error', reject)
+        udp.connect(+port, target, () => {
+            const address = udp.address().address
+            udp.close()
+            resolve(address)
+        })
+    })
+
+    /**
+     * Follows a pull: the device reports "<bytes written>\n" after every range it fetched. Ends at the image size,
+     * or at the final answer that arrives when the reports were read together with the part start
+     * @param { any } sock @param { number } size
+     */
+    const await_pull = async (sock, size) => {
+        let written = 0
+        let last_progress = Date.now()
+        let c = 0
+        println(`${timestamp(ts)}Total:    |<${'-'.repeat(total_bars - 2)}>| ${size} bytes`)
+        print(`${timestamp(ts)}Progress: [`)
+        const pull_start = +new Date
+        while (written < size) {
+            await delay(10)
+            const pending = sock.peekAll()
+            if (pending.includes('ERR')) {
+                println(']')
+                throw new Error(`Bad response: ${JSON.stringify(sock.readAll())}`)
+            }
+            if (pending.includes('OK')) break // Left for verify()
+            const end = pending.lastIndexOf('\n')
+            if (end >= 0) {
+                const lines = sock.read(end + 1).split('\n').filter(Boolean)
+                written = +lines[lines.length - 1] || written
+                last_progress = Date.now()
+                const p = Math.floor(written / size * total_bars)
+                for (; c < p; c++) print('=')
+            }
+            if (Date.now() - last_progress > 60000) {
+                println(']')
+                throw new Error('Timeout: the target stopped pulling the image')
+            }
+        }
+        for (; c < total_bars; c++) print('=')
+        println(`] ${((+new Date - pull_start) / 1000).toFixed(2)} seconds`)
+    }
+
     try {
         const time_start = +new Date
         let filename = image
@@ -253,32 +769,114 @@
             filename = filename + '.signed'
             println(`${timestamp(ts)}Detected Signed Update. "${filename}" will be uploaded instead.`)
         }
-        if (upload && filename.endsWith('.elf')) {
+        /** @type { Buffer | null } */
+        let elf_image = null
+        let elf_base = 0
+        if (upload && header && filename.endsWith('.elf')) elf_base = load_elf(fs.readFileSync(filename)).base
+        if (upload && sparse && filename.endsWith('.elf')) {
+            println(`${timestamp(ts)}Loading the ELF segments`)
+            elf_image = load_elf(fs.readFileSync(filename)).image
+        } else if (upload && filename.endsWith('.elf')) {
             // Convert ELF to BIN
             const { exec } = require('child_process')
             /** @param { string } cmd */
             const exec_promise = (cmd) => new Promise((resolve, reject) => exec(cmd, (err, stdout, stderr) => err ? reject(err) : resolve(stdout)))
 
             const binfile = filename.replace('.elf', '.bin')
-            // arm-none-eabi-objcopy -O binary firmware.elf firmware.bin
-            const cmd = `arm-none-eabi-objcopy -O binary "${filename}" "${binfile}"`
-            println(`${timestamp(ts)}Converting ELF to BIN`)
-            await exec_promise(cmd)
+            const key = `objcopy-${md5(fs.readFileSync(filename))}.bin`
+            elf_image = artifact_cache.get(key)
+            if (elf_image) {
+                println(`${timestamp(ts)}Using the cached BIN of the ELF file`)
+            } else {
+                // arm-none-eabi-objcopy -O binary firmware.elf firmware.bin
+                const cmd = `arm-none-eabi-objcopy -O binary "${filename}" "${binfile}"`
+                println(`${timestamp(ts)}Converting ELF to BIN`)
+                await exec_promise(cmd)
+                elf_image = fs.readFileSync(binfile)
+                artifact_cache.put(key, elf_image)
+            }
             filename = binfile
         }
-        const file_content = upload && fs.readFileSync(filename, { encoding: null }) || Buffer.from('')
+        const file_content = elf_image || upload && fs.readFileSync(filename, { encoding: null }) || Buffer.from('')
         const content_size = file_content.length
         const file_md5 = await md5(file_content)
-        if (upload) println(`${timestamp(ts)}Sending OTA ${command === SPIFFS ? 'SPIFFS' : 'Flash'} update request to ${host}:${port}`)
+        if (upload) println(`${timestamp(ts)}Sending OTA ${config_file ? 'multi-part' : command === SPIFFS ? 'SPIFFS' : 'Flash'} update request to ${host}:${port}`)
         else println(`${timestamp(ts)}Testing OTA ${command === SPIFFS ? 'SPIFFS' : 'Flash'} on ${host}:${port}`)
-        const message = `${command} ${content_size} ${file_md5}\n`
-        const sock = await connect(message)
+        // Multi-part session: the config blob goes first, the firmware last
+        /** @type { { cmd: number, data: Buffer }[] } */
+        const parts = []
+        if (upload && config_file) parts.push({ cmd: CONFIG, data: fs.readFileSync(config_file) })
+        if (parts.length) parts.push({ cmd: command, data: file_content })
+        const manifest = parts.map(part => `${part.cmd}:${part.data.length}:${md5(part.data)}`).join(',')
+        // Delta transfer: mark the blocks the device already has, it copies them from the running image
+        let payload = file_content
+        let blocks_option = ''
+        if (upload && delta && parts.length) println(`${timestamp(ts)}Delta transfer is not available in multi-part sessions, sending the full images`)
+        if (upload && delta && command === FLASH && !parts.length) {
+            try {
+                const remote = await query_blocks(host, delta_block_size)
+                const count = Math.ceil(content_size / delta_block_size)
+                /** @param { number } i */
+                const block = i => file_content.subarray(i * delta_block_size, (i + 1) * delta_block_size)
+                // The block table of the running image stands for it, the delta to it is the same on every device that runs it
+                const base = md5(remote.join(''))
+                const bitmap = Buffer.from(cached_json(`delta-${file_md5}-${base}-${delta_block_size}.json`, () => {
+                    const local = cached_json(`blocks-${file_md5}-${delta_block_size}.json`, () => Array.from({ length: count }, (_, i) => md5(block(i)).substring(0, BLOCK_HASH_SIZE * 2)))
+                    const unchanged = Buffer.alloc(Math.ceil(count / 8))
+                    for (let i = 0; i < count; i++) if (remote[i] && local[i] === remote[i]) unchanged[i >> 3] |= 1 << (i & 7)
+                    return unchanged.toString('hex')
+                }), 'hex')
+                const changed = Array.from({ length: count }, (_, i) => i).filter(i => !(bitmap[i >> 3] & 1 << (i & 7))).map(block)
+                payload = Buffer.concat(changed)
+                blocks_option = ` blocks=${delta_block_size}:${bitmap.toString('hex')}`
+                println(`${timestamp(ts)}Delta: ${changed.length} of ${count} blocks changed, sending ${payload.length} of ${content_size} bytes`)
+            } catch (e) {
+                println(`${timestamp(ts)}Delta transfer not available (${e.message}), sending the full image`)
+            }
+        }
+        // Sparse transfer: only the data runs are sent, the device skips the erased gaps
+        let extents_option = ''
+        if (upload && sparse && parts.length) println(`${timestamp(ts)}Sparse transfer is not available in multi-part sessions, sending the full images`)
+        if (upload && sparse && command === FLASH && !parts.length) {
+            const extents = cached_json(`extents-${file_md5}-${SPARSE_MIN_GAP}-${EXTENTS_MAX}.json`, () => find_extents(file_content))
+            payload = Buffer.concat(extents.map(x => file_content.subarray(x.offset, x.offset + x.length)))
+            extents_option = ` extents=${extents.map(x => `${x.offset.toString(16)}:${x.length.toString(16)}`).join(',')}`
+            println(`${timestamp(ts)}Sparse: sending ${payload.length} of ${content_size} bytes in ${extents.length} extent(s)`)
+        }
+        // Image header: checked by the device before it erases the update slot
+        let header_data = null
+        if (upload && header && parts.length) println(`${timestamp(ts)}The image header is not available in multi-part sessions, sending without it`)
+        if (upload && header && command === FLASH && !parts.length) {
+            header_data = image_header(file_content, link_address || elf_base, device_board, image_version)
+        }
+        // Pull mode: the device fetches the image from here
+        let url_option = ''
+        if (upload && pull) {
+            const url_path = `/${file_md5}.bin`
+            const server = await serve_image(file_content, url_path)
+            const address = `${pull_host || await local_address(host)}`
+            const server_port = /** @type { import('net').AddressInfo } */ (server.address()).port
+            url_option = ` url=http://${address.includes(':') ? `[${address}]` : address}:${server_port}${url_path}`
+            println(`${timestamp(ts)}Pull: serving the image at ${url_option.substring(5)}`)
+        }
+        const total_size = parts.reduce((total, part) => total + part.data.length, 0)
+        const relay_option = relay ? ` relay=${relay}` : ''
+        let request = parts.length
+            ? `${MULTI} ${total_size} ${md5(manifest)} parts=${manifest}${relay_option}`
+            : `${command} ${content_size} ${file_md5}${reflash ? ' reflash=1' : ''}${blocks_option}${extents_option}${header_data ? ' hdr=1' : ''}${url_option}${relay_option}`
+        // Single round trip authentication: the request is signed, a device without it answers with the AUTH challenge
+        const signed = upload && auth && auth !== true && signed_request
+        if (signed) {
+            request += ` ts=${Date.now()}`
+            request += ` mac=${crypto.createHmac('md5', md5(auth)).update(request).digest('hex')}`
+        }
+        const sock = await connect(`${request}\n`)
         const res_update = sock.readAll()
         if (!res_update) throw new Error(`No Answer from ${host}:${port}`)
         const res_parts = res_update.split(' ')
         // println(res_parts);
-        let response = res_parts.shift() || '' // 'AUTH' or 'OK'
-        while (!['OK', 'AUTH'].includes(response) && res_parts.length) response = res_parts.shift() || ''
+        let response = res_parts.shift() || '' // 'AUTH', 'OK' or 'SAME'
+        while (!['OK', 'AUTH', 'SAME'].includes(response) && res_parts.length) response = res_parts.shift() || ''
         const nonce = response === 'AUTH' ? res_parts.shift() || '' : '' // required for authentication
         const meta = res_parts.join(' ')
         const meta_parts = meta.includes('|/') ? meta.split('|/') : res_parts
@@ -287,6 +885,7 @@
         const dev_platform = meta_parts.shift() || '' // device platform (e.g. "ESP8266" or "STM32F4")
         const dev_board = meta_parts.shift() || '' // device board (e.g. "NodeMCU 1.0" or "XTP14A6E")
         const dev_version = meta_parts.shift() || '' // device version (e.g. "0.0.1")
+        const dev_hash = meta_parts.shift() || '' // MD5 of the running image
         const version = dev_version && dev_version !== '0.0.0' ? dev_version : ''
         const full_name = [
             dev_name,
@@ -321,6 +920,12 @@
                 else println(`${timestamp(ts)}Warning: Target device board ${JSON.stringify(dev_board)} does not match the expected board ${JSON.stringify(device_board)}. Continuing due to [--force].`)
             }
         }
+        if (response === 'SAME') {
+            println(`${timestamp(ts)}Target already runs this image (${dev_hash || file_md5}), nothing to upload. Use [--reflash] to upload anyway.`)
+            sock.end()
+            process.exit(0)
+        }
+        if (response === 'OK' && signed) println(`${timestamp(ts)}Authenticated by the signed request`)
         if (response === 'AUTH') {
             if (!auth || auth === true) throw new Error(`Target requires authentication. Please provide the password with [-a] / [--auth]`)
             const cnonce_text = `${filename}${content_size}${file_md5}${host}`
@@ -343,46 +948,92 @@
             println(' done!')
         } else if (response !== 'OK') {
             throw new Error(`Bad invitation response: ${JSON.stringify(res_update)}`)
+        } else if (header_data || url_option) {
+            await await_part_start(sock) // The device asks for the header, or starts to pull once the slot is erased
         } else {
             await delay(200)
             sock.readAll() // OK, we're good to go. Clean up the socket and start the update.
         }
+        if (header_data) {
+            print(`${timestamp(ts)}Sending the image header...`)
+            await sock.write(header_data)
+            try {
+                await await_part_start(sock)
+            } catch (e) {
+                println(' rejected!')
+                throw e
+            }
+            println(' accepted!')
+        }
         if (test) {
             throw new Error(`${timestamp(ts)}Test successful. Exiting due to [--test].`)
 
         }
-        const upload_start = +new Date
-        let offset = 0
-        let done = false
-        println(`${timestamp(ts)}Uploading ${[...file_content.subarray(0, 16)].map(x => x.toString(16).toLocaleUpperCase().padStart(2, '0')).join(' ')}...`)
-        println(`${timestamp(ts)}Total:    |<${'-'.repeat(total_bars - 2)}>| ${content_size} bytes`)
+        // Pick the chunk size: explicit [--chunk], then the cached autotune result for this device or board, then the default
+        const tune_keys = [dev_name && `name:${dev_name}`, dev_board && `board:${dev_board}`, `host:${host}`].filter(Boolean)
+        const tune_cache = autotune_load()
+        const cached_key = tune_keys.find(key => tune_cache[key] && tune_cache[key].chunk)
+        const cached_chunk = cached_key ? +tune_cache[cached_key].chunk : 0
+        let tuner = null
+        if (!chunk_arg && autotune) {
+            // Start from scratch, or refine around the cached optimum
+            const i = CHUNK_CANDIDATES.indexOf(cached_chunk)
+            const candidates = i >= 0 ? CHUNK_CANDIDATES.slice(Math.max(0, i - 1), i + 2) : CHUNK_CANDIDATES
+            tuner = create_tuner(candidates, payload.length * AUTOTUNE_BUDGET)
+        }
+        let chunk_size = chunk_arg || (tuner ? tuner.first() : cached_chunk || CHUNK_SIZE)
+        if (cached_chunk && !chunk_arg && !tuner && !url_option) println(`${timestamp(ts)}Using cached chunk size ${cached_chunk} bytes for ${cached_key}`)
 
-        print(`${timestamp(ts)}Progress: [`)
-        // split file into chunks of size CHUNK_SIZE
-        for (let i = 0, c = 0; i < content_size && !done; i += CHUNK_SIZE) {
-            // Without using the deprecated Buffer.prototype.slice method
-            const size = (Math.min(i + CHUNK_SIZE, content_size) - i)
-            const chunk = file_content.subarray(i, i + CHUNK_SIZE)
-            await sock.write(chunk)
-            await sock.doAwait()
-            const response = sock.readAll()
-            if (response) {
-                if (response.includes('OK')) done = true
-                else {
-                    const expected = `${size}`
-                    if (expected !== response) throw new Error(`Bad response: ${JSON.stringify(response)} (expected: ${JSON.stringify(expected)})`)
+        const bucket = rate ? create_bucket(rate) : null
+        const payloads = url_option ? [] : parts.length ? parts.map(part => part.data) : [payload]
+        const part_names = { [FLASH]: 'Flash', [SPIFFS]: 'SPIFFS', [CONFIG]: 'Config' }
+        let next_ready = false
+        for (let part = 0; part < payloads.length; part++) {
+            const payload = payloads[part]
+            const payload_size = payload.length
+            if (part > 0 && !next_ready) await await_part_start(sock)
+            next_ready = false
+            if (parts.length) println(`${timestamp(ts)}Part ${part + 1} of ${parts.length}: ${part_names[parts[part].cmd]}`)
+            const upload_start = +new Date
+            let offset = 0
+            let done = false
+            println(`${timestamp(ts)}Uploading ${[...payload.subarray(0, 16)].map(x => x.toString(16).toLocaleUpperCase().padStart(2, '0')).join(' ')}...`)
+            println(`${timestamp(ts)}Total:    |<${'-'.repeat(total_bars - 2)}>| ${payload_size} bytes`)
+
+            print(`${timestamp(ts)}Progress: [`)
+            // split file into chunks of size chunk_size
+            for (let c = 0; offset < payload_size && !done;) {
+                // Without using the deprecated Buffer.prototype.slice method
+                const size = Math.min(chunk_size, payload_size - offset)
+                const chunk = payload.subarray(offset, offset + size)
+                if (bucket) await bucket.take(size)
+                const sent_at = process.hrtime.bigint()
+                await sock.write(chunk)
+                const response = await await_ack(sock, size)
+                if (response.includes('ERR')) throw new Error(`Bad response: ${JSON.stringify(response)}`)
+                if (response.includes('OK')) {
+                    // Final OK, or the start of the next part arriving together with the last ack
+                    done = true
+                    next_ready = part < payloads.length - 1
+                }
+                if (tuner) chunk_size = tuner.next(size, Number(process.hrtime.bigint() - sent_at) / 1e6)
+                offset += chunk.length
+                const progress = offset / payload_size
+                const p = Math.floor(progress * total_bars)
+                if (p !== c) {
+                    c = p
+                    print('=')
                 }
             }
-            offset += chunk.length
-            const progress = offset / content_size
-            const p = Math.floor(progress * total_bars)
-            if (p !== c) {
-                c = p
-                print('=')
-            }
+            const upload_duration = ((+new Date - upload_start) / 1000).toFixed(2)
+            println(`] ${upload_duration} seconds`)
+        }
+        if (url_option) await await_pull(sock, content_size)
+        const tuned = tuner && tuner.result()
+        if (tuned) {
+            println(`${timestamp(ts)}Autotune: chunk size ${tuned.chunk} bytes (${(tuned.goodput / 1024).toFixed(1)} kB/s)`)
+            autotune_save(tune_keys, tuned)
         }
-        const upload_duration = ((+new Date - upload_start) / 1000).toFixed(2)
-        println(`] ${upload_duration} seconds`)
         await verify(sock)
         const reply = sock.readAll()
         if (!reply.includes('OK')) throw new Error(`Problem while uploading: ${JSON.stringify(reply)}`)